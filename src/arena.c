@@ -0,0 +1,34 @@
+#include <stdlib.h>
+#include <stdalign.h>
+
+#include "./arena.h"
+
+bool arena_init(Arena *const arena, size_t const capacity) {
+    *arena = (Arena) {
+        .base = malloc(capacity),
+        .capacity = capacity,
+        .used = 0,
+        .high_water = 0,
+    };
+    return arena->base != NULL;
+}
+
+void arena_close(Arena *const arena) {
+    free(arena->base);
+    *arena = (Arena) {0};
+}
+
+void *arena_alloc(Arena *const arena, size_t const size) {
+    size_t const align = alignof (max_align_t);
+    size_t const start = (arena->used + align - 1) & ~(align - 1);
+    if (start > arena->capacity || size > arena->capacity - start)
+        return NULL;
+
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+void arena_reset(Arena *const arena) {
+    if (arena->used > arena->high_water) arena->high_water = arena->used;
+    arena->used = 0;
+}
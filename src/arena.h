@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Linear allocator for memory that only lives until the next reset, e.g. for one frame.
+// Allocating bumps a pointer and nothing is freed individually, resetting frees everything at once.
+typedef struct {
+    uint8_t *base;
+    size_t capacity;   // bytes
+    size_t used;       // bytes since the last reset
+    size_t high_water; // most bytes used between two resets
+} Arena;
+
+bool arena_init(Arena *arena, size_t capacity);
+void arena_close(Arena *arena);
+
+// Returns NULL if the arena is full.
+// The memory is aligned for any type and stays valid until the next reset.
+void *arena_alloc(Arena *arena, size_t size);
+
+void arena_reset(Arena *arena);
@@ -0,0 +1,458 @@
+// Microbenchmarks for the server's hot paths.
+// Built as one translation unit with net.c, so its static functions can be timed directly.
+//
+// Usage: bench [--json <file>] [--label <text>] [filter]
+// Only benchmarks whose name contains `filter` run.
+// With `--json` every result is also appended to `file` as one JSON object per line, tagged with `label`.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <time.h>
+#endif
+
+// Every allocation in net.c, pool.c and cookie.c goes through these.
+static long allocations = 0;
+
+static void *bench_malloc(size_t const size) {
+    allocations++;
+    return malloc(size);
+}
+
+static void *bench_calloc(size_t const count, size_t const size) {
+    allocations++;
+    return calloc(count, size);
+}
+
+#ifdef __linux__
+static void *bench_aligned_alloc(size_t const alignment, size_t const size) {
+    allocations++;
+    return aligned_alloc(alignment, size);
+}
+#define aligned_alloc(alignment, size) bench_aligned_alloc(alignment, size)
+#endif
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+
+#include "./net.c"
+#include "./pool.c"
+#include "./cookie.c"
+#include "./codec.c"
+#include "./trace.c"
+#include "./replay.c"
+#include "./lockstep.c"
+#include "./entities.c"
+
+#undef malloc
+#undef calloc
+#undef aligned_alloc
+
+#define MIN_RUN_NS (200000000LL) // each benchmark doubles its op count until a run takes this long
+#define MAX_OPS (1 << 24)
+#define SINKS (16)
+#define SINK_PORT (47000)
+#define BENCH_PORT (46999)
+
+static int const player_counts[] = {10, 100, 1000, 10000, UINT16_MAX};
+
+/* Clocks */
+
+#ifdef __linux__
+static long long clock_ns(clockid_t const id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long wall_ns(void) { return clock_ns(CLOCK_MONOTONIC); }
+static long long cpu_ns(void)  { return clock_ns(CLOCK_PROCESS_CPUTIME_ID); }
+
+static void real_sleep_ms(long const ms) {
+    struct timespec const ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+#endif
+
+#ifdef _WIN64
+static long long wall_ns(void) {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (long long) ((double) counter.QuadPart * 1e9 / (double) frequency.QuadPart);
+}
+
+static long long cpu_ns(void) {
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    ULARGE_INTEGER k = {.LowPart = kernel.dwLowDateTime, .HighPart = kernel.dwHighDateTime};
+    ULARGE_INTEGER u = {.LowPart = user.dwLowDateTime, .HighPart = user.dwHighDateTime};
+    return (long long) (k.QuadPart + u.QuadPart) * 100;
+}
+
+static void real_sleep_ms(long const ms) {
+    Sleep((DWORD) ms);
+}
+#endif
+
+// The server reads time through this, so rate limits and timeouts see whatever time the benchmark needs.
+static long bench_now = 1000000; // milliseconds
+
+static void *bench_spawned(void) { return NULL; }
+static void bench_thread(void *const thread) { (void) thread; }
+
+static bool bench_sleep_ms(long const ms) {
+    real_sleep_ms(ms);
+    return true;
+}
+
+static bool bench_get_monotonic(long *const millis) {
+    *millis = bench_now;
+    return true;
+}
+
+static Scheduler const bench_clock = {
+    .spawned = bench_spawned,
+    .started = bench_thread,
+    .finished = bench_thread,
+    .joining = bench_thread,
+    .sleep_ms = bench_sleep_ms,
+    .get_monotonic = bench_get_monotonic,
+};
+
+/* A transport that drops everything, so a tick is timed without the kernel */
+
+static char *null_get_error(void) { return "null transport"; }
+static bool null_init_udp(Socket *const s) { s->socket = 0; return true; }
+static bool null_close(Socket const s) { return true; }
+static bool null_bind(Socket const s, Address *const addr) { return true; }
+static bool null_sendto_inet(Socket const s, void const *const buf, int const len, Address const *const dest) { return true; }
+static bool null_recvfrom_inet(Socket const s, void *const buf, int const len, int *const read, Address *const src) { return false; }
+
+static bool null_poll(Socket const s, short const ev_req, short *const ev_ret, int const timeout) {
+    *ev_ret = ev_req & POLLOUT;
+    if (*ev_ret == 0 && timeout > 0) real_sleep_ms(timeout);
+    return true;
+}
+
+static SocketTransport const null_transport = {
+    .get_error = null_get_error,
+    .init_udp = null_init_udp,
+    .close = null_close,
+    .bind = null_bind,
+    .sendto_inet = null_sendto_inet,
+    .recvfrom_inet = null_recvfrom_inet,
+    .poll = null_poll,
+};
+
+/* Running and reporting */
+
+typedef struct {
+    Server *server;
+    int players;
+    PacketBuffer *buf;
+    C2SPacket *packets; // one POSITION packet per client, encoded
+    int packet_len;     // bytes of each of `packets`
+    long spawned;       // `allocations` once the server was spawned and filled
+    long bytes;
+    long sends;
+} Bench;
+
+typedef void bench_t(Bench *bench, long op);
+
+static FILE *json = NULL;
+static char const *label = "";
+static char const *filter = NULL;
+static volatile long sink; // keeps results of pure functions alive
+
+static void run(Bench *const b, char const *const name, bench_t *const fn) {
+    if (filter != NULL && strstr(name, filter) == NULL) return;
+
+    long ops = 1;
+    long long wall, cpu;
+    long allocs;
+    while (true) {
+        b->bytes = 0;
+        b->sends = 0;
+        allocs = allocations;
+        cpu = cpu_ns();
+        wall = wall_ns();
+
+        for (long op = 0; op < ops; op++)
+            fn(b, op);
+
+        wall = wall_ns() - wall;
+        cpu = cpu_ns() - cpu;
+        allocs = allocations - allocs;
+
+        if (wall >= MIN_RUN_NS || ops >= MAX_OPS) break;
+        ops *= 2;
+    }
+
+    printf(
+        "%-20s %7d %10ld %12.1f %12.1f %10.1f %10.3f %10.3f\n",
+        name, b->players, ops,
+        (double) wall / ops, (double) cpu / ops,
+        (double) b->bytes / ops, (double) allocs / ops, (double) b->sends / ops
+    );
+    fflush(stdout);
+
+    if (json != NULL) {
+        fprintf(
+            json,
+            "{\"label\":\"%s\",\"benchmark\":\"%s\",\"players\":%d,\"ops\":%ld,\"ns_per_op\":%.1f,\"cpu_ns_per_op\":%.1f,\"bytes_per_op\":%.1f,\"allocs_per_op\":%.3f,\"sends_per_op\":%.3f}\n",
+            label, name, b->players, ops,
+            (double) wall / ops, (double) cpu / ops,
+            (double) b->bytes / ops, (double) allocs / ops, (double) b->sends / ops
+        );
+        fflush(json);
+    }
+}
+
+// Fills the server with `players` clients that have all joined, each from its own address.
+// Their POSITION packets are encoded like a client's, and one is checked to be applied,
+// so `bench_parse` times the server taking them and not dropping them.
+static void fill(Bench *const b) {
+    Server *const data = b->server;
+    for (int i = 0; i < b->players; i++) {
+        data->clnt_addrs[i] = (Address) {0};
+        data->clnt_addrs[i].sin_family = AF_INET;
+        data->clnt_addrs[i].sin_addr.s_addr = htonl(0x0a000001 + i);
+        data->clnt_addrs[i].sin_port = htons(40000);
+        data->clnt_states[i] = PLAYING;
+        data->clnt_last[i] = bench_now;
+        session_open(data, i);
+        rate_init(&data->clnt_rates[i], data->max_budget, bench_now);
+        data->players[i] = (Player) {.id = i, .pos.x = i, .pos.y = 2 * i};
+
+        b->packets[i] = (C2SPacket) {
+            .tag = POSITION,
+            .p_token = data->clnt_tokens[i],
+            .p_pos.x = i + 1,
+            .p_pos.y = i + 2,
+        };
+        b->packet_len = (int) c2s_encode(&b->packets[i]);
+    }
+    *data->len = b->players;
+
+    server_handle_packet(data, &b->packets[0], b->packet_len, &data->clnt_addrs[0]);
+    if (data->players[0].pos.x != 1 || data->players[0].pos.y != 2)
+        EXIT_PRINT("The server didn't apply an encoded POSITION packet, it is at (%u, %u)", data->players[0].pos.x, data->players[0].pos.y);
+}
+
+// Spreads lookups over the whole table instead of walking it in order.
+static int pick(Bench const *const b, long const op) {
+    return (int) ((op * 7919) % b->players);
+}
+
+/* Benchmarks */
+
+static void bench_serialize(Bench *const b, long const op) {
+    uint16_t const count = b->players < b->server->max_budget ? b->players : b->server->max_budget;
+    b->bytes += server_write_positions(b->server, (S2CPacket *) b->buf->data, (uint16_t) op, bench_now, 0, 0, count);
+}
+
+// POSITION packets from one address are rate limited, so time moves on by a millisecond per packet.
+static void bench_parse(Bench *const b, long const op) {
+    bench_now++;
+    int const i = pick(b, op);
+    server_handle_packet(b->server, &b->packets[i], b->packet_len, &b->server->clnt_addrs[i]);
+    b->bytes += b->packet_len;
+}
+
+static void bench_find_addr(Bench *const b, long const op) {
+    Address const addr = b->server->clnt_addrs[pick(b, op)];
+    sink += server_find_addr(b->server, &addr);
+}
+
+static void bench_find_token(Bench *const b, long const op) {
+    sink += server_find_token(b->server, b->server->clnt_tokens[pick(b, op)]);
+}
+
+static void bench_find_id(Bench *const b, long const op) {
+    sink += server_find_id(b->server, (uint32_t) pick(b, op));
+}
+
+static void bench_sweep(Bench *const b, long const op) {
+    server_sweep(b->server, bench_now);
+    sink += *b->server->len;
+}
+
+// Every client is due and the byte cap is out of the way, so this is the most a tick can cost.
+static void bench_tick(Bench *const b, long const op) {
+    Server *const data = b->server;
+    for (int i = 0; i < b->players; i++) {
+        data->clnt_rates[i].next_send = 0;
+        data->clnt_last[i] = bench_now;
+    }
+
+    size_t next_client = 0;
+    long tokens = LONG_MAX;
+    SendMetrics metrics = {0};
+    server_tick(data, bench_now, &next_client, &tokens, &metrics);
+
+    b->bytes += metrics.bytes;
+    b->sends += metrics.calls;
+}
+
+// With one player the budget is one player, too few to split into even segments, so it must go out unsplit, once a tick.
+static void bench_tick_budget_1(Bench *const b, long const op) {
+    Server *const data = b->server;
+    data->clnt_rates[0].next_send = 0;
+    data->clnt_last[0] = bench_now;
+
+    size_t next_client = 0;
+    long tokens = SEND_BYTES_BURST;
+    SendMetrics metrics = {0};
+    server_tick(data, bench_now, &next_client, &tokens, &metrics);
+    if (metrics.packets != 1)
+        EXIT_PRINT("A tick with a budget of one player sent %ld packets", (long) metrics.packets);
+
+    b->bytes += metrics.bytes;
+    b->sends += metrics.calls;
+}
+
+// One client's snapshot of `players` players in frame-sized segments, queued and flushed to a real socket.
+static void bench_flush(Bench *const b, long const op) {
+    Server *const data = b->server;
+    int const client = (int) (op % SINKS);
+    uint16_t const segment = SEGMENT_PLAYERS & ~1;
+
+    for (int offset = 0; offset < b->players; offset += segment) {
+        uint16_t const n = b->players - offset < segment ? b->players - offset : segment;
+        PacketBuffer *const buf = server_acquire(data, NULL);
+        buf->addr = data->clnt_addrs[client];
+        buf->len = server_write_positions(data, (S2CPacket *) buf->data, (uint16_t) op, bench_now, 0, offset, n);
+        server_queue(data, buf);
+    }
+
+    SendMetrics metrics = {0};
+    server_flush(data, NULL, &metrics);
+
+    b->bytes += metrics.bytes;
+    b->sends += metrics.calls;
+}
+
+static Bench bench_server_new(int const players, Player *const table, _Atomic uint16_t *const len) {
+    *len = 0;
+    Bench b = {
+        .server = net_server_spawn(table, len, players, BENCH_PORT),
+        .players = players,
+        .packets = malloc(players * sizeof (C2SPacket)),
+    };
+    fill(&b);
+    b.buf = pool_acquire(&b.server->pool);
+    b.spawned = allocations;
+    return b;
+}
+
+// Every table is sized for all players at spawn, so nothing after it should allocate however many players there are.
+static void bench_server_close(Bench *const b) {
+    long const allocs = allocations - b->spawned;
+    if (allocs != 0)
+        printf("%ld allocations since spawning the server with %d players\n", allocs, b->players);
+    pool_release(&b->server->pool, b->buf);
+    net_server_close(b->server);
+    free(b->packets);
+}
+
+int main(int const argc, char **const argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = fopen(argv[++i], "a");
+            if (json == NULL)
+                EXIT_PRINT("Failed to open %s", argv[i]);
+        }
+        else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+            label = argv[++i];
+        }
+        else {
+            filter = argv[i];
+        }
+    }
+
+    // Line buffered, so the server's messages and the results appear in order.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    thread_set_scheduler(&bench_clock);
+
+    printf("%-20s %7s %10s %12s %12s %10s %10s %10s\n", "benchmark", "players", "ops", "ns/op", "cpu ns/op", "bytes/op", "allocs/op", "sends/op");
+
+    /* Server hot paths, with sends going nowhere */ {
+        socket_set_transport(&null_transport);
+
+        for (size_t i = 0; i < sizeof player_counts / sizeof *player_counts; i++) {
+            int const players = player_counts[i];
+            Player *const table = malloc(players * sizeof (Player));
+            _Atomic uint16_t len;
+            Bench b = bench_server_new(players, table, &len);
+
+            run(&b, "serialize_positions", bench_serialize);
+            run(&b, "find_client_addr", bench_find_addr);
+            run(&b, "find_client_token", bench_find_token);
+            run(&b, "find_client_id", bench_find_id);
+            run(&b, "sweep", bench_sweep);
+            run(&b, "tick", bench_tick);
+
+            run(&b, "parse_position", bench_parse);
+
+            bench_server_close(&b);
+            free(table);
+        }
+
+        /* A single player, with GSO on whether or not the socket has it */ {
+            Player table[1];
+            _Atomic uint16_t len;
+            Bench b = bench_server_new(1, table, &len);
+            b.server->gso = true;
+            run(&b, "tick_budget_1", bench_tick_budget_1);
+            bench_server_close(&b);
+        }
+
+        socket_set_transport(NULL);
+    }
+
+    /* Flushing snapshot segments through the kernel, with and without UDP GSO */ {
+        Socket sinks[SINKS];
+        for (int i = 0; i < SINKS; i++) {
+            Address addr = {0};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(SINK_PORT + i);
+            if (!socket_init_udp(&sinks[i]) || !socket_bind(sinks[i], &addr))
+                EXIT_PRINT("Failed to open sink socket: %s", sockets_get_error());
+        }
+
+        int const players = 1000;
+        Player *const table = malloc(players * sizeof (Player));
+        _Atomic uint16_t len;
+        Bench b = bench_server_new(players, table, &len);
+        for (int i = 0; i < SINKS; i++) {
+            b.server->clnt_addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            b.server->clnt_addrs[i].sin_port = htons(SINK_PORT + i);
+        }
+
+        bool const gso = b.server->gso;
+        b.server->gso = false;
+        run(&b, "flush_sendto", bench_flush);
+        if (gso) {
+            b.server->gso = true;
+            run(&b, "flush_gso", bench_flush);
+        }
+        else {
+            printf("flush_gso skipped, UDP segmentation offload is unavailable\n");
+        }
+
+        bench_server_close(&b);
+        free(table);
+
+        for (int i = 0; i < SINKS; i++)
+            socket_close(sinks[i]);
+    }
+
+    thread_set_scheduler(NULL);
+    if (json != NULL) fclose(json);
+    return 0;
+}
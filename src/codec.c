@@ -0,0 +1,51 @@
+#include "./codec.h"
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+void codec_swap_words(uint32_t *const dst, uint32_t const *const src, size_t const count) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    if (dst != src) memcpy(dst, src, count * sizeof (uint32_t));
+#else
+    size_t i = 0;
+
+    // Each vector is loaded before it is stored, so converting in place is fine.
+#if defined(__AVX2__)
+    __m256i const reverse = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+    );
+    for (; i + 8 <= count; i += 8) {
+        __m256i const words = _mm256_loadu_si256((__m256i const *) (src + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(words, reverse));
+    }
+#elif defined(__SSSE3__)
+    __m128i const reverse = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 4 <= count; i += 4) {
+        __m128i const words = _mm_loadu_si128((__m128i const *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(words, reverse));
+    }
+#elif defined(__SSE2__)
+    // Without a byte shuffle: swap the halves of each word, then the bytes of each half.
+    for (; i + 4 <= count; i += 4) {
+        __m128i words = _mm_loadu_si128((__m128i const *) (src + i));
+        words = _mm_shufflehi_epi16(_mm_shufflelo_epi16(words, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+        words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+        _mm_storeu_si128((__m128i *) (dst + i), words);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4) {
+        uint8x16_t const words = vld1q_u8((uint8_t const *) (src + i));
+        vst1q_u8((uint8_t *) (dst + i), vrev32q_u8(words));
+    }
+#endif
+
+    for (; i < count; i++)
+        dst[i] = __builtin_bswap32(src[i]);
+#endif
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#include "./player.h"
+
+// Building blocks of the packet codecs in net.c.
+// Every packet lists its fields once as `F(name, kind)` and its trailing array, if any, as `A(name, kind, count)`.
+// The packet structs, their tags, sizes, encoders, decoders and bounds checks are all expanded from those lists,
+// so nothing about a packet's layout is written down twice.
+// On the wire every field is in network byte order, at the offset it has in the struct.
+
+// The type of a field of each kind. An array of a kind without a byte order, like `U8`, can be a field too.
+#define CODEC_TYPE_U8     uint8_t
+#define CODEC_TYPE_U16    uint16_t
+#define CODEC_TYPE_U32    uint32_t
+#define CODEC_TYPE_COOKIE uint64_t // opaque, only ever echoed, so never byte swapped
+#define CODEC_TYPE_POINT  point
+#define CODEC_TYPE_PLAYER Player
+
+// Reverses the byte order of a field of each kind where it is, from host to network order or back.
+#define CODEC_SWAP_U8(field)
+#define CODEC_SWAP_U16(field)    (field) = codec_swap16(field);
+#define CODEC_SWAP_U32(field)    (field) = codec_swap32(field);
+#define CODEC_SWAP_COOKIE(field)
+#define CODEC_SWAP_POINT(field)  CODEC_SWAP_U32((field).x) CODEC_SWAP_U32((field).y)
+#define CODEC_SWAP_PLAYER(field) CODEC_SWAP_U32((field).id) CODEC_SWAP_POINT((field).pos)
+
+// Copies `count` elements of each kind from `src` to `dst` converting them, `src` may be `dst` to convert in place.
+#define CODEC_CONVERT_U8(dst, src, count)     { if ((void const *) (dst) != (void const *) (src)) memcpy(dst, src, count); }
+#define CODEC_CONVERT_PLAYER(dst, src, count) codec_swap_words((uint32_t *) (dst), (uint32_t const *) (src), (size_t) (count) * (sizeof (Player) / sizeof (uint32_t)));
+
+static_assert(sizeof (Player) % sizeof (uint32_t) == 0, "Players are converted as a run of 32-bit words");
+
+// Declarations of the fields and the trailing array of a packet struct.
+#define CODEC_DECLARE(name, kind)              CODEC_TYPE_##kind name;
+#define CODEC_DECLARE_ARRAY(name, kind, count) CODEC_TYPE_##kind name[];
+
+#define CODEC_TAG(tag) tag,
+
+static inline uint16_t codec_swap16(uint16_t const value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return value;
+#else
+    return __builtin_bswap16(value);
+#endif
+}
+
+static inline uint32_t codec_swap32(uint32_t const value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return value;
+#else
+    return __builtin_bswap32(value);
+#endif
+}
+
+// Copies `count` 32-bit words from `src` to `dst`, reversing the bytes of each on little-endian machines.
+// `dst` is either `src` or doesn't overlap it. Vectorized with whatever SIMD the build targets.
+void codec_swap_words(uint32_t *dst, uint32_t const *src, size_t count);
@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./cookie.h"
+#include "./util.h"
+#include "./os/random.h"
+
+#define ROTL(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+}
+
+static uint64_t load_le64(uint8_t const *const p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+// SipHash-2-4 with a 128-bit key.
+static uint64_t siphash(uint8_t const key[16], uint8_t const *const msg, size_t const len) {
+    uint64_t const k0 = load_le64(key);
+    uint64_t const k1 = load_le64(key + 8);
+
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t const tail = len & 7;
+    for (size_t i = 0; i < len - tail; i += 8) {
+        uint64_t const m = load_le64(msg + i);
+        v3 ^= m;
+        SIPROUND SIPROUND
+        v0 ^= m;
+    }
+
+    uint64_t b = (uint64_t) len << 56;
+    for (size_t i = 0; i < tail; i++)
+        b |= (uint64_t) msg[len - tail + i] << (8 * i);
+
+    v3 ^= b;
+    SIPROUND SIPROUND
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND SIPROUND SIPROUND SIPROUND
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void new_secret(uint8_t secret[16]) {
+    if (!random_fill(secret, 16))
+        EXIT_PRINT("Failed to generate cookie secret: %s", random_get_error());
+}
+
+static void rotate(CookieJar *const jar, long const now) {
+    long const epoch = now / COOKIE_ROTATE;
+    if (epoch == jar->epoch) return;
+
+    if (epoch == jar->epoch + 1)
+        memcpy(jar->secrets[1], jar->secrets[0], 16);
+    else
+        new_secret(jar->secrets[1]);
+    new_secret(jar->secrets[0]);
+
+    jar->epoch = epoch;
+}
+
+static uint64_t hash_address(uint8_t const secret[16], Address const *const address) {
+    uint8_t msg[6];
+    memcpy(msg, &address->sin_addr.s_addr, 4);
+    memcpy(msg + 4, &address->sin_port, 2);
+    return siphash(secret, msg, sizeof msg);
+}
+
+void cookie_jar_init(CookieJar *const jar, long const now) {
+    new_secret(jar->secrets[0]);
+    new_secret(jar->secrets[1]);
+    jar->epoch = now / COOKIE_ROTATE;
+}
+
+uint64_t cookie_make(CookieJar *const jar, Address const *const address, long const now) {
+    rotate(jar, now);
+    return hash_address(jar->secrets[0], address);
+}
+
+bool cookie_check(CookieJar *const jar, Address const *const address, uint64_t const cookie, long const now) {
+    rotate(jar, now);
+    // Both are always computed so the check takes the same time whichever secret matches.
+    uint64_t const current  = hash_address(jar->secrets[0], address);
+    uint64_t const previous = hash_address(jar->secrets[1], address);
+    return (current == cookie) | (previous == cookie);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "./os/sockets.h"
+
+#define COOKIE_ROTATE (10000) // milliseconds
+
+// Stateless connection cookies.
+// A cookie is a keyed hash (SipHash-2-4) of the client address under a secret that rotates every `COOKIE_ROTATE`.
+// Cookies made under the current or the previous secret are accepted,
+// so a cookie stays valid for at least one full rotation period.
+typedef struct {
+    uint8_t secrets[2][16]; // current, previous
+    long epoch;
+} CookieJar;
+
+void cookie_jar_init(CookieJar *jar, long now);
+
+uint64_t cookie_make(CookieJar *jar, Address const *address, long now);
+bool cookie_check(CookieJar *jar, Address const *address, uint64_t cookie, long now);
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+
+#include "./entities.h"
+
+#define INDEX_MASK (ENTITY_INDEX - 1)
+
+// Fibonacci hashing, ids are handed out in order so their low bits alone would cluster.
+static uint32_t index_home(uint32_t const id) {
+    return (id * 2654435761u) >> (32 - ENTITY_INDEX_BITS);
+}
+
+// Returns the slot of the index holding this id, or the empty one where it would go.
+static uint32_t index_probe(EntityStore const *const store, uint32_t const id) {
+    uint32_t slot = index_home(id);
+    while (store->index[slot] != 0 && store->players[store->index[slot] - 1].id != id)
+        slot = (slot + 1) & INDEX_MASK;
+    return slot;
+}
+
+// Empties a slot of the index, moving later entries of the same run back so every probe still finds them.
+static void index_remove(EntityStore *const store, uint32_t const slot) {
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & INDEX_MASK; store->index[next] != 0; next = (next + 1) & INDEX_MASK) {
+        uint32_t const home = index_home(store->players[store->index[next] - 1].id);
+        // An entry can only move back as far as its home slot.
+        if (((next - home) & INDEX_MASK) >= ((next - hole) & INDEX_MASK)) {
+            store->index[hole] = store->index[next];
+            hole = next;
+        }
+    }
+    store->index[hole] = 0;
+}
+
+// Removes the player at `place`, the last one takes its place.
+static void store_despawn(EntityStore *const store, uint32_t const place) {
+    index_remove(store, index_probe(store, store->players[place].id));
+
+    uint32_t const last = store->len - 1;
+    if (place != last) {
+        store->players[place] = store->players[last];
+        store->seqs[place] = store->seqs[last];
+        store->seen[place] = store->seen[last];
+        store->index[index_probe(store, store->players[place].id)] = place + 1;
+    }
+    store->len = last;
+}
+
+// Despawns whoever has been missing for too many passes and starts the next one.
+static void store_end_pass(EntityStore *const store) {
+    for (uint32_t i = 0; i < store->len;) {
+        if (store->pass - store->seen[i] >= ENTITY_DESPAWN_PASSES) store_despawn(store, i);
+        else i++;
+    }
+    store->pass++;
+}
+
+static void store_apply(EntityStore *const store, EntityUpdate const *const update) {
+    if (update->ends_pass) {
+        store_end_pass(store);
+        return;
+    }
+
+    uint32_t const slot = index_probe(store, update->player.id);
+    uint32_t place = store->index[slot];
+    if (place == 0) {
+        if (store->len == ENTITY_CAPACITY) return;
+        place = ++store->len;
+        store->index[slot] = place;
+    }
+    else if ((int16_t) (update->seq - store->seqs[place - 1]) < 0) {
+        return; // reordered, the player has been updated by a newer packet already
+    }
+
+    store->players[place - 1] = update->player;
+    store->seqs[place - 1] = update->seq;
+    store->seen[place - 1] = store->pass;
+}
+
+// Allocated zeroed, so only the pages of the players and index slots actually used ever get touched.
+static bool store_init(EntityStore *const store) {
+    *store = (EntityStore) {
+        .players = calloc(ENTITY_CAPACITY, sizeof (Player)),
+        .seqs = calloc(ENTITY_CAPACITY, sizeof (uint16_t)),
+        .seen = calloc(ENTITY_CAPACITY, sizeof (uint32_t)),
+        .index = calloc(ENTITY_INDEX, sizeof (uint32_t)),
+    };
+    return store->players != NULL && store->seqs != NULL && store->seen != NULL && store->index != NULL;
+}
+
+static void store_close(EntityStore *const store) {
+    free(store->players);
+    free(store->seqs);
+    free(store->seen);
+    free(store->index);
+}
+
+bool entities_init(EntityTable *const table) {
+    atomic_init(&table->front, 0);
+    atomic_init(&table->reading, 0);
+    table->logged = 0;
+    table->applied[0] = 0;
+    table->applied[1] = 0;
+    table->log = malloc(ENTITY_LOG * sizeof (EntityUpdate));
+
+    bool const first = store_init(&table->copies[0]);
+    bool const second = store_init(&table->copies[1]);
+    return first && second && table->log != NULL;
+}
+
+void entities_close(EntityTable *const table) {
+    store_close(&table->copies[0]);
+    store_close(&table->copies[1]);
+    free(table->log);
+}
+
+// Applies every update the copy doesn't have yet.
+static void table_catch_up(EntityTable *const table, uint8_t const copy) {
+    for (; table->applied[copy] < table->logged; table->applied[copy]++)
+        store_apply(&table->copies[copy], &table->log[table->applied[copy] & (ENTITY_LOG - 1)]);
+}
+
+bool entities_update(EntityTable *const table, Player const *const players, uint16_t const count, uint16_t const seq, bool const ends_pass) {
+    uint8_t const back = !atomic_load(&table->front);
+
+    // The reader only ever takes the published copy, so the other one stays free until it is published, if it is free now.
+    // Otherwise the reader still holds what was published the time before, and the updates reach it once it lets go.
+    bool const held = atomic_load(&table->reading) == back + 1;
+    if (!held) table_catch_up(table, back);
+
+    // The log keeps every update the unpublished copy doesn't have, it is the one further behind.
+    if (table->logged + count + ends_pass - table->applied[back] > ENTITY_LOG) return false;
+
+    for (uint16_t i = 0; i < count; i++)
+        table->log[table->logged++ & (ENTITY_LOG - 1)] = (EntityUpdate) {.player = players[i], .seq = seq};
+    if (ends_pass)
+        table->log[table->logged++ & (ENTITY_LOG - 1)] = (EntityUpdate) {.ends_pass = true};
+
+    if (held) return true;
+
+    table_catch_up(table, back);
+    atomic_store(&table->front, back);
+    return true;
+}
+
+// `reading` is set before `front` is checked again, so a writer either sees the copy as held and leaves it alone,
+// or it is about to write the copy because it already published the other one, and the check fails.
+EntityStore const *entities_acquire(EntityTable *const table) {
+    uint8_t front;
+    do {
+        front = atomic_load(&table->front);
+        atomic_store(&table->reading, front + 1);
+    } while (atomic_load(&table->front) != front);
+    return &table->copies[front];
+}
+
+void entities_release(EntityTable *const table) {
+    atomic_store(&table->reading, 0);
+}
+
+int32_t entities_find(EntityStore const *const store, uint32_t const id) {
+    uint32_t const place = store->index[index_probe(store, id)];
+    return (int32_t) place - 1;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "./player.h"
+
+// The client's copy of the world: every player the server told it about, by id.
+// The server sends its players in POSITIONS packets, all of them at once or in chunks that take turns,
+// and every packet is applied as a delta: players not seen before spawn, the rest move.
+// A player that was missing from `ENTITY_DESPAWN_PASSES` passes over the server's players in a row is despawned,
+// so a lost chunk or a player the server moved to a chunk already sent doesn't make it blink.
+
+#define ENTITY_CAPACITY (UINT16_MAX)  // players, as many as a server can have
+#define ENTITY_INDEX_BITS (17)        // the id index has twice as many slots as there can be players
+#define ENTITY_INDEX (1 << ENTITY_INDEX_BITS)
+#define ENTITY_DESPAWN_PASSES (2)
+#define ENTITY_LOG (16384)            // updates held for the copy being read, a few of the largest POSITIONS packets, power of two
+
+// One copy of the players, the part the game reads.
+// `players` is dense, in no particular order, and `index` maps ids to places in it.
+typedef struct {
+    Player *players;   // `len` in use, `ENTITY_CAPACITY` entries
+    uint32_t len;
+    uint16_t *seqs;    // POSITIONS sequence number each player was last updated by, older updates are ignored
+    uint32_t *seen;    // pass each player was last updated in
+    uint32_t pass;     // passes completed
+    uint32_t *index;   // place in `players` plus one by id, 0 for empty, linear probing, `ENTITY_INDEX` entries
+} EntityStore;
+
+// An update, as logged for the copy that couldn't take it yet.
+typedef struct {
+    Player player;
+    uint16_t seq;
+    bool ends_pass; // the last update of a pass, `player` and `seq` are unused
+} EntityUpdate;
+
+// Two copies of the players, written by one thread and read by another without either waiting.
+// The writer only ever changes the copy that isn't published, then publishes it,
+// and catches the other copy up from `log` once the reader has let go of it.
+// So the reader gets a consistent copy for as long as it holds it, and nothing is copied in full.
+typedef struct {
+    EntityStore copies[2];
+    _Atomic uint8_t front;   // the published copy, the one the reader acquires
+    _Atomic uint8_t reading; // copy the reader holds, plus one, 0 if none
+    EntityUpdate *log;       // `ENTITY_LOG` entries, by update number
+    uint64_t logged;         // updates made
+    uint64_t applied[2];     // updates each copy has, the one published has all of them
+} EntityTable;
+
+bool entities_init(EntityTable *table);
+void entities_close(EntityTable *table);
+
+// Applies `count` players of one POSITIONS packet, or drops them if the copy being read is too far behind to catch up.
+// While the reader holds the copy published before, they are only logged, and published with the next update after it lets go.
+// `ends_pass` is whether the packet reaches the end of the server's players, which is when despawns are decided.
+// Only ever called by the one writing thread.
+bool entities_update(EntityTable *table, Player const *players, uint16_t count, uint16_t seq, bool ends_pass);
+
+// Returns the published copy, which stays as it is until `entities_release`.
+// Only ever called by the one reading thread, at most once before releasing it.
+EntityStore const *entities_acquire(EntityTable *table);
+void entities_release(EntityTable *table);
+
+// Returns where the player with this id is in `store->players`, or -1.
+int32_t entities_find(EntityStore const *store, uint32_t id);
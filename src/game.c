@@ -4,14 +4,48 @@
 #include <stdint.h>
 
 #include "raylib.h"
+#include "rlgl.h"
 
 #include "./game.h"
 #include "./net.h"
+#include "./trace.h"
+#include "./profile.h"
+#include "./arena.h"
+#include "./textcache.h"
+#include "./replay.h"
+#include "./lockstep.h"
 #include "./util.h"
 
+#define FRAME_ARENA_SIZE (64 * 1024) // bytes
+#define PLAYER_SIZE (10)             // pixels
+#define PANEL_X (190)                // pixels
+#define PANEL_Y (260)                // pixels
+#define PANEL_LINE (20)              // pixels per line of the player panel
+#define BATCH_QUADS (1024)           // quads per `rlBegin`, well within one render batch
+#define SIM_RATE (LOCKSTEP_RATE)     // simulation steps per second, one input each in lockstep mode
+#define SIM_MAX_STEPS (8)            // per frame, after a longer hitch the simulation drops time instead of catching up
+#define SIM_LOCKSTEP_FRAMES (2)      // lockstep frames simulated per step at most, so a backlog drains without a jump
+#define DEFAULT_MAX_PLAYERS (10)     // hosted, see `max_players_setting`
+#define TIMELINE_MARGIN (20)         // pixels between the replay timeline and the window edges
+#define TIMELINE_HEIGHT (10)         // pixels
+
+// Kinds of cached text, see `TEXT_KEY`
+enum {
+    TEXT_MENU,     // by menu entry
+    TEXT_POSITION, // by player id
+    TEXT_ID,
+    TEXT_PANEL,
+    LABEL_HEADING,
+    LABEL_ROLE,    // by whether hosting
+    LABEL_PORT,    // by port
+    TEXT_REPLAY,
+    LABEL_REPLAY_HELP,
+};
+
 typedef enum {
     TITLE_SCREEN,
     GAME_SCREEN,
+    REPLAY_SCREEN,
 } Screen;
 
 struct State {
@@ -25,34 +59,90 @@ struct State {
             union {
                 struct { // Server
                     Server *gss_server;
-                    uint16_t gss_player_count;
+                    _Atomic uint16_t gss_player_count; // changed by the server's threads
                     Player *gss_players;
+                    uint16_t gss_panel_first; // first player shown in the player panel
                 };
                 struct { // Client
                     Client *gsc_client;
                     Player gsc_player;
+                    point gsc_prev_pos; // position before the last step, drawn positions are blended from it
+                    uint8_t gsc_held;   // `INPUT_*` keys down this frame, applied to every step
+                    uint8_t gsc_tapped; // `INPUT_*` keys pressed since the last step, applied once
+                    uint32_t gsc_trace; // trace id of a key press for the next step, 0 if none
+                    bool gsc_lockstep;  // the server relays inputs, every player is simulated from them
+                    Player *gsc_players; // in lockstep mode, `LOCKSTEP_MAX_PLAYERS` entries
+                    uint16_t gsc_player_count;
                 };
             };
             //char *gs_ip; Uses localhost for now
             uint16_t gs_net_port;
         };
+        struct { // Replay Screen
+            ReplayReader *rs_replay;
+            Player *rs_players;       // as of `rs_tick`, `rs_replay->max_players` entries
+            uint16_t rs_player_count;
+            uint32_t rs_tick;
+            uint32_t rs_time;         // milliseconds since the first tick
+            float rs_position;        // ticks, moves on with the frame time while playing
+            bool rs_paused;
+        };
     };
-    uint32_t frames;
+    uint32_t frames;       // simulation steps, not rendered frames
+    float sim_accumulator; // seconds not yet simulated
     int screen_width;
     int screen_height;
+    uint16_t max_players; // hosted, set at startup, every table of a match is sized for it up front
+    NetApi const *net; // swapped for a rebuilt net.so's while hot reloading
+    Arena frame_arena; // reset every frame
+    TextCache texts;
 };
 
+// Setting GAME_MAX_PLAYERS=<n> hosts matches of up to `n` players, as many as the protocol's 16-bit counts allow.
+static uint16_t max_players_setting(void) {
+    char const *const setting = getenv("GAME_MAX_PLAYERS");
+    if (setting == NULL) return DEFAULT_MAX_PLAYERS;
+
+    long const max = strtol(setting, NULL, 10);
+    if (max < 1 || max > UINT16_MAX) {
+        printf("GAME_MAX_PLAYERS must be from 1 to %d, hosting up to %d players\n", UINT16_MAX, DEFAULT_MAX_PLAYERS);
+        return DEFAULT_MAX_PLAYERS;
+    }
+    return (uint16_t) max;
+}
+
 Gamestate *game_init() {
     Gamestate *const state = malloc(sizeof (Gamestate));
     *state = (Gamestate) {
         TITLE_SCREEN,
         .ts_selected = 0,
         .frames = 0,
+        .sim_accumulator = 0.0f,
         800, 450,
+        .max_players = max_players_setting(),
+#if (defined(HOTRELOAD) || defined(HOTRELOADING)) && defined(__linux__)
+        .net = NULL, // set by `game_set_net` once net.so is loaded
+#else
+        .net = &net_api,
+#endif
     };
 
+    if (!arena_init(&state->frame_arena, FRAME_ARENA_SIZE))
+        EXIT_PRINT("Failed to allocate frame arena");
+
     InitWindow(state->screen_width, state->screen_height, "Title");
-    SetTargetFPS(60);
+
+    // Frames are paced by the display, the simulation runs at `SIM_RATE` regardless.
+    int const refresh_rate = GetMonitorRefreshRate(GetCurrentMonitor());
+    SetTargetFPS(refresh_rate > 0 ? refresh_rate : 60);
+
+    if (!text_cache_init(&state->texts))
+        EXIT_PRINT("Failed to allocate text cache");
+
+    // Setting GAME_TRACE=<file> records input latency traces, written to the file on close.
+    char const *const trace_file = getenv("GAME_TRACE");
+    if (trace_file != NULL && !trace_start(trace_file))
+        printf("Failed to start tracing\n");
 
     return state;
 }
@@ -69,16 +159,27 @@ void game_close(Gamestate *const state) {
         case GAME_SCREEN: {
             if (state->gs_hosting) {
                 printf("closing game from game screen as server\n");
-                net_server_close(state->gss_server);
+                state->net->server_close(state->gss_server);
                 free(state->gss_players);
             }
             else {
                 printf("closing game from game screen as client\n");
-                net_client_close(state->gsc_client);
+                state->net->client_close(state->gsc_client);
+                free(state->gsc_players);
             }
         } break;
+        case REPLAY_SCREEN: {
+            printf("closing game from replay screen\n");
+            replay_close(state->rs_replay);
+            free(state->rs_replay);
+            free(state->rs_players);
+        } break;
     }
+    printf("frame arena high water: %zu of %zu bytes\n", state->frame_arena.high_water, state->frame_arena.capacity);
+    arena_close(&state->frame_arena);
+    text_cache_close(&state->texts);
     free(state);
+    trace_stop();
     fflush(stdout);
     CloseWindow();
 }
@@ -89,98 +190,221 @@ void game_close(Gamestate *const state) {
 //     state->ts_selected = 0;
 // }
 
-#if defined(HOTRELOADING) && defined(__linux__)
-    #include <dlfcn.h>
-#endif
-
 static void goto_game_screen(Gamestate *const state, bool const hosting) {
-#if defined(HOTRELOADING) && defined(__linux__)
-    net_server_data_new_t *net_server_data_new;
-    net_server_create_t *net_server_create;
-    net_client_data_new_t *net_client_data_new;
-    net_client_create_t *net_client_create;
-    
-    /* load functions from net.so */ {
-        printf("Loading net.so...\n");
-
-        char const *error;
-
-        void *const net_so = dlopen("net.so", RTLD_NOW | RTLD_NODELETE);
-        error = dlerror();
-        if (error != NULL)
-            EXIT_PRINT("Failed to load net.so: %s\n", error);
-
-        if (hosting) {
-            net_server_data_new = dlsym(net_so, "net_server_data_new");
-            error = dlerror();
-            if (error != NULL)
-                EXIT_PRINT("Failed to load net_server_data_new: %s\n", error);
-
-            net_server_create = dlsym(net_so, "net_server_create");
-            error = dlerror();
-            if (error != NULL)
-                EXIT_PRINT("Failed to load net_server_create: %s\n", error);
-        }
-        else {
-            net_client_data_new = dlsym(net_so, "net_client_data_new");
-            error = dlerror();
-            if (error != NULL)
-                EXIT_PRINT("Failed to load net_client_data_new: %s\n", error);
-
-            net_client_create = dlsym(net_so, "net_client_create");
-            error = dlerror();
-            if (error != NULL)
-                EXIT_PRINT("Failed to load net_client_create: %s\n", error);
-        }
-
-        printf("Loaded net.so\n");
-
-        if (dlclose(net_so))
-            EXIT_PRINT("Failed to close net.so: %s\n", dlerror());
-    }
-#endif
-
     state->screen_tag = GAME_SCREEN;
     state->gs_hosting = hosting;
     state->gs_net_port = 1234;
     if (hosting) {
-        state->gss_players = malloc(10 * sizeof (Player));
+        state->gss_players = malloc(state->max_players * sizeof (Player));
         state->gss_player_count = 0;
-        state->gss_server = net_server_spawn(state->gss_players, &state->gss_player_count, 10, state->gs_net_port);
+        state->gss_panel_first = 0;
+        state->gss_server = state->net->server_spawn(state->gss_players, &state->gss_player_count, state->max_players, state->gs_net_port);
     }
     else {
         state->gsc_player.id = 0;
         state->gsc_player.pos.x = 0;
         state->gsc_player.pos.y = 0;
-        state->gsc_client = net_client_spawn(&state->gsc_player, state->gs_net_port);
+        state->gsc_prev_pos = state->gsc_player.pos;
+        state->gsc_held = 0;
+        state->gsc_tapped = 0;
+        state->gsc_trace = 0;
+        state->gsc_lockstep = false;
+        state->gsc_players = malloc(LOCKSTEP_MAX_PLAYERS * sizeof (Player));
+        state->gsc_player_count = 0;
+        state->gsc_client = state->net->client_spawn(&state->gsc_player, state->gs_net_port);
+    }
+}
+
+// Shows the players as of `tick`.
+static void show_replay_tick(Gamestate *const state, uint32_t const tick) {
+    state->rs_tick = tick;
+    if (!replay_seek(state->rs_replay, tick, state->rs_players, &state->rs_player_count, &state->rs_time))
+        state->rs_player_count = 0;
+}
+
+// Setting GAME_REPLAY=<file> picks the replay to watch, a server records one with NET_REPLAY=<file>.
+static void goto_replay_screen(Gamestate *const state) {
+    char const *path = getenv("GAME_REPLAY");
+    if (path == NULL) path = "replay.bin";
+
+    ReplayReader *const replay = malloc(sizeof (ReplayReader));
+    if (!replay_open(replay, path)) {
+        free(replay);
+        return;
+    }
+    if (replay->ticks == 0) {
+        printf("Replay %s has no ticks\n", path);
+        replay_close(replay);
+        free(replay);
+        return;
     }
+
+    state->screen_tag = REPLAY_SCREEN;
+    state->rs_replay = replay;
+    state->rs_players = malloc(replay->max_players * sizeof (Player));
+    state->rs_position = 0.0f;
+    state->rs_paused = false;
+    show_replay_tick(state, 0);
+}
+
+// Memory for the rest of the frame, no need to free it.
+static void *frame_alloc(Arena *const frame, size_t const size) {
+    void *const memory = arena_alloc(frame, size);
+    if (memory == NULL)
+        EXIT_PRINT("Frame arena is out of memory (%zu bytes)", frame->capacity);
+    return memory;
 }
 
 static void update_title_screen(Gamestate *const state) {
     if (IsKeyPressed(KEY_SPACE)) state->frames = 0;
 
     if (IsKeyPressed(KEY_UP)   && state->ts_selected > 0) state->ts_selected--;
-    if (IsKeyPressed(KEY_DOWN) && state->ts_selected < 1) state->ts_selected++;
+    if (IsKeyPressed(KEY_DOWN) && state->ts_selected < 2) state->ts_selected++;
 
     if (IsKeyPressed(KEY_ENTER)) switch (state->ts_selected) {
         case 0: goto_game_screen(state, true); break;
         case 1: goto_game_screen(state, false); break;
+        case 2: goto_replay_screen(state); break;
     }
 }
 
+// Players listed in the panel at once, as many lines as fit below its header.
+static int panel_rows(Gamestate const *const state) {
+    int const rows = (state->screen_height - PANEL_Y) / PANEL_LINE - 1;
+    return rows > 1 ? rows : 1;
+}
+
+// The panel scrolls with the mouse wheel and pages with Page Up and Page Down.
+static void update_player_panel(Gamestate *const state) {
+    int const rows = panel_rows(state);
+    int first = state->gss_panel_first;
+
+    if (IsKeyPressed(KEY_PAGE_DOWN)) first += rows;
+    if (IsKeyPressed(KEY_PAGE_UP))   first -= rows;
+    if (IsKeyPressed(KEY_HOME))      first = 0;
+    if (IsKeyPressed(KEY_END))       first = state->gss_player_count;
+    first -= (int) GetMouseWheelMove() * 3;
+
+    int const last = state->gss_player_count - rows;
+    if (first > last) first = last;
+    if (first < 0) first = 0;
+    state->gss_panel_first = first;
+}
+
+// Runs once per rendered frame, reads input for the steps that follow.
 static void update_game_screen(Gamestate *const state) {
+    if (state->gs_hosting) {
+        update_player_panel(state);
+        return;
+    }
+
+    state->gsc_held = (IsKeyDown(KEY_UP)    ? INPUT_UP    : 0)
+                    | (IsKeyDown(KEY_DOWN)  ? INPUT_DOWN  : 0)
+                    | (IsKeyDown(KEY_LEFT)  ? INPUT_LEFT  : 0)
+                    | (IsKeyDown(KEY_RIGHT) ? INPUT_RIGHT : 0);
+
+    // Latched until a step consumes it, so a tap shorter than a step still moves the player.
+    if (IsKeyPressed(KEY_UP))    state->gsc_tapped |= INPUT_UP;
+    if (IsKeyPressed(KEY_DOWN))  state->gsc_tapped |= INPUT_DOWN;
+    if (IsKeyPressed(KEY_LEFT))  state->gsc_tapped |= INPUT_LEFT;
+    if (IsKeyPressed(KEY_RIGHT)) state->gsc_tapped |= INPUT_RIGHT;
+
+    // Only the press is traced, not every frame the key is held.
+    if (state->gsc_trace == 0 && (IsKeyPressed(KEY_UP) || IsKeyPressed(KEY_DOWN) || IsKeyPressed(KEY_LEFT) || IsKeyPressed(KEY_RIGHT)))
+        state->gsc_trace = trace_begin();
+}
+
+// Space pauses, Left and Right step a tick, Page Up and Page Down skip a keyframe interval,
+// and clicking or dragging on the timeline seeks.
+static void update_replay_screen(Gamestate *const state) {
+    ReplayReader const *const replay = state->rs_replay;
+    float const last = replay->ticks - 1;
+    float position = state->rs_position;
+
+    if (IsKeyPressed(KEY_SPACE)) state->rs_paused = !state->rs_paused;
+    if (IsKeyPressed(KEY_RIGHT)) { position = (uint32_t) position + 1; state->rs_paused = true; }
+    if (IsKeyPressed(KEY_LEFT))  { position = (uint32_t) position - 1.0f; state->rs_paused = true; }
+    if (IsKeyPressed(KEY_PAGE_DOWN)) position += REPLAY_KEYFRAME_TICKS;
+    if (IsKeyPressed(KEY_PAGE_UP))   position -= REPLAY_KEYFRAME_TICKS;
+    if (IsKeyPressed(KEY_HOME))      position = 0;
+    if (IsKeyPressed(KEY_END))       position = last;
+
+    if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+        Vector2 const mouse = GetMousePosition();
+        int const width = state->screen_width - 2 * TIMELINE_MARGIN;
+        int const top = state->screen_height - TIMELINE_MARGIN - TIMELINE_HEIGHT;
+        if (width > 0 && mouse.y >= top - TIMELINE_HEIGHT && mouse.y <= top + 2 * TIMELINE_HEIGHT)
+            position = (mouse.x - TIMELINE_MARGIN) / width * last;
+    }
+
+    if (!state->rs_paused)
+        position += GetFrameTime() * 1000.0f / (replay->tick_interval > 0 ? replay->tick_interval : 1);
+
+    if (position < 0) position = 0;
+    if (position >= last) {
+        position = last;
+        state->rs_paused = true;
+    }
+    state->rs_position = position;
+
+    uint32_t const tick = (uint32_t) position;
+    if (tick != state->rs_tick) show_replay_tick(state, tick);
+}
+
+// Simulates the frames the server relayed in lockstep mode, the own player follows its simulated position.
+static void step_lockstep(Gamestate *const state) {
+    LockstepFrame frame;
+    for (int i = 0; i < SIM_LOCKSTEP_FRAMES && state->net->client_next_frame(state->gsc_client, state->gsc_players, &frame); i++) {
+        state->gsc_lockstep = true;
+        state->gsc_player_count = frame.len;
+        if (!frame.sync)
+            lockstep_step(state->gsc_players, frame.len, frame.inputs);
+        state->net->client_frame_done(state->gsc_client, frame.frame, lockstep_checksum(state->gsc_players, frame.len));
+    }
+
+    if (!state->gsc_lockstep) return;
+
+    for (uint16_t i = 0; i < state->gsc_player_count; i++) {
+        if (state->gsc_players[i].id == state->gsc_player.id)
+            state->gsc_player.pos = state->gsc_players[i].pos;
+    }
+    state->gsc_prev_pos = state->gsc_player.pos;
+}
+
+// Runs `SIM_RATE` times per second however fast frames are rendered.
+static void step_game_screen(Gamestate *const state) {
     if (state->gs_hosting) return;
-    if (IsKeyDown(KEY_UP))    state->gsc_player.pos.y -= 1;
-    if (IsKeyDown(KEY_DOWN))  state->gsc_player.pos.y += 1;
-    if (IsKeyDown(KEY_LEFT))  state->gsc_player.pos.x -= 1;
-    if (IsKeyDown(KEY_RIGHT)) state->gsc_player.pos.x += 1;
+
+    uint8_t const input = state->gsc_held | state->gsc_tapped;
+    state->gsc_tapped = 0;
+
+    // Moved right away, unless the server relays inputs, then it moves once the input comes back in a frame.
+    if (!state->gsc_lockstep) {
+        state->gsc_prev_pos = state->gsc_player.pos;
+        lockstep_move(&state->gsc_player, input);
+    }
+    state->net->client_input(state->gsc_client, input);
+
+    // Handed over once the position or the input includes the press.
+    state->net->client_trace_input(state->gsc_client, state->gsc_trace);
+    state->gsc_trace = 0;
+
+    step_lockstep(state);
 }
 
-static void draw_title_screen(Gamestate const *const state) {
+// Where to draw a simulated point, `alpha` of the way from its previous to its current position.
+static point blend_point(point const prev, point const current, float const alpha) {
+    return (point) {
+        .x = prev.x + (int32_t) ((int32_t) (current.x - prev.x) * alpha),
+        .y = prev.y + (int32_t) ((int32_t) (current.y - prev.y) * alpha),
+    };
+}
+
+static void draw_title_screen(Gamestate const *const state, Arena *const frame, TextCache *const texts) {
     ClearBackground(ColorFromHSV(150, 0.15, 1.0));
 
-    /* draw title */ {
-        char *const str = malloc(100);
+    /* draw title, not cached since it changes every frame */ {
+        char *const str = frame_alloc(frame, 100);
         snprintf(str, 100, "frames: %u", state->frames);
 
         int i = state->frames * 5;
@@ -193,25 +417,13 @@ static void draw_title_screen(Gamestate const *const state) {
         int const posY = i - text_size.y;
 
         DrawText(str, posX, posY, font_size, BLACK);
-        free(str);
     }
 
     /* draw menu */ {
-        char const *const host_str_full = "* Host a game";
-        char const *const host_str = state->ts_selected == 0 ? host_str_full : host_str_full + 2;
-        char const *const join_str_full = "* Join a game";
-        char const *const join_str = state->ts_selected == 1 ? join_str_full : join_str_full + 2;
+        char const *const entries[] = {"* Host a game", "* Join a game", "* Watch a replay"};
 
         int const font_size = 32;
 
-        Vector2 const host_size = MeasureTextEx(GetFontDefault(), host_str, font_size, 0);
-        int const host_x = state->screen_width / 2.0 - host_size.x / 2.0;
-        int const host_y = state->screen_height / 2.0;
-
-        Vector2 const join_size = MeasureTextEx(GetFontDefault(), join_str, font_size, 0);
-        int const join_x = state->screen_width / 2.0 - join_size.x / 2.0;
-        int const join_y = state->screen_height / 2.0 + host_size.y;
-
         uint32_t const speed = 3;
         uint32_t const min = 50 * speed;
         uint32_t const time = state->frames * speed;
@@ -220,50 +432,166 @@ static void draw_title_screen(Gamestate const *const state) {
         else if (time > min + 255) alpha = 255;
         else alpha = time - min;
 
-        DrawText(host_str, host_x, host_y, font_size, (Color) {0, 0, 0, alpha});
-        DrawText(join_str, join_x, join_y, font_size, (Color) {0, 0, 0, alpha});
+        // Each entry is drawn right away, since finding the next one could take over its slot.
+        bool fresh;
+        int y = state->screen_height / 2.0;
+        for (int i = 0; i < (int) (sizeof entries / sizeof *entries); i++) {
+            bool const selected = state->ts_selected == i;
+            TextEntry *const entry = text_cache_find(texts, TEXT_KEY(TEXT_MENU, i), selected, font_size, &fresh);
+            if (!fresh) text_cache_format(entry, "%s", selected ? entries[i] : entries[i] + 2);
+            int const x = state->screen_width / 2.0 - entry->size.x / 2.0;
+            DrawText(entry->text, x, y, font_size, (Color) {0, 0, 0, alpha});
+            y += entry->size.y;
+        }
+    }
+}
+
+// Positions packed into the inputs of a cached text.
+static uint64_t pack_point(point const p) {
+    return (uint64_t) p.x << 32 | p.y;
+}
+
+// Draws every player that is on screen as one run of quads, which raylib sends to the GPU in as few draw calls as its batch allows.
+static void draw_players(Player const *const players, uint16_t const count, int const screen_width, int const screen_height) {
+    // The shapes texture is a white pixel, so the vertex colors come through unchanged.
+    rlSetTexture(GetShapesTexture().id);
+
+    int quads = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        int const x = players[i].pos.x;
+        int const y = players[i].pos.y;
+        if (x + PLAYER_SIZE <= 0 || y + PLAYER_SIZE <= 0 || x >= screen_width || y >= screen_height)
+            continue;
+
+        if (quads == 0) {
+            rlCheckRenderBatchLimit(BATCH_QUADS * 4);
+            rlBegin(RL_QUADS);
+            rlTexCoord2f(0.0f, 0.0f);
+        }
+
+        Color const color = ColorFromHSV(players[i].id / 360.0, 1.0, 1.0);
+        rlColor4ub(color.r, color.g, color.b, color.a);
+        rlVertex2i(x, y);
+        rlVertex2i(x, y + PLAYER_SIZE);
+        rlVertex2i(x + PLAYER_SIZE, y + PLAYER_SIZE);
+        rlVertex2i(x + PLAYER_SIZE, y);
+
+        if (++quads == BATCH_QUADS) {
+            rlEnd();
+            quads = 0;
+        }
     }
+    if (quads > 0) rlEnd();
+
+    rlSetTexture(0);
 }
 
-static void draw_game_screen(Gamestate const *const state) {
+// Lists one page of player positions instead of one line for every player.
+static void draw_player_panel(Gamestate const *const state, TextCache *const texts) {
+    int const rows = panel_rows(state);
+    int const count = state->gss_player_count;
+    int const first = state->gss_panel_first < count ? state->gss_panel_first : 0;
+    int const last = first + rows < count ? first + rows : count;
+    bool fresh;
+
+    TextEntry *const header = text_cache_find(texts, TEXT_KEY(TEXT_PANEL, 0), (uint64_t) first << 32 | (uint64_t) last << 16 | count, PANEL_LINE, &fresh);
+    if (!fresh) text_cache_format(header, "Players %d-%d of %d (Page Up/Down)", count ? first + 1 : 0, last, count);
+    DrawText(header->text, PANEL_X, PANEL_Y, PANEL_LINE, DARKGRAY);
+
+    for (int i = first; i < last; i++) {
+        Player const *const player = &state->gss_players[i];
+        TextEntry *const position = text_cache_find(texts, TEXT_KEY(TEXT_POSITION, player->id), pack_point(player->pos), PANEL_LINE, &fresh);
+        if (!fresh) text_cache_format(position, "X: %d, Y: %d", player->pos.x, player->pos.y);
+        DrawText(position->text, PANEL_X, PANEL_Y + (i - first + 1) * PANEL_LINE, PANEL_LINE, BLACK);
+    }
+}
+
+static void draw_game_screen(Gamestate const *const state, Arena *const frame, TextCache *const texts) {
     ClearBackground(ColorFromHSV(150, 0.15, 1.0));
 
-    DrawText("Some cool text!", 190, 200, 20, BLACK);
+    if (!text_cache_draw_label(texts, TEXT_KEY(LABEL_HEADING, 0), 190, 200))
+        text_cache_bake_label(texts, TEXT_KEY(LABEL_HEADING, 0), "Some cool text!", 190, 200, 20, BLACK);
 
-    if (state->gs_hosting)
-        DrawText("Hosting a game", 190, 220, 20, BLACK);
-    else
-        DrawText("Joined a game", 190, 220, 20, BLACK);
+    if (!text_cache_draw_label(texts, TEXT_KEY(LABEL_ROLE, state->gs_hosting), 190, 220))
+        text_cache_bake_label(texts, TEXT_KEY(LABEL_ROLE, state->gs_hosting), state->gs_hosting ? "Hosting a game" : "Joined a game", 190, 220, 20, BLACK);
 
-    char *const str = malloc(100);
+    if (!text_cache_draw_label(texts, TEXT_KEY(LABEL_PORT, state->gs_net_port), 190, 240)) {
+        char *const str = frame_alloc(frame, 100);
+        snprintf(str, 100, "Port: %u", state->gs_net_port);
+        text_cache_bake_label(texts, TEXT_KEY(LABEL_PORT, state->gs_net_port), str, 190, 240, 20, BLACK);
+    }
 
-    snprintf(str, 100, "Port: %u", state->gs_net_port);
-    DrawText(str, 190, 240, 20, BLACK);
+    bool fresh;
 
     if (state->gs_hosting) {
-        for (uint16_t i = 0; i < state->gss_player_count; i++) {
-            snprintf(str, 100, "X: %d, Y: %d", state->gss_players[i].pos.x, state->gss_players[i].pos.y);
-            DrawText(str, 190, 260 + i * 20, 20, BLACK);
-
-            DrawRectangle(state->gss_players[i].pos.x, state->gss_players[i].pos.y, 10, 10, ColorFromHSV(state->gss_players[i].id / 360.0, 1.0, 1.0));
-        }
+        draw_players(state->gss_players, state->gss_player_count, state->screen_width, state->screen_height);
+        draw_player_panel(state, texts);
     }
     else {
-        snprintf(str, 100, "X: %d, Y: %d", state->gsc_player.pos.x, state->gsc_player.pos.y);
-        DrawText(str, 190, 260, 20, BLACK);
+        TextEntry *const position = text_cache_find(texts, TEXT_KEY(TEXT_POSITION, state->gsc_player.id), pack_point(state->gsc_player.pos), 20, &fresh);
+        if (!fresh) text_cache_format(position, "X: %d, Y: %d", state->gsc_player.pos.x, state->gsc_player.pos.y);
+        DrawText(position->text, 190, 260, 20, BLACK);
 
-        snprintf(str, 100, "ID: %d", state->gsc_player.id);
-        DrawText(str, 190, 280, 20, BLACK);
+        TextEntry *const id = text_cache_find(texts, TEXT_KEY(TEXT_ID, 0), state->gsc_player.id, 20, &fresh);
+        if (!fresh) text_cache_format(id, "ID: %d", state->gsc_player.id);
+        DrawText(id->text, 190, 280, 20, BLACK);
 
-        DrawRectangle(state->gsc_player.pos.x, state->gsc_player.pos.y, 10, 10, ColorFromHSV(state->gsc_player.id / 360.0, 1.0, 1.0));
+        if (state->gsc_lockstep) {
+            draw_players(state->gsc_players, state->gsc_player_count, state->screen_width, state->screen_height);
+        }
+        else {
+            // Everyone else as the server last told us, the own player is drawn where it was predicted instead.
+            EntityTable *const entities = state->net->client_entities(state->gsc_client);
+            EntityStore const *const world = entities_acquire(entities);
+            int32_t const own = entities_find(world, state->gsc_player.id);
+            if (own < 0) {
+                draw_players(world->players, world->len, state->screen_width, state->screen_height);
+            }
+            else {
+                draw_players(world->players, own, state->screen_width, state->screen_height);
+                draw_players(world->players + own + 1, world->len - own - 1, state->screen_width, state->screen_height);
+            }
+            entities_release(entities);
+
+            point const drawn = blend_point(state->gsc_prev_pos, state->gsc_player.pos, state->sim_accumulator * SIM_RATE);
+            DrawRectangle(drawn.x, drawn.y, PLAYER_SIZE, PLAYER_SIZE, ColorFromHSV(state->gsc_player.id / 360.0, 1.0, 1.0));
+        }
     }
 }
 
+static void draw_replay_screen(Gamestate const *const state, TextCache *const texts) {
+    ClearBackground(ColorFromHSV(150, 0.15, 1.0));
+
+    draw_players(state->rs_players, state->rs_player_count, state->screen_width, state->screen_height);
+
+    ReplayReader const *const replay = state->rs_replay;
+    int const width = state->screen_width - 2 * TIMELINE_MARGIN;
+    int const top = state->screen_height - TIMELINE_MARGIN - TIMELINE_HEIGHT;
+    bool fresh;
+
+    TextEntry *const status = text_cache_find(texts, TEXT_KEY(TEXT_REPLAY, 0), (uint64_t) state->rs_paused << 32 | state->rs_tick, 20, &fresh);
+    if (!fresh) text_cache_format(
+        status, "Tick %u of %u, %u.%02u s%s", state->rs_tick + 1, replay->ticks,
+        state->rs_time / 1000, state->rs_time % 1000 / 10, state->rs_paused ? " (paused)" : ""
+    );
+    DrawText(status->text, TIMELINE_MARGIN, top - 50, 20, BLACK);
+
+    if (!text_cache_draw_label(texts, TEXT_KEY(LABEL_REPLAY_HELP, 0), TIMELINE_MARGIN, top - 30))
+        text_cache_bake_label(texts, TEXT_KEY(LABEL_REPLAY_HELP, 0), "Space pause, Left/Right step, Page Up/Down skip", TIMELINE_MARGIN, top - 30, 20, DARKGRAY);
+
+    int const played = replay->ticks > 1 ? (int) ((float) state->rs_tick / (replay->ticks - 1) * width) : width;
+    DrawRectangle(TIMELINE_MARGIN, top, width, TIMELINE_HEIGHT, LIGHTGRAY);
+    DrawRectangle(TIMELINE_MARGIN, top, played, TIMELINE_HEIGHT, DARKGRAY);
+}
+
 void game_update(Gamestate *const state) {
-    state->frames++;
+    PROFILE_FRAME();
+    arena_reset(&state->frame_arena);
+
     state->screen_width = GetScreenWidth();
     state->screen_height = GetScreenHeight();
 
+    PROFILE_BEGIN(PROFILE_UPDATE);
     switch (state->screen_tag) {
         case TITLE_SCREEN:
             update_title_screen(state);
@@ -271,20 +599,55 @@ void game_update(Gamestate *const state) {
         case GAME_SCREEN:
             update_game_screen(state);
             break;
+        case REPLAY_SCREEN:
+            update_replay_screen(state);
+            break;
+    }
+
+    /* Advance the simulation in fixed steps, what is left over is blended when drawing */ {
+        float const step = 1.0f / SIM_RATE;
+
+        state->sim_accumulator += GetFrameTime();
+        if (state->sim_accumulator > SIM_MAX_STEPS * step)
+            state->sim_accumulator = SIM_MAX_STEPS * step;
+
+        while (state->sim_accumulator >= step) {
+            state->sim_accumulator -= step;
+            state->frames++;
+            if (state->screen_tag == GAME_SCREEN)
+                step_game_screen(state);
+        }
     }
+    PROFILE_END(PROFILE_UPDATE);
+
+    PROFILE_BEGIN(PROFILE_NET);
+    // The first frame drawn with a traced input ends its trace.
+    uint32_t trace = 0;
+    if (state->screen_tag == GAME_SCREEN)
+        trace = state->gs_hosting ? state->net->server_take_trace(state->gss_server) : state->net->client_take_trace(state->gsc_client);
+    PROFILE_END(PROFILE_NET);
 
     BeginDrawing();
 
+    PROFILE_BEGIN(PROFILE_DRAW);
     switch (state->screen_tag) { 
         case TITLE_SCREEN:
-            draw_title_screen(state);
+            draw_title_screen(state, &state->frame_arena, &state->texts);
             break;
         case GAME_SCREEN:
-            draw_game_screen(state);
+            draw_game_screen(state, &state->frame_arena, &state->texts);
+            break;
+        case REPLAY_SCREEN:
+            draw_replay_screen(state, &state->texts);
             break;
     }
+    PROFILE_END(PROFILE_DRAW);
+
+    PROFILE_OVERLAY();
 
     EndDrawing();
+
+    trace_mark(trace, TRACE_RENDER);
 }
 #endif // !defined(HOTRELOAD) || !defined(__linux__)
 
@@ -292,3 +655,37 @@ bool game_should_debug_reload(Gamestate const *const state) {
     return IsKeyPressed(KEY_R);
 }
 
+#if defined(HOTRELOAD) && defined(__linux__)
+void game_set_net(Gamestate *const state, NetApi const *const net) {
+    NetApi const *const old = state->net;
+    state->net = net;
+
+    if (old == NULL || state->screen_tag != GAME_SCREEN) return;
+
+    if (net->state_version == old->state_version) {
+        if (state->gs_hosting) {
+            old->server_suspend(state->gss_server);
+            net->server_resume(state->gss_server);
+        }
+        else {
+            old->client_suspend(state->gsc_client);
+            net->client_resume(state->gsc_client);
+        }
+        return;
+    }
+
+    // The new code can't read the old state, so start over. Clients that lose the server rejoin by themselves.
+    printf("Network state version changed from %u to %u, restarting the network\n", old->state_version, net->state_version);
+    if (state->gs_hosting) {
+        old->server_close(state->gss_server);
+        state->gss_player_count = 0;
+        state->gss_server = net->server_spawn(state->gss_players, &state->gss_player_count, state->max_players, state->gs_net_port);
+    }
+    else {
+        old->client_close(state->gsc_client);
+        state->gsc_lockstep = false;
+        state->gsc_client = net->client_spawn(&state->gsc_player, state->gs_net_port);
+    }
+}
+#endif
+
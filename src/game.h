@@ -5,6 +5,8 @@
 
 #include "raylib.h"
 
+#include "./net.h"
+
 typedef struct State Gamestate;
 
 Gamestate *game_init();
@@ -21,5 +23,9 @@ void game_update(Gamestate *state);
 bool game_should_debug_reload(Gamestate const *state);
 
 typedef void game_update_t(Gamestate *state);
+
+// Points the game at the network code of a (re)loaded net.so.
+// A live server or client is handed over to it, or restarted if the new code has a different state version.
+void game_set_net(Gamestate *state, NetApi const *net);
 #endif
 
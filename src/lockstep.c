@@ -0,0 +1,33 @@
+#include "./lockstep.h"
+
+void lockstep_move(Player *const player, uint8_t const input) {
+    if (input & INPUT_UP)    player->pos.y -= 1;
+    if (input & INPUT_DOWN)  player->pos.y += 1;
+    if (input & INPUT_LEFT)  player->pos.x -= 1;
+    if (input & INPUT_RIGHT) player->pos.x += 1;
+}
+
+void lockstep_step(Player *const players, uint16_t const len, uint8_t const *const inputs) {
+    for (uint16_t i = 0; i < len; i++)
+        lockstep_move(&players[i], inputs[i]);
+}
+
+// FNV-1a over each value a byte at a time, least significant first.
+static uint32_t hash_u32(uint32_t hash, uint32_t const value) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        hash ^= (value >> shift) & 0xff;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t lockstep_checksum(Player const *const players, uint16_t const len) {
+    uint32_t hash = 2166136261u;
+    hash = hash_u32(hash, len);
+    for (uint16_t i = 0; i < len; i++) {
+        hash = hash_u32(hash, players[i].id);
+        hash = hash_u32(hash, players[i].pos.x);
+        hash = hash_u32(hash, players[i].pos.y);
+    }
+    return hash;
+}
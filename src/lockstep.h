@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "./player.h"
+
+// Deterministic input lockstep, the alternative to sending positions.
+// Every frame each player contributes one byte of `INPUT_*` bits, the server relays the inputs of every frame to every client,
+// and the server and each client step the same players with the same inputs in slot order.
+// Positions are unsigned integers that wrap, so the result is the same on every machine.
+// A checksum of the players after each frame is compared with the server's, to find clients that drifted apart anyway.
+// Bandwidth is a byte per player and frame, however large the state being simulated is.
+
+#define LOCKSTEP_RATE (60)          // frames per second
+#define LOCKSTEP_MAX_PLAYERS (256)  // lockstep is for small matches, every frame carries an input of each player
+
+// Directions held or pressed during a frame
+enum {
+    INPUT_UP    = 1 << 0,
+    INPUT_DOWN  = 1 << 1,
+    INPUT_LEFT  = 1 << 2,
+    INPUT_RIGHT = 1 << 3,
+};
+
+// Moves `player` by one frame of `input`.
+void lockstep_move(Player *player, uint8_t input);
+
+// Advances `len` players by one frame, `inputs[i]` moves `players[i]`.
+void lockstep_step(Player *players, uint16_t len, uint8_t const *inputs);
+
+// Hash of the ids and positions of `len` players, the same on machines of either byte order.
+uint32_t lockstep_checksum(Player const *players, uint16_t len);
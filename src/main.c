@@ -2,73 +2,228 @@
 
 #include "./util.h"
 #include "./game.h"
+#include "./profile.h"
 
 #if defined(HOTRELOAD) && defined(__linux__)
+    #include <stdio.h>
     #include <string.h>
+    #include <stdatomic.h>
 
     #include <dlfcn.h>
     #include <sys/inotify.h>
+    #include <sys/stat.h>
+    #include <poll.h>
     #include <pthread.h>
     #include <unistd.h>
     #include <errno.h>
     #include <stdnoreturn.h>
 
-    // Input is just a pointer to a bool, which is set to true when the file is modified.
+    #define RELOAD_DEBOUNCE (200) // milliseconds without changes in src before building
+
+    // Built into bin by the Makefile, each from its own cached objects.
+    #ifndef DEBUG
+        #define GAME_SO "game.so"
+        #define NET_SO "net.so"
+        #define MAKE_GAME_SO "make --no-print-directory _game.so"
+        #define MAKE_NET_SO "make --no-print-directory _net.so"
+    #else
+        #define GAME_SO "game-debug.so"
+        #define NET_SO "net-debug.so"
+        #define MAKE_GAME_SO "make --no-print-directory _game.so-debug"
+        #define MAKE_NET_SO "make --no-print-directory _net.so-debug"
+    #endif
+
+    // Which shared objects have been rebuilt and wait to be swapped in, set by the watcher.
+    typedef struct {
+        _Atomic bool game;
+        _Atomic bool net;
+    } Rebuilt;
+
+    // Returns whether `name` is a file in src built into net.so.
+    static bool is_net_source(char const *const name) {
+        static char const *const sources[] = {"net.c", "cookie.c", "cookie.h", "pool.c", "pool.h", "codec.c", "codec.h"};
+        for (size_t i = 0; i < sizeof sources / sizeof *sources; i++)
+            if (strcmp(name, sources[i]) == 0) return true;
+        return false;
+    }
+
+    // Returns whether `name` is a file in src built into both game.so and net.so.
+    static bool is_shared_source(char const *const name) {
+        static char const *const sources[] = {"net.h", "player.h", "util.h"};
+        for (size_t i = 0; i < sizeof sources / sizeof *sources; i++)
+            if (strcmp(name, sources[i]) == 0) return true;
+        return false;
+    }
+
+    // Returns whether `name` is a C source or header, not an editor's swap, backup or lock file.
+    static bool is_source(char const *const name) {
+        size_t const len = strlen(name);
+        return name[0] != '.' && len > 2 && name[len - 2] == '.' && (name[len - 1] == 'c' || name[len - 1] == 'h');
+    }
+
+    // Runs `command` and returns whether it changed the file at `path`.
+    static bool rebuild(char const *const command, char const *const path) {
+        struct stat before;
+        bool const existed = stat(path, &before) == 0;
+
+        if (system(command)) {
+            // The game keeps running the old code.
+            fprintf(stderr, "Failed to build %s\n", path);
+            return false;
+        }
+
+        struct stat after;
+        if (stat(path, &after) != 0)
+            return false;
+        return !existed
+            || after.st_mtim.tv_sec != before.st_mtim.tv_sec
+            || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec;
+    }
+
+    // Input is a pointer to a `Rebuilt`.
+    // Once files in src stop changing for `RELOAD_DEBOUNCE`, rebuilds what they are part of, on this thread,
+    // so the game keeps rendering during the compile and only swaps in shared objects that built.
     // Does not return.
     // (Uses static variables)
     static noreturn void *watcher(void *args) {
         static int fd;
-        bool *modified = args;
+        static char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+        Rebuilt *rebuilt = args;
 
         fd = inotify_init();
         if (fd == -1)
             EXIT_PRINT("Failed to initialize inotify: %s\n", strerror(errno));
 
-        if (inotify_add_watch(fd, "src", IN_MODIFY) == -1)
+        // Editors either write the file in place or rename a finished copy over it.
+        if (inotify_add_watch(fd, "src", IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
             EXIT_PRINT("Failed to add watch: %s\n", strerror(errno));
 
-        char buf[1024];
+        bool game = false; // changed since the last build
+        bool net = false;
         while (true) {
-            ssize_t len = read(fd, buf, sizeof(buf)); // blocks until file is modified
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            int const ready = poll(&pfd, 1, game || net ? RELOAD_DEBOUNCE : -1); // blocks until a file is changed
+            if (ready == -1) {
+                if (errno == EINTR) continue;
+                EXIT_PRINT("Failed to poll inotify: %s\n", strerror(errno));
+            }
+
+            if (ready == 0) {
+                // Quiet for long enough, net.so first since game.so may call new network code.
+                if (net && rebuild(MAKE_NET_SO, "bin/" NET_SO))
+                    atomic_store(&rebuilt->net, true);
+                if (game && rebuild(MAKE_GAME_SO, "bin/" GAME_SO))
+                    atomic_store(&rebuilt->game, true);
+                game = false;
+                net = false;
+                continue;
+            }
+
+            ssize_t len = read(fd, buf, sizeof(buf));
             if (len == -1)
                 EXIT_PRINT("Failed to read inotify: %s\n", strerror(errno));
-            *modified = true;
+
+            for (char *at = buf; at < buf + len; at += sizeof (struct inotify_event) + ((struct inotify_event *) at)->len) {
+                struct inotify_event const *const event = (void *) at;
+                if (event->len == 0 || !is_source(event->name)) continue;
+
+                // Anything else is either in game.so or linked into main, which needs a restart.
+                if (is_shared_source(event->name)) {
+                    net = true;
+                    game = true;
+                }
+                else if (is_net_source(event->name)) {
+                    net = true;
+                }
+                else {
+                    game = true;
+                }
+            }
+        }
+    }
+
+    // Loads bin/net.so under a name of its own, so the build in use stays loaded until it has handed its state over.
+    // Returns NULL if it fails to load.
+    static void *load_net_so(unsigned const generation, NetApi const **const net) {
+        char name[32];
+        char command[64];
+        snprintf(name, sizeof name, "net-%u.so", generation);
+        snprintf(command, sizeof command, "cp bin/" NET_SO " bin/%s", name);
+
+        if (system(command)) {
+            fprintf(stderr, "Failed to copy " NET_SO " to %s\n", name);
+            return NULL;
+        }
+
+        void *const net_so = dlopen(name, RTLD_NOW);
+
+        // Stays mapped until it is closed, so the copy can go right away.
+        snprintf(command, sizeof command, "bin/%s", name);
+        remove(command);
+
+        if (net_so == NULL) {
+            fprintf(stderr, "Failed to load %s: %s\n", name, dlerror());
+            return NULL;
         }
+
+        *net = dlsym(net_so, "net_api");
+        if (*net == NULL) {
+            fprintf(stderr, "Failed to load net_api: %s\n", dlerror());
+            dlclose(net_so);
+            return NULL;
+        }
+
+        printf("Loaded %s (state version %u)\n", name, (*net)->state_version);
+        return net_so;
+    }
+
+    // Loads the latest net.so and hands the live server or client over to it.
+    // If loading fails, the game keeps running the old code.
+    // (Uses static variables)
+    static void debug_reload_net(Gamestate *const state) {
+        static void *net_so = NULL; // Shared object handle to the net.so in use
+        static unsigned generation = 0;
+
+        NetApi const *net;
+        void *const new_so = load_net_so(generation + 1, &net);
+        if (new_so == NULL) {
+            if (net_so == NULL)
+                EXIT_PRINT("Failed to load " NET_SO "\n");
+            return;
+        }
+
+        game_set_net(state, net);
+
+        // Every thread running the old code has been joined by now.
+        if (net_so != NULL && dlclose(net_so))
+            EXIT_PRINT("Failed to close net.so: %s\n", dlerror());
+
+        net_so = new_so;
+        generation++;
     }
 
     // Returns a pointer to the game_update function dynamically loaded from game.so.
-    // If a file depended on by game.so is modified, game.so is rebuild and reloaded.
+    // Called between frames, swaps in game.so or net.so once the watcher has rebuilt them.
     // (Uses static variables)
     static game_update_t *debug_reload(Gamestate *const state) {
         static void *game_so = NULL; // Shared object handle to game.so
         static game_update_t *game_update = NULL;
         static pthread_t watcher_id;
-        static bool modified = false;
+        static Rebuilt rebuilt;
 
         if (game_so == NULL) { // On first invocation
-            if (pthread_create(&watcher_id, NULL, watcher, &modified))
+            atomic_init(&rebuilt.game, false);
+            atomic_init(&rebuilt.net, false);
+            if (pthread_create(&watcher_id, NULL, watcher, &rebuilt))
                 EXIT_PRINT("Failed to create watcher thread: %s\n", strerror(errno));
+            debug_reload_net(state);
             goto do_reload;
         }
 
-        if (modified) {
-            modified = false;
-#ifndef DEBUG
-            if (system("make _game.so")) {
-#else
-            if (system("make _game.so-debug")) {
-#endif
-                // If compilation fails, the game will continue to run the old code.
-                fprintf(stderr, "Failed to build game.so: %s\n", strerror(errno));
-                modified = false;
-                return game_update;
-            }
-            if (dlclose(game_so))
-                EXIT_PRINT("Failed to close game.so: %s\n", dlerror());
-            goto do_reload;
-        }
+        if (atomic_exchange(&rebuilt.net, false))
+            debug_reload_net(state);
 
-        if (game_should_debug_reload(state)) {
+        if (atomic_exchange(&rebuilt.game, false) || game_should_debug_reload(state)) {
             if (dlclose(game_so))
                 EXIT_PRINT("Failed to close game.so: %s\n", dlerror());
             goto do_reload;
@@ -77,21 +232,21 @@
         return game_update;
 
     do_reload:
-        printf("Loading game.so...\n");
+        printf("Loading " GAME_SO "...\n");
 
         char const *error;
 
-        game_so = dlopen("game.so", RTLD_NOW);
+        game_so = dlopen(GAME_SO, RTLD_NOW);
         error = dlerror();
         if (error != NULL) 
-            EXIT_PRINT("Failed to load game.so: %s\n", error);
+            EXIT_PRINT("Failed to load " GAME_SO ": %s\n", error);
 
         game_update = dlsym(game_so, "game_update");
         error = dlerror();
         if (error != NULL)
             EXIT_PRINT("Failed to load game_update: %s\n", error);
 
-        printf("Loaded game.so (game_update = %p)\n", game_update);
+        printf("Loaded " GAME_SO " (game_update = %p)\n", game_update);
 
         return game_update;
     }
@@ -109,7 +264,9 @@ int main(int const argc, char const *const *const argv) {
         game_update(state);
 
 #if defined(HOTRELOAD) && defined(__linux__)
+        PROFILE_BEGIN(PROFILE_RELOAD);
         game_update = debug_reload(state);
+        PROFILE_END(PROFILE_RELOAD);
 #endif
     }
 
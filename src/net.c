@@ -4,6 +4,9 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
 
 #ifdef __linux__
 #include <poll.h>
@@ -13,13 +16,73 @@
 
 #include "./net.h"
 #include "./util.h"
+#include "./cookie.h"
+#include "./pool.h"
+#include "./codec.h"
+#include "./trace.h"
+#include "./replay.h"
+#include "./lockstep.h"
+#include "./entities.h"
 #include "./os/sockets.h"
 #include "./os/threads.h"
+#include "./os/uring.h"
+#include "./os/files.h"
+#include "./os/random.h"
 
 #define SOCK_ADDR_IN_EQ(a, b) (a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port)
 #define DISCONNECT_TIMEOUT (5000) // milliseconds
 #define SENDER_DELAY (35)         // milliseconds
+#define SENDER_TICK (5)           // milliseconds
 #define POLL_TIMEOUT (1000)       // milliseconds
+#define METRICS_INTERVAL (5000)   // milliseconds
+#define BUSY_POLL (50)            // microseconds a waiting receive spins on the device queue in low-latency mode
+#define JITTER_BUCKETS (16)       // of the tick jitter histogram, bucket `i` counts ticks less than 2^i microseconds late
+
+// Bump whenever `Server`, `Client` or anything they point to changes layout.
+// A reloaded net.so only takes over a live server or client created with the same version.
+#define NET_STATE_VERSION (15)
+
+#define TABLE_MAGIC "BBCLIENT"
+#define TABLE_ALIGN (64)          // bytes, each array of the client table starts on its own cache line
+
+#define PACKET_MAX (65507)        // largest UDP payload over IPv4
+#define SERVER_POOL_BUFFERS (256)
+#define ENCODE_BATCH (SERVER_POOL_BUFFERS / 2) // POSITIONS packets planned before they are written and sent, the rest of the pool is left to the receiver
+#define ENCODE_GRAIN (4)          // POSITIONS packets written per job, batches no bigger than this are written by the sender itself
+#define CLIENT_POOL_BUFFERS (4)
+
+// Per-client congestion control.
+// Each client gets its own snapshot interval and per-packet player budget,
+// which back off under loss or queueing delay and recover when the path is clean.
+#define RATE_MIN_INTERVAL (15)    // milliseconds
+#define RATE_MAX_INTERVAL (250)   // milliseconds
+#define RATE_MIN_BUDGET (16)      // players per packet
+#define RATE_BUDGET_STEP (16)     // players per packet
+#define RATE_LOSS_HIGH (0.05f)
+#define RATE_LOSS_LOW (0.01f)
+#define RATE_RTT_SLACK (25)       // milliseconds of queueing delay tolerated above the minimum rtt
+
+// Per-source-ip token buckets in front of the receive path.
+// Handshake packets (JOIN, REJOIN) draw from a second, much smaller bucket.
+#define LIMIT_SLOTS (4096)              // power of two
+#define LIMIT_RATE (200)                // packets per second
+#define LIMIT_BURST (400)               // packets
+#define LIMIT_HANDSHAKE_RATE (10)       // packets per second
+#define LIMIT_HANDSHAKE_BURST (20)      // packets
+
+// Server-wide outbound cap, enforced with a token bucket refilled every sender tick.
+#define SEND_BYTES_PER_SECOND (4 * 1024 * 1024)
+#define SEND_BYTES_BURST (SEND_BYTES_PER_SECOND / 20)
+
+// Lockstep mode, see lockstep.h.
+#define LOCKSTEP_HISTORY (64)        // frames the server keeps, a client further behind is sent a SYNC instead
+#define LOCKSTEP_QUEUE (8)           // inputs buffered per client, the oldest are dropped so inputs never lag further behind
+#define LOCKSTEP_INPUT_WINDOW (16)   // unacknowledged inputs repeated in every INPUTS packet
+#define LOCKSTEP_FRAMES_MAX (12)     // frames per FRAMES packet
+#define LOCKSTEP_CATCH_UP (8)        // frames stepped at once after the sender stalled, the rest are skipped
+#define LOCKSTEP_SYNC_INTERVAL (100) // milliseconds between SYNC packets to one client
+#define LOCKSTEP_CLIENT_FRAMES (64)  // frames a client has received and the game has not simulated yet
+#define LOCKSTEP_NEVER (UINT32_MAX)  // roster of a client that was never sent a SYNC
 
 typedef enum {
     JOINING,
@@ -29,348 +92,1796 @@ typedef enum {
 
 typedef uint8_t PacketTag;
 
+// The packets, as lists of their fields in wire order, see codec.h.
+// Commented out tags are reserved for packets that don't exist yet.
+
+#define C2S_PACKETS(P) P(JOIN) P(REJOIN) P(POSITION) P(INPUTS) /* P(LEAVE) */
+
+// Once joined, a client is known by the session token it got in ACCEPT, not by its address,
+// so a client whose NAT picks a new port carries on from the new address with its next packet.
+
+#define JOIN_FIELDS(F) \
+    F(j_cookie, COOKIE) /* Echo of the last CHALLENGE cookie, or 0 */
+
+#define POSITION_FIELDS(F) \
+    F(p_token,      COOKIE) /* Session token from ACCEPT */ \
+    F(p_pos,        POINT) /* TODO: Clients shouldn't need to send their player id. */ \
+    F(p_ack_seq,    U16)   /* Latest POSITIONS sequence received */ \
+    F(p_ack_delay,  U16)   /* Milliseconds between receiving `p_ack_seq` and sending this packet */ \
+    F(p_ack_time,   U32)   /* `p_time` of the packet with `p_ack_seq`, echoed back */ \
+    F(p_recv_count, U16)   /* Number of POSITIONS packets received (wraps) */ \
+    F(p_trace,      U32)   /* Trace id of the newest input in `p_pos`, 0 if untraced */ \
+    F(p_number,     U32)   /* Counts every packet the client sends, so a late one from an address it left is told apart */
+
+#define REJOIN_FIELDS(F) \
+    F(r_player, PLAYER) \
+    F(r_cookie, COOKIE) /* Same as `j_cookie` */ \
+    F(r_token,  COOKIE) /* of the session being rejoined, or 0 */ \
+    F(r_number, U32)    /* Same as `p_number` */
+
+#define INPUTS_FIELDS(F) \
+    F(i_token,    COOKIE) /* Same as `p_token` */ \
+    F(i_seq,      U32) /* of the first input in `i_inputs`, the client numbers one input per frame it simulates */ \
+    F(i_received, U32) /* newest frame received in order */ \
+    F(i_roster,   U32) /* `s_roster` of the last SYNC received, `LOCKSTEP_NEVER` if none */ \
+    F(i_frame,    U32) /* newest frame simulated */ \
+    F(i_checksum, U32) /* of the players after `i_frame` */ \
+    F(i_trace,    U32) /* Same as `p_trace` */ \
+    F(i_number,   U32) /* Same as `p_number` */ \
+    F(i_count,    U8)  /* inputs in `i_inputs` */ \
+    F(i_inputs[LOCKSTEP_INPUT_WINDOW], U8)
+
+#define S2C_PACKETS(P) P(ACCEPT) P(POSITIONS) P(CHALLENGE) P(SYNC) P(FRAMES) /* P(UPDATE) P(KICK) */
+
+#define CHALLENGE_FIELDS(F) \
+    F(c_cookie, COOKIE) /* To be echoed in the next JOIN or REJOIN packet */
+#define CHALLENGE_ARRAY(A)
+
+#define ACCEPT_FIELDS(F) \
+    F(a_max,   U16) \
+    F(a_id,    U32) \
+    F(a_token, COOKIE) /* To be sent in every packet from now on, see `session_token` */
+#define ACCEPT_ARRAY(A)
+
+#define POSITIONS_FIELDS(F) \
+    F(p_seq,    U16) /* Per-client sequence number */ \
+    F(p_offset, U16) /* Index of the first player in this packet */ \
+    F(p_time,   U32) /* Server clock when sent, in milliseconds (wraps) */ \
+    F(p_trace,  U32) /* Echo of the client's last traced `p_trace`, 0 if none */ \
+    F(p_total,  U16) /* Number of players on the server */ \
+    F(p_len,    U16) /* Number of players in this packet */
+#define POSITIONS_ARRAY(A) \
+    A(p_players, PLAYER, packet->p_len)
+
+#define SYNC_FIELDS(F) \
+    F(s_frame,     U32) /* the players are as of after this frame */ \
+    F(s_roster,    U32) /* frame after which players last joined or left, only FRAMES with the same roster apply */ \
+    F(s_input_ack, U32) /* `i_seq` of the next input the server expects */ \
+    F(s_len,       U16) /* Number of players */
+#define SYNC_ARRAY(A) \
+    A(s_players, PLAYER, packet->s_len)
+
+#define FRAMES_FIELDS(F) \
+    F(f_frame,     U32) /* of the first frame in `f_inputs` */ \
+    F(f_roster,    U32) /* Same as `s_roster` */ \
+    F(f_input_ack, U32) /* Same as `s_input_ack` */ \
+    F(f_trace,     U32) /* Same as `p_trace` */ \
+    F(f_len,       U16) /* inputs per frame, one per player */ \
+    F(f_count,     U8)  /* frames in `f_inputs` */
+#define FRAMES_ARRAY(A) \
+    A(f_inputs, U8, packet->f_len * packet->f_count)
+
+#define DECLARE_C2S(tag) struct { tag##_FIELDS(CODEC_DECLARE) };
+#define DECLARE_S2C(tag) struct { tag##_FIELDS(CODEC_DECLARE) tag##_ARRAY(CODEC_DECLARE_ARRAY) };
+
 typedef struct {
-    enum : PacketTag {
-        JOIN,
-        REJOIN,
-        POSITION,
-        // LEAVE,
-    } tag;
-    union {
-        struct { // Position
-            point p_pos; // TODO: Clients shouldn't need to send their player id.
-        };
-        struct { // Rejoin
-            Player r_player;
-        };
-    };
+    enum : PacketTag { C2S_PACKETS(CODEC_TAG) } tag;
+    union { C2S_PACKETS(DECLARE_C2S) };
 } C2SPacket;
 
 typedef struct {
-    enum : PacketTag {
-        ACCEPT,
-        POSITIONS,
-        // UPDATE,
-        // KICK,
-    } tag;
-    union {
-        struct { // Accept
-            uint16_t a_max;
-            uint32_t a_id;
-        };
-        struct { // Positions
-            uint16_t p_len;
-            Player p_players[];
-        };
-        // struct { // Update
-        //     Player p_player;
-        // };
-    };
+    enum : PacketTag { S2C_PACKETS(CODEC_TAG) } tag;
+    union { S2C_PACKETS(DECLARE_S2C) };
 } S2CPacket;
 
+#undef DECLARE_C2S
+#undef DECLARE_S2C
+
+// The codecs expanded from the lists.
+// Packets are written and read in host order, and converted in place right before sending or after receiving.
+#define SWAP(name, kind) CODEC_SWAP_##kind(packet->name)
+
+// Reverses the byte order of the fields of `packet`, from host to network order or back.
+// Returns false if the tag is unknown.
+static bool c2s_swap(C2SPacket *const packet) {
+#define PACKET(tag) case tag: tag##_FIELDS(SWAP) return true;
+    switch (packet->tag) { C2S_PACKETS(PACKET) }
+#undef PACKET
+    return false;
+}
+
+// Converts `packet` to network order and returns its size.
+// Every packet is sent with the full size of `C2SPacket`, which also keeps CHALLENGE replies from being larger than what triggered them.
+static size_t c2s_encode(C2SPacket *const packet) {
+    c2s_swap(packet);
+    return sizeof (C2SPacket);
+}
+
+// Copies the `len` bytes at `payload` into `packet` in host order.
+// Returns false if they aren't a packet of a known kind and the full size.
+static bool c2s_decode(C2SPacket *const packet, void const *const payload, int const len) {
+    if (len != sizeof (C2SPacket)) return false;
+    memcpy(packet, payload, sizeof (C2SPacket));
+    return c2s_swap(packet);
+}
+
+// Like `c2s_swap`, the trailing array is left as it is.
+static bool s2c_swap(S2CPacket *const packet) {
+#define PACKET(tag) case tag: tag##_FIELDS(SWAP) return true;
+    switch (packet->tag) { S2C_PACKETS(PACKET) }
+#undef PACKET
+    return false;
+}
+
+// Returns the size of a `tag` packet with `elements` entries in its trailing array, packets without one ignore `elements`.
+static size_t s2c_size_of(PacketTag const tag, size_t const elements) {
+#define ELEMENTS(name, kind, count) + elements * sizeof (CODEC_TYPE_##kind)
+#define PACKET(tag) case tag: return sizeof (S2CPacket) tag##_ARRAY(ELEMENTS);
+    switch (tag) { S2C_PACKETS(PACKET) }
+#undef PACKET
+#undef ELEMENTS
+    return sizeof (S2CPacket);
+}
+
+// Returns the size of `packet`, whose fields are in host order.
+static size_t s2c_size(S2CPacket const *const packet) {
+#define ELEMENTS(name, kind, count) + (size_t) (count) * sizeof (CODEC_TYPE_##kind)
+#define PACKET(tag) case tag: return sizeof (S2CPacket) tag##_ARRAY(ELEMENTS);
+    switch (packet->tag) { S2C_PACKETS(PACKET) }
+#undef PACKET
+#undef ELEMENTS
+    return sizeof (S2CPacket);
+}
+
+// Converts the trailing array of `packet`, copying it from `elements` or converting it in place if `elements` is NULL.
+// The fields must be in host order.
+static void s2c_convert_array(S2CPacket *const packet, void const *const elements) {
+#define CONVERT(name, kind, count) CODEC_CONVERT_##kind(packet->name, elements != NULL ? elements : (void const *) packet->name, count)
+#define PACKET(tag) case tag: tag##_ARRAY(CONVERT) break;
+    switch (packet->tag) { S2C_PACKETS(PACKET) }
+#undef PACKET
+#undef CONVERT
+}
+
+// Converts `packet`, written in host order, to network order and returns its size.
+// Its trailing array is copied from `elements` on the way, or converted where it is if `elements` is NULL.
+static size_t s2c_encode(S2CPacket *const packet, void const *const elements) {
+    size_t const size = s2c_size(packet);
+    s2c_convert_array(packet, elements);
+    s2c_swap(packet);
+    return size;
+}
+
+// Converts the `len` bytes of `packet` to host order in place.
+// Returns false if they aren't a packet of a known kind or are fewer than its fields say, it is left half converted then.
+static bool s2c_decode(S2CPacket *const packet, int const len) {
+    if (len < (int) sizeof (S2CPacket) || !s2c_swap(packet)) return false;
+    if ((size_t) len < s2c_size(packet)) return false;
+    s2c_convert_array(packet, NULL);
+    return true;
+}
+
+#undef SWAP
+
+static_assert(sizeof (S2CPacket) <= sizeof (C2SPacket), "CHALLENGE must not be larger than JOIN");
+
+// Most players that fit into one POSITIONS packet
+#define PACKET_MAX_PLAYERS ((PACKET_MAX - sizeof (S2CPacket)) / sizeof (Player))
+
+// With GSO, POSITIONS chunks are split into datagrams that fit one ethernet frame.
+#define SEGMENT_MAX (1472)
+#define SEGMENT_PLAYERS ((SEGMENT_MAX - sizeof (S2CPacket)) / sizeof (Player))
+
+// Packet buffers fit `max_budget` players, which is every player in lockstep mode.
+static_assert(LOCKSTEP_FRAMES_MAX <= sizeof (Player), "A FRAMES packet must fit where the positions of its players would");
+static_assert(LOCKSTEP_MAX_PLAYERS <= PACKET_MAX_PLAYERS, "A SYNC packet must fit one datagram");
+
+static_assert((2 * sizeof (Player)) % alignof (S2CPacket) == 0, "GSO segments with an even player count must stay aligned");
+
+typedef struct {
+    long next_send;      // milliseconds
+    long interval;       // milliseconds
+    uint16_t budget;     // players per send, one POSITIONS packet or several GSO segments
+    uint16_t offset;     // first player of the next chunk when `budget` is smaller than the player count
+    uint16_t seq;        // sequence number of the next POSITIONS packet
+    uint16_t acked_seq;  // last `p_ack_seq` reported by the client
+    uint16_t acked_recv; // last `p_recv_count` reported by the client
+    float loss;          // smoothed loss ratio
+    long srtt;           // smoothed round trip time in milliseconds, -1 until the first sample
+    long min_rtt;        // milliseconds
+} RateControl;
+
+typedef struct {
+    uint32_t ip;            // network byte order, 0 if the slot is unused
+    long last;              // milliseconds
+    long tokens;            // thousandths of a packet
+    long handshake_tokens;  // thousandths of a packet
+} SourceBucket;
+
+typedef struct {
+    long bytes;     // bytes sent since the last report
+    long packets;   // packets sent since the last report
+    long calls;     // send calls since the last report, fewer than `packets` with GSO
+    long throttled; // sends deferred by the server-wide byte cap since the last report
+    long since;     // milliseconds
+    long jitter[JITTER_BUCKETS]; // ticks since the last report by how late they started, the last bucket takes the rest
+    long long jitter_max;        // microseconds
+} SendMetrics;
+
+// Low-latency mode spends processors on steady ticks: the sender spins until each tick is due instead of sleeping,
+// the receiver polls without blocking, the kernel busy polls the socket, and both threads can be pinned and run real-time.
+// It is meant for machines with processors to spare, a spinning thread never gives its processor up.
+typedef struct {
+    bool on;
+    int receiver_cpu; // -1 leaves the thread wherever the operating system puts it
+    int sender_cpu;   // -1 likewise
+    int priority;     // SCHED_FIFO priority of both threads, 0 keeps the normal policy
+} LowLatency;
+
+// A POSITIONS packet planned during a tick, written later on the job pool.
+typedef struct {
+    PacketBuffer *buf;
+    uint16_t seq;
+    uint16_t offset;
+    uint16_t count;
+    uint32_t trace;
+} EncodeTask;
+
+typedef enum : uint8_t {
+    LOCKSTEP_SEND_NONE,
+    LOCKSTEP_SEND_SYNC,
+    LOCKSTEP_SEND_FRAMES,
+} LockstepSend;
+
+// What a client in lockstep mode is sent this tick, planned under `len_mutex` right after the frames are stepped,
+// so the packets can be written and sent without it.
+typedef struct {
+    LockstepSend send;
+    bool sent;          // queued this tick, the client's `LockstepPeer` is updated once the tick is done
+    uint32_t frame;     // last frame stepped
+    uint32_t roster;
+    uint32_t input_ack; // `next_seq` of the client
+    uint32_t first;     // of the frames sent
+    uint8_t count;
+} LockstepPlan;
+
+// The server's side of lockstep mode.
+// Stepped by the sender thread under `len_mutex`, since joining and leaving changes the players.
+typedef struct {
+    uint32_t frame;      // last frame stepped, frames start at 1
+    uint32_t roster;     // frame after which players last joined or left
+    uint32_t base_frame; // frames are due `LOCKSTEP_RATE` times per second, counting from `base_frame` at `base_time`
+    long base_time;      // milliseconds
+    uint8_t *inputs;     // the last `LOCKSTEP_HISTORY` frames, `max` inputs each, by frame number
+    uint32_t *checksums; // of the players after each frame in `inputs`
+    uint16_t len;        // players when the frames were last stepped, only the first `len` plans are valid
+    LockstepPlan *plans; // by client, `max` entries, only used by the sender thread
+    Player *sync_players; // the players when the frames were last stepped if any client is sent a SYNC, `max` entries
+} LockstepRelay;
+
+// A client in lockstep mode, changed by the receiver and the sender under `len_mutex`.
+typedef struct {
+    uint32_t next_seq;             // of the next input expected from the client
+    uint8_t queue[LOCKSTEP_QUEUE]; // inputs received and not stepped yet, oldest first
+    uint8_t queued;
+    uint8_t last;       // input stepped last, repeated while the queue is empty
+    uint32_t received;  // newest frame the client has received
+    uint32_t sent;      // newest frame sent to the client
+    uint32_t roster;    // of the last SYNC sent to the client, `LOCKSTEP_NEVER` if none
+    uint32_t reported;  // roster the client last reported, it didn't get the last SYNC while it differs from `roster`
+    uint32_t synced;    // frame of the last SYNC sent to the client
+    long synced_at;     // milliseconds
+    bool needs_sync;    // its checksum didn't match the server's
+} LockstepPeer;
+
+// Everything the server knows about its clients, in one block so that it can live in a mapped file and outlive the process.
+// The header is followed by the `clnt_*` and `session_*` arrays and a copy of the players, each `max` entries long.
+// A server restarted with the same file carries on with the clients in it, they only notice a pause.
+typedef struct {
+    char magic[8];
+    uint32_t version; // `NET_STATE_VERSION` of the code that wrote it
+    uint32_t size;    // bytes, including the arrays
+    uint16_t max;
+    uint16_t len;     // players in the copy, as of the last commit
+    uint32_t next_id;
+    bool changing;    // set while clients are added or removed, a table a crash left like this isn't reused
+} ClientTable;
+
 struct Server {
+    uint32_t version; // `NET_STATE_VERSION` of the code that spawned it
     uint16_t max;
-    uint16_t *len;
+    uint16_t max_budget; // players per POSITIONS packet, at most `PACKET_MAX_PLAYERS`
+    _Atomic uint16_t *len; // changed under `len_mutex`, read without it
     Mutex len_mutex;
-    clnt_state *clnt_states;
-    long *clnt_last; // milliseconds
+    ClientTable *table;    // the `clnt_*` arrays below point into it
+    MappedFile table_file; // the mapping `table` is in
+    bool persistent;       // whether `table` is mapped from a file, otherwise from memory
+    Player *table_players; // copy of `players` in the table, as of the last commit
+    _Atomic clnt_state *clnt_states;
+    _Atomic long *clnt_last; // milliseconds, set by the receiver and read by the sender
     Address *clnt_addrs;
+    uint64_t *clnt_tokens;   // session token of each client
+    uint32_t *clnt_moved;    // `p_number` of the packet that last moved each client to a new address, 0 if none
+    uint16_t *session_slots; // session slot of each client, the slots after the first `len` are free
+    _Atomic uint16_t *session_index; // client holding each session slot, only meaningful if its token matches
+    RateControl *clnt_rates;
+    uint32_t *clnt_traces; // trace id to echo in the next POSITIONS packet, 0 if none
+    LockstepPeer *clnt_peers;
+    _Atomic uint32_t trace; // latest trace id received from any client, until taken
+    CookieJar cookies;
+    SourceBucket *limiter; // `LIMIT_SLOTS` entries
+    PacketPool pool;
+    PacketQueue send_queue; // only used by the sender thread
+    Uring *recv_ring; // NULL with the poll backend, otherwise only used by the receiver thread
+    Uring *send_ring; // NULL with the poll backend, otherwise only used by the sender thread
+    bool gso;         // whether runs of POSITIONS segments to one client go out in one send
+    uint32_t next_id;
     Player *players;
-    Thread sender;
+    Thread sender;    // left to be joined by whoever starts the next one when it stops by itself
+    bool sending;     // whether `sender` is running, under `len_mutex`
     Thread receiver;
-    bool should_stop;
+    _Atomic bool should_stop;
     Socket serv_fd;
+    ReplayWriter replay; // only used by the sender thread, kept across suspends
+    JobPool *jobs;             // only used by the sender thread
+    EncodeTask *encode_tasks;  // planned this tick, `ENCODE_BATCH` entries
+    uint16_t encode_len;
+    long encode_now;           // milliseconds, the time of the tick being encoded
+    bool lockstep;             // relays inputs instead of sending positions
+    LockstepRelay relay;       // only used in lockstep mode
+    LowLatency low_latency;
 };
 
+// The client's side of lockstep mode, shared by the game, the sender and the receiver under `mutex`.
+typedef struct {
+    Mutex mutex;
+    bool on;              // the server relays inputs, known from its first SYNC
+    uint8_t inputs[LOCKSTEP_INPUT_WINDOW]; // the newest inputs, by sequence number
+    uint32_t input_seq;   // of the next input
+    uint32_t input_acked; // inputs before this one have reached the server
+    uint32_t roster;      // of the last SYNC received
+    uint32_t synced;      // frame of the last SYNC received
+    uint32_t received;    // newest frame received in order
+    uint32_t taken;       // newest frame taken by the game
+    uint32_t simulated;   // newest frame the game reported simulating
+    uint32_t checksum;    // of the players after `simulated`
+    uint16_t len;         // players, inputs per frame
+    uint8_t *frames;      // `LOCKSTEP_CLIENT_FRAMES` frames of `LOCKSTEP_MAX_PLAYERS` inputs, by frame number
+    Player *sync_players; // of the last SYNC until the game takes them, `LOCKSTEP_MAX_PLAYERS` entries
+    bool sync_pending;
+} LockstepClient;
+
 struct Client {
-    clnt_state clnt_state;
+    uint32_t version; // `NET_STATE_VERSION` of the code that spawned it
+    _Atomic clnt_state clnt_state; // set by the receiver, and by the sender when the server stops answering
     Address serv_addr;
     Player *player;
+    uint64_t cookie;     // from the last CHALLENGE packet
+    uint64_t token;      // session token from the last ACCEPT packet, 0 before the first
+    uint32_t sent;       // packets sent, numbers the next one, only used by the sender
+    uint16_t recv_seq;   // latest POSITIONS sequence received
+    uint16_t recv_count; // POSITIONS packets received (wraps)
+    uint32_t recv_time;  // `p_time` of the packet with `recv_seq`
+    long recv_at;        // milliseconds
+    _Atomic uint32_t trace_input;    // trace id for the next POSITION packet
+    _Atomic uint32_t trace_received; // trace id echoed by the server, until taken
+    PacketPool pool;
     Thread sender;
     Thread receiver;
-    bool should_stop;
+    _Atomic bool should_stop;
+    Event wake; // wakes the sender before its next send is due, for a traced input, a lockstep input or to stop
     Socket clnt_fd;
+    LockstepClient lockstep;
+    EntityTable entities; // written by the receiver, read by the game
 };
 
-#if !defined(__linux__) || !defined(HOTRELOADING)
+static void rate_init(RateControl *const rc, uint16_t const max_budget, long const now) {
+    *rc = (RateControl) {
+        .next_send = now,
+        .interval = SENDER_DELAY,
+        .budget = max_budget,
+        .offset = 0,
+        .seq = 0,
+        .acked_seq = 0,
+        .acked_recv = 0,
+        .loss = 0.0f,
+        .srtt = -1,
+        .min_rtt = -1,
+    };
+}
+
+static void peer_init(LockstepPeer *const peer, long const now) {
+    *peer = (LockstepPeer) {
+        .roster = LOCKSTEP_NEVER,
+        .reported = LOCKSTEP_NEVER,
+        .synced_at = now - LOCKSTEP_SYNC_INTERVAL,
+    };
+}
+
+// Updates the loss and rtt estimates from the acknowledgement fields of a POSITION packet,
+// then moves the snapshot interval and player budget accordingly.
+// Under loss or queueing delay the interval grows first and the budget shrinks once the interval is maxed out.
+// On a clean path the budget is restored first and then the interval shrinks again.
+static void rate_on_feedback(RateControl *const rc, uint16_t const max_budget, C2SPacket const *const packet, long const now) {
+    uint16_t const ack_seq = packet->p_ack_seq;
+    uint16_t const recv_count = packet->p_recv_count;
+
+    uint16_t const sent = ack_seq - rc->acked_seq;
+    uint16_t const recv = recv_count - rc->acked_recv;
+
+    // Feedback for packets older than the last report, or before anything was received, carries no information.
+    if (sent == 0 || sent > (uint16_t) (rc->seq - rc->acked_seq) || recv_count == 0)
+        return;
+
+    rc->acked_seq = ack_seq;
+    rc->acked_recv = recv_count;
+
+    float const sample = recv >= sent ? 0.0f : (float) (sent - recv) / sent;
+    rc->loss = rc->loss * 0.875f + sample * 0.125f;
+
+    long const rtt = (long) ((uint32_t) now - packet->p_ack_time) - packet->p_ack_delay;
+    if (rtt >= 0 && rtt < DISCONNECT_TIMEOUT) {
+        rc->srtt = rc->srtt < 0 ? rtt : (rc->srtt * 7 + rtt) / 8;
+        if (rc->min_rtt < 0 || rtt < rc->min_rtt) rc->min_rtt = rtt;
+    }
+
+    bool const congested = rc->loss > RATE_LOSS_HIGH
+        || (rc->srtt >= 0 && rc->srtt > 2 * rc->min_rtt + RATE_RTT_SLACK);
+
+    if (congested) {
+        if (rc->interval < RATE_MAX_INTERVAL) {
+            rc->interval = rc->interval * 3 / 2;
+            if (rc->interval > RATE_MAX_INTERVAL) rc->interval = RATE_MAX_INTERVAL;
+        }
+        else if (rc->budget > RATE_MIN_BUDGET) {
+            rc->budget /= 2;
+            if (rc->budget < RATE_MIN_BUDGET) rc->budget = RATE_MIN_BUDGET;
+        }
+    }
+    else if (rc->loss < RATE_LOSS_LOW) {
+        if (rc->budget < max_budget) {
+            rc->budget = max_budget - rc->budget > RATE_BUDGET_STEP ? rc->budget + RATE_BUDGET_STEP : max_budget;
+        }
+        else if (rc->interval > RATE_MIN_INTERVAL) {
+            rc->interval--;
+        }
+    }
+}
+
+static void server_print_metrics(Server const *const data, SendMetrics *const metrics, long const now) {
+    long const elapsed = now - metrics->since;
+    if (elapsed < METRICS_INTERVAL) return;
+
+    uint16_t const len = *data->len;
+    float loss = 0.0f;
+    long rtt = 0, interval = 0, budget = 0, rtt_samples = 0;
+    for (uint16_t i = 0; i < len; i++) {
+        RateControl const *const rc = &data->clnt_rates[i];
+        loss += rc->loss;
+        interval += rc->interval;
+        budget += rc->budget;
+        if (rc->srtt >= 0) {
+            rtt += rc->srtt;
+            rtt_samples++;
+        }
+    }
+
+    /* Summarize the tick jitter histogram */
+    long ticks = 0;
+    for (int i = 0; i < JITTER_BUCKETS; i++) ticks += metrics->jitter[i];
+
+    // Percentiles are the upper bounds of the buckets they fall into.
+    long p50 = 0, p99 = 0, seen = 0;
+    char buckets[JITTER_BUCKETS * 24] = "";
+    int written = 0;
+    for (int i = 0; i < JITTER_BUCKETS; i++) {
+        if (metrics->jitter[i] == 0) continue;
+        seen += metrics->jitter[i];
+        if (p50 == 0 && seen * 2 >= ticks) p50 = 1L << i;
+        if (p99 == 0 && seen * 100 >= ticks * 99) p99 = 1L << i;
+        if (i < JITTER_BUCKETS - 1)
+            written += snprintf(buckets + written, sizeof buckets - written, " <%ldus:%ld", 1L << i, metrics->jitter[i]);
+        else
+            written += snprintf(buckets + written, sizeof buckets - written, " >=%ldus:%ld", 1L << (i - 1), metrics->jitter[i]);
+    }
+
+    printf(
+        "metrics: %u clients, %ld B/s, %ld packets/s, %ld sends/s, %ld throttled, avg loss %.1f%%, avg rtt %ld ms, avg interval %ld ms, avg budget %ld\n"
+        "tick jitter: %ld ticks, p50 <%ld us, p99 <%ld us, max %lld us,%s\n",
+        len,
+        metrics->bytes * 1000 / elapsed,
+        metrics->packets * 1000 / elapsed,
+        metrics->calls * 1000 / elapsed,
+        metrics->throttled,
+        len ? loss * 100.0f / len : 0.0f,
+        rtt_samples ? rtt / rtt_samples : 0,
+        len ? interval / len : 0,
+        len ? budget / len : 0,
+        ticks, p50, p99, metrics->jitter_max, buckets
+    );
+
+    *metrics = (SendMetrics) {.since = now};
+}
+
+// Completion callback of both io_uring instances
+static void server_sent(Server *const data, PacketBuffer *const buf) {
+    pool_release(&data->pool, buf);
+}
+
+static void server_send(Server *const data, Uring *const ring, PacketBuffer *const *const batch, int const count) {
+    void const *bufs[SOCKET_SEGMENTS_MAX];
+    int lens[SOCKET_SEGMENTS_MAX];
+    void *users[SOCKET_SEGMENTS_MAX];
+    for (int i = 0; i < count; i++) {
+        bufs[i] = batch[i]->data;
+        lens[i] = batch[i]->len;
+        users[i] = batch[i];
+    }
+
+    if (ring != NULL) {
+        if (!uring_send(ring, bufs, lens, count, &batch[0]->addr, users))
+            EXIT_PRINT("Failed to send to client: %s", uring_get_error());
+        return;
+    }
+
+    if (!socket_sendto_segments_inet(data->serv_fd, bufs, lens, count, &batch[0]->addr))
+        EXIT_PRINT("Failed to send to client: %s", sockets_get_error());
+
+    for (int i = 0; i < count; i++)
+        pool_release(&data->pool, batch[i]);
+}
+
+// Whether `buf` can be appended to a GSO batch, which needs one destination and equal-sized datagrams with only the last one shorter.
+static bool server_extends_batch(Server const *const data, PacketBuffer *const *const batch, int const count, int const total, PacketBuffer const *const buf) {
+    if (!data->gso || count == 0 || count == SOCKET_SEGMENTS_MAX) return false;
+
+    PacketBuffer const *const first = batch[0];
+    return first->len <= SEGMENT_MAX
+        && batch[count - 1]->len == first->len
+        && buf->len <= first->len
+        && total + buf->len <= PACKET_MAX
+        && buf->addr.sin_addr.s_addr == first->addr.sin_addr.s_addr
+        && buf->addr.sin_port == first->addr.sin_port;
+}
+
+// Sends every queued buffer and returns it to the pool.
+// Only the sender thread queues and flushes, the receiver sends its CHALLENGE packets itself.
+// `ring` is the sender's io_uring instance, or NULL with the poll backend.
+// With io_uring the whole queue goes out in one submission and buffers return to the pool on completion.
+// With GSO consecutive segments to the same client are sent together.
+static void server_flush(Server *const data, Uring *const ring, SendMetrics *const metrics) {
+    PacketBuffer *batch[SOCKET_SEGMENTS_MAX];
+    int count = 0, total = 0;
+
+    PacketBuffer *buf;
+    while ((buf = queue_pop(&data->send_queue)) != NULL) {
+        DEBUG_PRINT("< Send %d bytes to %s:%d", buf->len, inet_ntoa(buf->addr.sin_addr), ntohs(buf->addr.sin_port));
+
+        if (count > 0 && !server_extends_batch(data, batch, count, total, buf)) {
+            server_send(data, ring, batch, count);
+            if (metrics != NULL) metrics->calls++;
+            count = total = 0;
+        }
+
+        batch[count++] = buf;
+        total += buf->len;
+
+        if (metrics != NULL) {
+            metrics->bytes += buf->len;
+            metrics->packets++;
+        }
+    }
+
+    if (count > 0) {
+        server_send(data, ring, batch, count);
+        if (metrics != NULL) metrics->calls++;
+    }
+
+    if (ring != NULL && !uring_submit(ring))
+        EXIT_PRINT("Failed to send to client: %s", uring_get_error());
+}
+
+static void server_queue(Server *const data, PacketBuffer *const buf) {
+    // The queue holds at least as many entries as the pool has buffers, so this can only fail on a double push.
+    if (!queue_push(&data->send_queue, buf))
+        EXIT_PRINT("Send queue is full");
+}
+
+// Writes a POSITIONS packet with `count` players starting at `offset` and returns its size.
+static size_t server_write_positions(Server const *const data, S2CPacket *const packet, uint16_t const seq, long const now, uint32_t const trace, uint16_t const offset, uint16_t const count) {
+    packet->tag = POSITIONS;
+    packet->p_seq = seq;
+    packet->p_offset = offset;
+    packet->p_time = (uint32_t) now;
+    packet->p_trace = trace;
+    packet->p_total = *data->len;
+    packet->p_len = count;
+    return s2c_encode(packet, &data->players[offset]);
+}
+
+// Writes the planned POSITIONS packets from `begin` to `end`, on any thread of the job pool.
+static void server_encode(Server *const data, uint32_t const begin, uint32_t const end) {
+    for (uint32_t i = begin; i < end; i++) {
+        EncodeTask const *const task = &data->encode_tasks[i];
+        server_write_positions(data, (S2CPacket *) task->buf->data, task->seq, data->encode_now, task->trace, task->offset, task->count);
+    }
+}
+
+// Writes every planned packet in parallel, then queues them in the order they were planned, so GSO batches stay together.
+static void server_encode_planned(Server *const data) {
+    jobs_parallel_for(data->jobs, data->encode_len, ENCODE_GRAIN, (job_t *) server_encode, data);
+
+    for (uint16_t i = 0; i < data->encode_len; i++) {
+        EncodeTask const *const task = &data->encode_tasks[i];
+        server_queue(data, task->buf);
+        if (task->trace != 0) trace_mark(task->trace, TRACE_SERVER_SEND);
+    }
+    data->encode_len = 0;
+}
+
+static PacketBuffer *server_acquire(Server *const data, SendMetrics *const metrics) {
+    PacketBuffer *buf = pool_acquire(&data->pool);
+    if (buf == NULL) {
+        // Every buffer is planned or queued, send them to get some back.
+        server_encode_planned(data);
+        server_flush(data, data->send_ring, metrics);
+        buf = pool_acquire(&data->pool);
+        if (buf == NULL)
+            EXIT_PRINT("Packet pool exhausted");
+    }
+    return buf;
+}
+
+// Queues `size` bytes of `buf` if the server-wide byte budget allows it, otherwise returns it to the pool.
+static bool server_queue_within(Server *const data, PacketBuffer *const buf, size_t const size, Address const *const addr, long *const tokens) {
+    if ((long) size > *tokens) {
+        pool_release(&data->pool, buf);
+        return false;
+    }
+
+    buf->addr = *addr;
+    buf->len = size;
+    server_queue(data, buf);
+    *tokens -= size;
+    return true;
+}
+
+// Copies the players into the client table and marks it consistent again, `len_mutex` must be held.
+// Only a persistent table is kept up to date, and positions only as of the last sender tick.
+static void server_commit(Server *const data) {
+    if (!data->persistent) return;
+
+    uint16_t const len = *data->len;
+    memcpy(data->table_players, data->players, len * sizeof (Player));
+    data->table->len = len;
+    data->table->next_id = data->next_id;
+    data->table->changing = false;
+}
+
+// Removes every client that has not been heard from in `DISCONNECT_TIMEOUT`.
+static void server_sweep(Server *const data, long const now) {
+    for (uint16_t i = 0; i < *data->len; i++) {
+        if (now - data->clnt_last[i] > DISCONNECT_TIMEOUT) {
+            printf("Client %s:%d has timed out\n", inet_ntoa(data->clnt_addrs[i].sin_addr), ntohs(data->clnt_addrs[i].sin_port));
+
+            mutex_lock(&data->len_mutex);
+            data->table->changing = true;
+            uint16_t len = *data->len;
+            if (i != len - 1) {
+                data->clnt_states[i] = data->clnt_states[len - 1];
+                data->clnt_last[i]   = data->clnt_last[len - 1];
+                data->clnt_addrs[i]  = data->clnt_addrs[len - 1];
+                data->clnt_tokens[i] = data->clnt_tokens[len - 1];
+                data->clnt_moved[i]  = data->clnt_moved[len - 1];
+                data->clnt_rates[i]  = data->clnt_rates[len - 1];
+                data->clnt_traces[i] = data->clnt_traces[len - 1];
+                data->clnt_peers[i]  = data->clnt_peers[len - 1];
+                data->players[i]     = data->players[len - 1];
+
+                // The slot of the removed client becomes the first free one.
+                uint16_t const slot = data->session_slots[i];
+                data->session_slots[i] = data->session_slots[len - 1];
+                data->session_slots[len - 1] = slot;
+                data->session_index[data->session_slots[i]] = i;
+            }
+
+            *data->len = --len;
+            data->relay.roster = data->relay.frame; // clients in lockstep mode need a SYNC without the player
+            server_commit(data);
+            mutex_unlock(&data->len_mutex);
+            i--;
+        }
+    }
+}
+
+// Steps every lockstep frame that is due, with the next input each client sent,
+// and plans what each client is sent this tick while `len_mutex` is held anyway.
+// That is the frames after the newest it has received, or a SYNC with every player if players joined or left since its last one,
+// it is further behind than the history, or it needs one for any other reason.
+static void server_lockstep_advance(Server *const data, long const now) {
+    LockstepRelay *const relay = &data->relay;
+
+    uint32_t due = relay->base_frame + (uint32_t) ((now - relay->base_time) * LOCKSTEP_RATE / 1000);
+    if (due - relay->frame > LOCKSTEP_CATCH_UP) {
+        relay->base_frame = relay->frame + LOCKSTEP_CATCH_UP;
+        relay->base_time = now;
+        due = relay->base_frame;
+    }
+
+    mutex_lock(&data->len_mutex);
+    uint16_t const len = *data->len;
+    while (relay->frame != due) {
+        uint32_t const frame = relay->frame + 1;
+        uint8_t *const inputs = &relay->inputs[frame % LOCKSTEP_HISTORY * data->max];
+
+        for (uint16_t i = 0; i < len; i++) {
+            LockstepPeer *const peer = &data->clnt_peers[i];
+            if (peer->queued > 0) {
+                peer->last = peer->queue[0];
+                memmove(peer->queue, peer->queue + 1, --peer->queued);
+            }
+            inputs[i] = peer->last;
+        }
+
+        lockstep_step(data->players, len, inputs);
+        relay->checksums[frame % LOCKSTEP_HISTORY] = lockstep_checksum(data->players, len);
+        relay->frame = frame;
+    }
+
+    bool sync = false;
+    for (uint16_t i = 0; i < len; i++) {
+        LockstepPeer const *const peer = &data->clnt_peers[i];
+        LockstepPlan *const plan = &relay->plans[i];
+        *plan = (LockstepPlan) {.frame = relay->frame, .roster = relay->roster, .input_ack = peer->next_seq};
+
+        if (peer->needs_sync || peer->roster != relay->roster || peer->reported != peer->roster || relay->frame - peer->received >= LOCKSTEP_HISTORY) {
+            // Unless the last one might still be on its way.
+            if (now - peer->synced_at >= LOCKSTEP_SYNC_INTERVAL) {
+                plan->send = LOCKSTEP_SEND_SYNC;
+                sync = true;
+            }
+        }
+        else if (peer->sent != relay->frame) {
+            // Every frame the client hasn't acknowledged is repeated, so a lost packet is made up for by the next one.
+            plan->send = LOCKSTEP_SEND_FRAMES;
+            plan->first = peer->received + 1;
+            plan->count = relay->frame - peer->received < LOCKSTEP_FRAMES_MAX ? relay->frame - peer->received : LOCKSTEP_FRAMES_MAX;
+        }
+    }
+
+    relay->len = len;
+    if (sync) memcpy(relay->sync_players, data->players, len * sizeof (Player));
+    mutex_unlock(&data->len_mutex);
+}
+
+// Brings every client that was sent a SYNC or FRAMES packet this tick up to date, with `len_mutex` taken once.
+static void server_lockstep_sent(Server *const data, long const now) {
+    LockstepRelay *const relay = &data->relay;
+
+    mutex_lock(&data->len_mutex);
+    for (uint16_t i = 0; i < relay->len; i++) {
+        LockstepPlan *const plan = &relay->plans[i];
+        if (!plan->sent) continue;
+        plan->sent = false;
+
+        LockstepPeer *const peer = &data->clnt_peers[i];
+        if (plan->send == LOCKSTEP_SEND_SYNC) {
+            peer->roster = plan->roster;
+            peer->synced = plan->frame;
+            peer->synced_at = now;
+            peer->received = plan->frame;
+            peer->needs_sync = false;
+        }
+        peer->sent = plan->frame;
+    }
+    mutex_unlock(&data->len_mutex);
+}
+
+// Queues what was planned for a client in lockstep mode, within the server-wide byte budget in `tokens`.
+// Returns false if the budget ran out.
+static bool server_queue_lockstep(Server *const data, uint16_t const client, long *const tokens, SendMetrics *const metrics) {
+    LockstepRelay const *const relay = &data->relay;
+
+    // A client that joined since the frames were stepped has no plan yet.
+    if (client >= relay->len) return true;
+    LockstepPlan *const plan = &relay->plans[client];
+    uint16_t const len = relay->len;
+
+    switch (plan->send) {
+        case LOCKSTEP_SEND_NONE:
+            return true;
+        case LOCKSTEP_SEND_SYNC: {
+            size_t const size = s2c_size_of(SYNC, len);
+            if ((long) size > *tokens) return false;
+
+            PacketBuffer *const buf = server_acquire(data, metrics);
+            S2CPacket *const packet = (S2CPacket *) buf->data;
+
+            packet->tag = SYNC;
+            packet->s_frame = plan->frame;
+            packet->s_roster = plan->roster;
+            packet->s_input_ack = plan->input_ack;
+            packet->s_len = len;
+            s2c_encode(packet, relay->sync_players);
+
+            DEBUG_PRINT("<<< Sending SYNC packet to %s:%d", inet_ntoa(data->clnt_addrs[client].sin_addr), ntohs(data->clnt_addrs[client].sin_port));
+
+            server_queue_within(data, buf, size, &data->clnt_addrs[client], tokens);
+        } break;
+        case LOCKSTEP_SEND_FRAMES: {
+            size_t const size = s2c_size_of(FRAMES, plan->count * len);
+            if ((long) size > *tokens) return false;
+
+            PacketBuffer *const buf = server_acquire(data, metrics);
+            S2CPacket *const packet = (S2CPacket *) buf->data;
+            uint32_t const trace = data->clnt_traces[client];
+
+            // Only the sender thread writes the inputs, so they can be read without `len_mutex`.
+            packet->tag = FRAMES;
+            packet->f_frame = plan->first;
+            packet->f_roster = plan->roster;
+            packet->f_input_ack = plan->input_ack;
+            packet->f_trace = trace;
+            packet->f_len = len;
+            packet->f_count = plan->count;
+            for (uint8_t i = 0; i < plan->count; i++)
+                memcpy(&packet->f_inputs[i * len], &relay->inputs[(plan->first + i) % LOCKSTEP_HISTORY * data->max], len);
+            s2c_encode(packet, NULL);
+
+            data->clnt_traces[client] = 0;
+
+            DEBUG_PRINT("<<< Sending FRAMES packet to %s:%d", inet_ntoa(data->clnt_addrs[client].sin_addr), ntohs(data->clnt_addrs[client].sin_port));
+
+            server_queue_within(data, buf, size, &data->clnt_addrs[client], tokens);
+            trace_mark(trace, TRACE_SERVER_SEND);
+        } break;
+    }
+
+    plan->sent = true;
+    return true;
+}
+
+// Takes a buffer for a POSITIONS packet that is written later, first writing and sending a full batch.
+static EncodeTask *server_plan(Server *const data, SendMetrics *const metrics) {
+    if (data->encode_len == ENCODE_BATCH) {
+        server_encode_planned(data);
+        server_flush(data, data->send_ring, metrics);
+    }
+
+    PacketBuffer *const buf = server_acquire(data, metrics);
+    EncodeTask *const task = &data->encode_tasks[data->encode_len++];
+    task->buf = buf;
+    return task;
+}
+
+// Sends to every client that is due, within the server-wide byte budget in `send_tokens`.
+// The packets are planned one client after the other, then written in parallel.
+static void server_tick(Server *const data, long const now, size_t *const next_client, long *const send_tokens, SendMetrics *const metrics) {
+    data->encode_now = now;
+
+    // Clients are visited round-robin starting where the previous tick stopped,
+    // so that the byte cap does not always starve the same clients.
+    uint16_t const len = *data->len;
+    size_t client = *next_client;
+    for (uint16_t visited = 0; visited < len; visited++, client = (client + 1) % len) {
+        if (client >= len) client = 0;
+
+        RateControl *const rc = &data->clnt_rates[client];
+        if (now < rc->next_send) continue;
+
+        bool throttled = false;
+        long interval = rc->interval;
+
+        switch (data->clnt_states[client]) {
+            case JOINING: {
+                PacketBuffer *const buf = server_acquire(data, metrics);
+                S2CPacket *const packet = (S2CPacket *) buf->data;
+
+                packet->tag = ACCEPT;
+                packet->a_max = data->max;
+                packet->a_id = data->players[client].id;
+                packet->a_token = data->clnt_tokens[client];
+                size_t const size = s2c_encode(packet, NULL);
+
+                DEBUG_PRINT("<<< Sending ACCEPT packet to %s:%d", inet_ntoa(data->clnt_addrs[client].sin_addr), ntohs(data->clnt_addrs[client].sin_port));
+
+                throttled = !server_queue_within(data, buf, size, &data->clnt_addrs[client], send_tokens);
+            } break;
+            case REJOINING: {
+                // The JOINING state exists so that the server knows it needs to send ACCEPT packets with the player id and session token.
+                // A rejoining client already knows its id, but its session is new, so it is sent ACCEPT packets just the same.
+                // We therefore don't need to store the REJOINING state on the server.
+                EXIT_PRINT("Client should not be in REJOINING state on the server");
+            } break;
+            case PLAYING: {
+                if (data->lockstep) {
+                    // Checked every tick, frames go out as soon as they are stepped.
+                    throttled = !server_queue_lockstep(data, client, send_tokens, metrics);
+                    interval = 0;
+                    break;
+                }
+
+                // When the budget is smaller than the player count, each send carries the next chunk of players.
+                // With GSO the chunk is split into frame-sized segments that go out in one call, otherwise it is one datagram.
+                uint16_t const offset = rc->offset < len ? rc->offset : 0;
+                uint16_t const budget = rc->budget < data->max_budget ? rc->budget : data->max_budget;
+                uint16_t const count = len - offset < budget ? len - offset : budget;
+                // An even player count keeps every segment aligned, so the client can parse a coalesced read in place.
+                // A budget of one player rounds down to nothing, it goes out as one unsplit packet.
+                uint16_t const rounded = (budget < SEGMENT_PLAYERS ? budget : SEGMENT_PLAYERS) & ~1;
+                uint16_t const segment = data->gso && rounded != 0 ? rounded : budget;
+
+                uint16_t sent = 0;
+                while (sent < count) {
+                    uint16_t const n = count - sent < segment ? count - sent : segment;
+                    // The echo rides on the first packet that goes out.
+                    uint32_t const trace = sent == 0 ? data->clnt_traces[client] : 0;
+                    long const size = s2c_size_of(POSITIONS, n);
+
+                    // Out of budget, the rest of the chunk is sent next time.
+                    if (size > *send_tokens) {
+                        throttled = true;
+                        break;
+                    }
+
+                    EncodeTask *const task = server_plan(data, metrics);
+                    task->buf->addr = data->clnt_addrs[client];
+                    task->buf->len = size;
+                    task->seq = rc->seq;
+                    task->offset = offset + sent;
+                    task->count = n;
+                    task->trace = trace;
+                    *send_tokens -= size;
+                    data->clnt_traces[client] = 0;
+
+                    rc->seq++;
+                    sent += n;
+                }
+
+                rc->offset = offset + sent < len ? offset + sent : 0;
+
+                DEBUG_PRINT("<<< Sending POSITIONS packets to %s:%d", inet_ntoa(data->clnt_addrs[client].sin_addr), ntohs(data->clnt_addrs[client].sin_port));
+            } break;
+        }
+
+        if (throttled) {
+            // Out of budget for this tick, continue from this client on the next one.
+            metrics->throttled++;
+            break;
+        }
+
+        rc->next_send = now + interval;
+    }
+    *next_client = client;
+
+    if (data->lockstep) server_lockstep_sent(data, now);
+
+    server_encode_planned(data);
+    server_flush(data, data->send_ring, metrics);
+}
+
+// Moves the calling server thread to `cpu` and makes it real-time, as far as low-latency mode asks for.
+static void low_latency_enter(LowLatency const *const ll, int const cpu, char const *const thread) {
+    if (!ll->on) return;
+
+    if (cpu >= 0 && !thread_pin(cpu))
+        printf("Failed to pin server %s thread to processor %d: %s\n", thread, cpu, threads_get_error());
+    if (ll->priority > 0 && !thread_set_realtime(ll->priority))
+        printf("Failed to make server %s thread real-time: %s\n", thread, threads_get_error());
+}
+
+// Waits for the next tick and records how many microseconds late it started.
+// Normally that is a sleep of a tick, late by however long the operating system takes to wake the thread.
+// In low-latency mode the thread spins until `*deadline`, which moves on by a tick each time, so ticks keep a steady rate
+// however long the work in between took. A tick that overran the next deadline starts the schedule over from now.
+static void server_wait_tick(Server const *const data, long long *const deadline, SendMetrics *const metrics) {
+    long long now;
+    if (!data->low_latency.on) {
+        if (!time_get_monotonic_us(&now))
+            EXIT_PRINT("Failed to get time: %s", threads_get_error());
+        *deadline = now + SENDER_TICK * 1000LL;
+        thread_sleep_ms(SENDER_TICK);
+        if (!time_get_monotonic_us(&now))
+            EXIT_PRINT("Failed to get time: %s", threads_get_error());
+    }
+    else {
+        *deadline += SENDER_TICK * 1000LL;
+        while (true) {
+            if (!time_get_monotonic_us(&now))
+                EXIT_PRINT("Failed to get time: %s", threads_get_error());
+            if (now >= *deadline || data->should_stop) break;
+            thread_pause();
+        }
+    }
+
+    long long const late = now > *deadline ? now - *deadline : 0;
+    if (late > SENDER_TICK * 1000LL) *deadline = now;
+
+    int bucket = 0;
+    while (bucket < JITTER_BUCKETS - 1 && late >= 1LL << bucket) bucket++;
+    metrics->jitter[bucket]++;
+    if (late > metrics->jitter_max) metrics->jitter_max = late;
+}
+
 static void server_thread_sender(Server *const data) {
     printf("starting server sender thread\n");
+    low_latency_enter(&data->low_latency, data->low_latency.sender_cpu, "sender");
 
-    S2CPacket *packet = malloc(sizeof (S2CPacket) + data->max * sizeof (Player));
     size_t next_client = 0;
 
+    long now;
+    if (!time_get_monotonic(&now))
+        EXIT_PRINT("Failed to get time: %s", threads_get_error());
+
+    long send_tokens = SEND_BYTES_BURST;
+    long last_refill = now;
+    SendMetrics metrics = {.since = now};
+
+    long long deadline;
+    if (!time_get_monotonic_us(&deadline))
+        EXIT_PRINT("Failed to get time: %s", threads_get_error());
+
+    // Lockstep frames continue from where the last sender stopped.
+    data->relay.base_frame = data->relay.frame;
+    data->relay.base_time = now;
+
     while (true) {
         if (data->should_stop) break;
 
         fflush(stdout);
 
-        thread_sleep_ms(SENDER_DELAY);
+        server_wait_tick(data, &deadline, &metrics);
 
-        /* Check if any clients have disconnected */ {
-            long now;
-            if (!time_get_monotonic(&now))
-                EXIT_PRINT("Failed to get time: %s", threads_get_error());
+        if (!time_get_monotonic(&now))
+            EXIT_PRINT("Failed to get time: %s", threads_get_error());
 
-            for (uint16_t i = 0; i < *data->len; i++) {
-                if (now - data->clnt_last[i] > DISCONNECT_TIMEOUT) {
-                    printf("Client %s:%d has timed out\n", inet_ntoa(data->clnt_addrs[i].sin_addr), ntohs(data->clnt_addrs[i].sin_port));
-
-                    mutex_lock(&data->len_mutex);
-                    uint16_t len = *data->len;
-                    if (i != len - 1) {
-                        data->clnt_states[i] = data->clnt_states[len - 1];
-                        data->clnt_last[i]   = data->clnt_last[len - 1];
-                        data->clnt_addrs[i]  = data->clnt_addrs[len - 1];
-                        data->players[i]     = data->players[len - 1];
-                    }
-
-                    *data->len = --len;
-                    mutex_unlock(&data->len_mutex);
-                    i--;
-                }
-            }
+        /* Check if any clients have disconnected */ {
+            server_sweep(data, now);
 
             if (*data->len == 0) {
                 // The `*data->len` being 0 is unlikely and locking the mutex is relatively expensive.
                 // So we check it first and then lock and check again.
                 mutex_lock(&data->len_mutex);
                 if (*data->len == 0) {
-                    Thread sender = data->sender;
-                    data->sender = THREAD_NULL; // So we don't attempt to join it
+                    data->sending = false; // joined by `server_start_sender` or when stopping the server
+                    mutex_unlock(&data->len_mutex);
+
+                    printf("All clients have disconnected\n");
+                    break;
+                }
+                mutex_unlock(&data->len_mutex);
+            }
+        }
+
+        if (data->lockstep) server_lockstep_advance(data, now);
+
+        if (data->persistent) {
+            mutex_lock(&data->len_mutex);
+            server_commit(data);
+            mutex_unlock(&data->len_mutex);
+        }
+
+        // Only copies into the mapped file, so the tick never waits on a write.
+        replay_record_tick(&data->replay, now, data->players, *data->len);
+
+        /* Refill the server-wide byte budget */ {
+            send_tokens += (now - last_refill) * SEND_BYTES_PER_SECOND / 1000;
+            if (send_tokens > SEND_BYTES_BURST) send_tokens = SEND_BYTES_BURST;
+            last_refill = now;
+        }
+
+        server_print_metrics(data, &metrics, now);
+
+        if (data->send_ring == NULL) {
+            short ev;
+            if (!socket_poll(data->serv_fd, POLLOUT, &ev, POLL_TIMEOUT))
+                EXIT_PRINT("Failed to poll for write on server socket: %s", sockets_get_error());
+
+            if (ev == 0) {
+                printf("send loop timed out\n");
+                continue;
+            }
+        }
+
+        server_tick(data, now, &next_client, &send_tokens, &metrics);
+    }
+
+    printf("stopping server sender thread\n");
+
+    server_flush(data, data->send_ring, NULL);
+}
+
+// Returns whether a packet from this source ip may be processed.
+// Slots are shared by hash, so a new ip takes over a colliding slot with a full bucket.
+// That keeps the table fixed-size, and a spoofed flood can only reset buckets, never grow state.
+static bool limiter_allow(SourceBucket *const limiter, uint32_t const ip, bool const handshake, long const now) {
+    SourceBucket *const b = &limiter[(ip * 2654435769u) >> 20 & (LIMIT_SLOTS - 1)];
+
+    if (b->ip != ip) {
+        *b = (SourceBucket) {
+            .ip = ip,
+            .last = now,
+            .tokens = LIMIT_BURST * 1000,
+            .handshake_tokens = LIMIT_HANDSHAKE_BURST * 1000,
+        };
+    }
+
+    long const elapsed = now - b->last;
+    b->last = now;
+
+    b->tokens += elapsed * LIMIT_RATE;
+    if (b->tokens > LIMIT_BURST * 1000) b->tokens = LIMIT_BURST * 1000;
+
+    b->handshake_tokens += elapsed * LIMIT_HANDSHAKE_RATE;
+    if (b->handshake_tokens > LIMIT_HANDSHAKE_BURST * 1000) b->handshake_tokens = LIMIT_HANDSHAKE_BURST * 1000;
+
+    if (b->tokens < 1000) return false;
+    if (handshake && b->handshake_tokens < 1000) return false;
+
+    b->tokens -= 1000;
+    if (handshake) b->handshake_tokens -= 1000;
+    return true;
+}
+
+// Answers a JOIN or REJOIN without a valid cookie.
+// The reply is never larger than the request, so it cannot be used for amplification.
+static void server_send_challenge(Server *const data, Address const *const clnt_addr, long const now) {
+    PacketBuffer *const buf = pool_acquire(&data->pool);
+    if (buf == NULL) {
+        DEBUG_PRINT("Dropped CHALLENGE packet, packet pool exhausted");
+        return;
+    }
+
+    S2CPacket *const packet = (S2CPacket *) buf->data;
+    packet->tag = CHALLENGE;
+    packet->c_cookie = cookie_make(&data->cookies, clnt_addr, now);
+    buf->addr = *clnt_addr;
+    buf->len = s2c_encode(packet, NULL);
+
+    DEBUG_PRINT("<<< Sending CHALLENGE packet to %s:%d", inet_ntoa(clnt_addr->sin_addr), ntohs(clnt_addr->sin_port));
+
+    // Sent right away, the sender thread only runs once someone has joined.
+    // Not through `send_queue`, which would take the sender's packets along on the receiver's ring.
+    // With io_uring the receiver's next `uring_wait` submits it.
+    PacketBuffer *const batch[] = {buf};
+    server_send(data, data->recv_ring, batch, 1);
+}
+
+// Returns the index of the client with this address, or -1.
+// `*data->len` might be decremented by the sender thread meanwhile, but that's okay.
+static int server_find_addr(Server const *const data, Address const *const addr) {
+    uint16_t const len = *data->len;
+    for (uint16_t i = 0; i < len; i++) {
+        if (SOCK_ADDR_IN_EQ(data->clnt_addrs[i], (*addr)))
+            return i;
+    }
+    return -1;
+}
+
+// A session token is 48 random bits above the client's session slot, so the client is found from it without a search
+// and one client's token says nothing about another's. Never 0, which is what a client sends before it has a session.
+static uint64_t session_token(uint16_t const slot) {
+    uint64_t bits;
+    if (!random_fill(&bits, sizeof bits))
+        EXIT_PRINT("Failed to generate session token: %s", random_get_error());
+
+    bits &= ~(uint64_t) UINT16_MAX;
+    if (bits == 0) bits = (uint64_t) 1 << 16;
+    return bits | slot;
+}
+
+// Gives the client just added at `client` the first free session slot, and a new token for it.
+// `len_mutex` must be held.
+static void session_open(Server *const data, uint16_t const client) {
+    uint16_t const slot = data->session_slots[client];
+    data->clnt_tokens[client] = session_token(slot);
+    data->session_index[slot] = client;
+}
+
+// Returns the index of the client holding this session token, or -1.
+// Like `server_find_addr`, the client might be moved or removed by the sender thread meanwhile.
+static int server_find_token(Server const *const data, uint64_t const token) {
+    uint16_t const slot = token & UINT16_MAX;
+    if (token == 0 || slot >= data->max) return -1;
+
+    uint16_t const client = data->session_index[slot];
+    if (client >= *data->len || data->clnt_tokens[client] != token) return -1;
+    return client;
+}
+
+// Points the client holding `token` at the address it was last heard from, after its NAT picked a new port or it changed networks.
+// `number` is the packet's `p_number`. Packets sent before the one that last moved the client came from where it was before,
+// so one of them arriving late doesn't move the client back.
+static void server_migrate(Server *const data, int const client, uint64_t const token, uint32_t const number, Address const *const addr) {
+    if (SOCK_ADDR_IN_EQ(data->clnt_addrs[client], (*addr))) return;
+
+    mutex_lock(&data->len_mutex);
+    // The client might have been moved since it was looked up.
+    if (client < *data->len && data->clnt_tokens[client] == token) {
+        if ((int32_t) (number - data->clnt_moved[client]) > 0) {
+            printf("Player %u moved to %s:%d\n", data->players[client].id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+            data->clnt_addrs[client] = *addr;
+            data->clnt_moved[client] = number;
+        }
+        else {
+            DEBUG_PRINT("Packet %u of player %u arrived late from %s:%d, where it was before", number, data->players[client].id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        }
+    }
+    mutex_unlock(&data->len_mutex);
+}
+
+// Returns the index of the client playing this player id, or -1.
+static int server_find_id(Server const *const data, uint32_t const id) {
+    uint16_t const len = *data->len;
+    for (uint16_t i = 0; i < len; i++) {
+        if (data->players[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+// Starts the sender thread unless it is running or the server is stopping, `len_mutex` must be held.
+// A sender that stopped by itself is joined first, so at most one ever runs.
+static void server_start_sender(Server *const data) {
+    if (data->sending || data->should_stop) return;
+
+    if (!thread_is_null(data->sender) && !thread_close(data->sender))
+        EXIT_PRINT("Failed to join server sender thread: %s", threads_get_error());
+
+    if (!thread_spawn(&data->sender, (void (*)(void *)) server_thread_sender, data))
+        EXIT_PRINT("Failed to create server sender thread: %s", threads_get_error());
+    data->sending = true;
+}
+
+// Queues the inputs of an INPUTS packet that haven't been received before and compares the client's checksum with the server's.
+// `len_mutex` must be held.
+static void server_lockstep_receive(Server *const data, int const client, C2SPacket const *const packet) {
+    LockstepRelay const *const relay = &data->relay;
+    LockstepPeer *const peer = &data->clnt_peers[client];
+
+    uint32_t const seq = packet->i_seq;
+    uint8_t const count = packet->i_count < LOCKSTEP_INPUT_WINDOW ? packet->i_count : LOCKSTEP_INPUT_WINDOW;
+
+    // Inputs that fell out of the client's window were lost for good.
+    if ((int32_t) (seq - peer->next_seq) > 0) peer->next_seq = seq;
+
+    for (uint8_t i = 0; i < count; i++) {
+        if (seq + i != peer->next_seq) continue;
+
+        if (peer->queued == LOCKSTEP_QUEUE)
+            memmove(peer->queue, peer->queue + 1, --peer->queued);
+        peer->queue[peer->queued++] = packet->i_inputs[i];
+        peer->next_seq++;
+    }
+
+    // What the client reports about frames is only about ours once it has the last SYNC.
+    peer->reported = packet->i_roster;
+    if (peer->reported != peer->roster) return;
+
+    uint32_t const received = packet->i_received;
+    if ((int32_t) (received - peer->received) > 0 && (int32_t) (received - relay->frame) <= 0)
+        peer->received = received;
+
+    // Only frames stepped since the last SYNC and still in the history can be compared.
+    uint32_t const frame = packet->i_frame;
+    if (
+        peer->roster == relay->roster
+        && (int32_t) (frame - peer->synced) > 0
+        && (int32_t) (frame - relay->frame) <= 0
+        && relay->frame - frame < LOCKSTEP_HISTORY
+        && packet->i_checksum != relay->checksums[frame % LOCKSTEP_HISTORY]
+    ) {
+        if (!peer->needs_sync)
+            printf("Player %u is out of sync at frame %u, sending a SYNC\n", data->players[client].id, frame);
+        peer->needs_sync = true;
+    }
+}
+
+// Handles one client packet, decoded into a copy, so `payload` is left as it was received.
+static void server_handle_packet(Server *const data, void const *const payload, int const nread, Address const *const source) {
+    Address const clnt_addr = *source;
+
+    DEBUG_PRINT("> Received %ld bytes from %s:%d", (long) nread, inet_ntoa(clnt_addr.sin_addr), ntohs(clnt_addr.sin_port));
+
+    long now;
+    if (!time_get_monotonic(&now))
+        EXIT_PRINT("Failed to get time: %s", threads_get_error());
+
+    // Copied out, since the same buffer might be handed to us again.
+    C2SPacket decoded;
+    if (!c2s_decode(&decoded, payload, nread)) {
+        DEBUG_PRINT("Dropped packet with invalid size %d or unknown tag", nread);
+        return;
+    }
+    C2SPacket const *const packet = &decoded;
+
+    if (!limiter_allow(data->limiter, clnt_addr.sin_addr.s_addr, packet->tag == JOIN || packet->tag == REJOIN, now)) {
+        DEBUG_PRINT("Dropped packet from rate limited source %s", inet_ntoa(clnt_addr.sin_addr));
+        return;
+    }
+
+    switch (packet->tag) {
+        case JOIN: {
+            DEBUG_PRINT(">>> Received JOIN packet");
+
+            // No state is allocated for an address until it has shown that it can receive from us.
+            if (!cookie_check(&data->cookies, &clnt_addr, packet->j_cookie, now)) {
+                server_send_challenge(data, &clnt_addr, now);
+                return;
+            }
+
+            if (*data->len == data->max) {
+                printf("Client sent JOIN packet but server is full\n");
+                return;
+            }
+
+            if (server_find_addr(data, &clnt_addr) >= 0) {
+                printf("Client sent JOIN packet but has already joined\n");
+                return;
+            }
+
+            mutex_lock(&data->len_mutex);
+            data->table->changing = true;
+            uint16_t const len = *data->len; // in case it was changed
+
+            data->clnt_addrs[len]  = clnt_addr;
+            data->clnt_last[len]   = now;
+            data->clnt_states[len] = JOINING;
+            data->clnt_traces[len] = 0;
+            data->clnt_moved[len]  = 0;
+            session_open(data, len);
+            rate_init(&data->clnt_rates[len], data->max_budget, now);
+            peer_init(&data->clnt_peers[len], now);
+            data->players[len]     = (Player) {
+                .id = data->next_id++,//rand(),
+                .pos.x = 0,
+                .pos.y = 0,
+            };
+            *data->len = len + 1;
+            data->relay.roster = data->relay.frame;
+            server_commit(data);
+            server_start_sender(data);
+            mutex_unlock(&data->len_mutex);
+
+            printf("Added player %u\n", data->players[len].id);
+        } break;
+        case REJOIN: {
+            uint32_t id = packet->r_player.id;
+
+            DEBUG_PRINT(">>> Received REJOIN packet");
+
+            if (!cookie_check(&data->cookies, &clnt_addr, packet->r_cookie, now)) {
+                server_send_challenge(data, &clnt_addr, now);
+                return;
+            }
+
+            // The session is still there, the client has only stopped hearing from us, likely after moving.
+            int const session = server_find_token(data, packet->r_token);
+            if (session >= 0) {
+                server_migrate(data, session, packet->r_token, packet->r_number, &clnt_addr);
+                data->clnt_last[session] = now;
+                return;
+            }
 
-                    printf("All clients have disconnected\n");
-                    thread_detach(sender);
-                    goto all_disconnected; // the lock will be released when the function returns
+            if (*data->len == data->max) {
+                printf("Client sent REJOIN packet but server is full\n");
+                return;
+            }
+
+            int const existing = server_find_id(data, id);
+            if (existing >= 0) {
+                if (!SOCK_ADDR_IN_EQ(data->clnt_addrs[existing], clnt_addr)) {
+                    printf("Client sent REJOIN packet but is already joined with a different address\n");
+                    return;
                 }
-                mutex_unlock(&data->len_mutex);
+
+                printf("Client sent REJOIN packet and is already joined\n");
+                return;
             }
-        }
 
-        short ev;
-        if (!socket_poll(data->serv_fd, POLLOUT, &ev, POLL_TIMEOUT))
-            EXIT_PRINT("Failed to poll for write on server socket: %s", sockets_get_error());
+            mutex_lock(&data->len_mutex);
+            data->table->changing = true;
+            uint16_t const len = *data->len; // in case it was changed
+
+            data->clnt_addrs[len]  = clnt_addr;
+            data->clnt_last[len]   = now;
+            data->clnt_states[len] = JOINING; // ACCEPT packets hand out the new session token.
+            data->clnt_traces[len] = 0;
+            data->clnt_moved[len]  = packet->r_number;
+            session_open(data, len);
+            rate_init(&data->clnt_rates[len], data->max_budget, now);
+            peer_init(&data->clnt_peers[len], now);
+            data->players[len]     = (Player) {
+                .id = id,
+                .pos.x = packet->r_player.pos.x,
+                .pos.y = packet->r_player.pos.y,
+            };
+            *data->len = len + 1;
+            data->relay.roster = data->relay.frame;
+            server_commit(data);
+            server_start_sender(data);
+            mutex_unlock(&data->len_mutex);
+
+            printf("Rejoined player %u\n", id);
+        } break;
+        case POSITION: {
+            int const i = server_find_token(data, packet->p_token);
+            if (i < 0) {
+                DEBUG_PRINT("Dropped POSITION packet with unknown session token");
+                return;
+            }
+            server_migrate(data, i, packet->p_token, packet->p_number, &clnt_addr);
 
-        if (ev == 0) {
-            printf("send loop timed out\n");
-            continue;
-        }
+            DEBUG_PRINT(">>> Received POSITION packet for player %u", data->players[i].id);
 
-        switch (data->clnt_states[next_client]) {
-            case JOINING: {
-                packet->tag = ACCEPT;
-                packet->a_max = htons(data->max);
-                packet->a_id = htonl(data->players[next_client].id);
+            // If the sender thread disconnects the client,
+            // then this will set the values to the wrong client.
+            // TODO: Is this a problem?
 
-                DEBUG_PRINT("<<< Sending ACCEPT packet to %s:%d", inet_ntoa(data->clnt_addrs[next_client].sin_addr), ntohs(data->clnt_addrs[next_client].sin_port));
-            } break;
-            case REJOINING: {
-                // The JOINING state exists so that the server knows it needs to send ACCEPT packets with the player id.
-                // But when rejoining, the client already knows its id, so the server can just send the POSITIONS packets.
-                // We therefore don't need to store the REJOINING state on the server.
-                EXIT_PRINT("Client should not be in REJOINING state on the server");
-            } break;
-            case PLAYING: {
-                packet->tag = POSITIONS;
-                packet->p_len = htons(*data->len);
-
-                for (uint16_t i = 0; i < *data->len; i++) {
-                    packet->p_players[i] = (Player) {
-                        .id = htonl(data->players[i].id),
-                        .pos.x = htonl(data->players[i].pos.x),
-                        .pos.y = htonl(data->players[i].pos.y),
-                    };
-                }
+            data->clnt_last[i]   = now;
+            data->clnt_states[i] = PLAYING;
 
-                DEBUG_PRINT("<<< Sending POSITIONS packet to %s:%d", inet_ntoa(data->clnt_addrs[next_client].sin_addr), ntohs(data->clnt_addrs[next_client].sin_port));
-            } break;
-        }
+            // Sent until the client hears that the server relays inputs, positions only come from the inputs then.
+            if (data->lockstep) return;
+
+            data->players[i].pos = packet->p_pos;
+            rate_on_feedback(&data->clnt_rates[i], data->max_budget, packet, now);
 
-        Address *clnt_addr = &data->clnt_addrs[next_client];
-        if (!socket_sendto_inet(data->serv_fd, packet, sizeof (S2CPacket), clnt_addr))
-            EXIT_PRINT("Failed to send to client: %s", sockets_get_error());
+            uint32_t const trace = packet->p_trace;
+            if (trace != 0) {
+                trace_mark(trace, TRACE_SERVER_RECEIVE);
+                data->clnt_traces[i] = trace;
+                atomic_store_explicit(&data->trace, trace, memory_order_relaxed);
+            }
 
-        DEBUG_PRINT("< Send %llu bytes to %s:%d", sizeof (S2CPacket), inet_ntoa(clnt_addr->sin_addr), ntohs(clnt_addr->sin_port));
+            DEBUG_PRINT("Updated player %u position to (%u, %u)", data->players[i].id, data->players[i].pos.x, data->players[i].pos.y);
 
-        next_client = (next_client + 1) % *data->len;
-    }
-    goto skip_unlock;
+            return;
+        } break;
+        case INPUTS: {
+            int const i = server_find_token(data, packet->i_token);
+            if (i < 0) {
+                DEBUG_PRINT("Dropped INPUTS packet with unknown session token");
+                return;
+            }
+            server_migrate(data, i, packet->i_token, packet->i_number, &clnt_addr);
+            if (!data->lockstep) {
+                DEBUG_PRINT("Dropped INPUTS packet, not in lockstep mode");
+                return;
+            }
 
-all_disconnected:
-    mutex_unlock(&data->len_mutex); // from the `len == 0` check
-skip_unlock:
+            DEBUG_PRINT(">>> Received INPUTS packet for player %u", data->players[i].id);
 
-    printf("stopping server sender thread\n");
+            data->clnt_last[i]   = now;
+            data->clnt_states[i] = PLAYING;
+
+            mutex_lock(&data->len_mutex);
+            server_lockstep_receive(data, i, packet);
+            mutex_unlock(&data->len_mutex);
 
-    free(packet);
+            uint32_t const trace = packet->i_trace;
+            if (trace != 0) {
+                trace_mark(trace, TRACE_SERVER_RECEIVE);
+                data->clnt_traces[i] = trace;
+                atomic_store_explicit(&data->trace, trace, memory_order_relaxed);
+            }
+        } break;
+    }
 }
 
 static void server_thread_receiver(Server *const data) {
     printf("starting server receiver thread\n");
+    low_latency_enter(&data->low_latency, data->low_latency.receiver_cpu, "receiver");
 
-    if (*data->len != 0)
-        EXIT_PRINT("Player list must be empty");
+    // In low-latency mode waiting never blocks, the thread keeps checking for datagrams instead.
+    int const timeout = data->low_latency.on ? 0 : POLL_TIMEOUT;
+
+    if (data->recv_ring != NULL) {
+        // Datagrams arrive through the multishot receive, `server_handle_packet` is called from `uring_wait`.
+        while (!data->should_stop) {
+            fflush(stdout);
+
+            if (!uring_wait(data->recv_ring, timeout))
+                EXIT_PRINT("Failed to receive from client: %s", uring_get_error());
+        }
 
-    C2SPacket packet;
+        printf("stopping server receiver thread\n");
+        return;
+    }
 
-    uint32_t next_id = 0;
+    // Received into, and decoded from by `server_handle_packet`, reused for every packet.
+    PacketBuffer *const buf = pool_acquire(&data->pool);
+    if (buf == NULL)
+        EXIT_PRINT("Packet pool exhausted");
 
-next_loop:
     while (true) {
         if (data->should_stop) break;
 
         fflush(stdout);
 
         short ev;
-        if (!socket_poll(data->serv_fd, POLLIN, &ev, POLL_TIMEOUT))
+        if (!socket_poll(data->serv_fd, POLLIN, &ev, timeout))
             EXIT_PRINT("Failed to poll for read on server socket: %s", sockets_get_error());
 
         if (ev == 0) {
-            printf("receive loop timed out\n");
+            if (timeout == 0) thread_pause();
+            else printf("receive loop timed out\n");
             continue;
         }
 
-        Address clnt_addr;
-        int nread;
-        if (!socket_recvfrom_inet(data->serv_fd, &packet, sizeof (C2SPacket), &nread, &clnt_addr))
+        if (!socket_recvfrom_inet(data->serv_fd, buf->data, data->pool.capacity, &buf->len, &buf->addr))
             EXIT_PRINT("Failed to receive from client: %s", sockets_get_error());
 
-        DEBUG_PRINT("> Received %ld bytes from %s:%d", (long) nread, inet_ntoa(clnt_addr.sin_addr), ntohs(clnt_addr.sin_port));
+        server_handle_packet(data, buf->data, buf->len, &buf->addr);
+    }
 
-        switch (packet.tag) {
-            case JOIN: {
-                DEBUG_PRINT(">>> Received JOIN packet");
+    pool_release(&data->pool, buf);
 
-                if (*data->len == data->max) {
-                    printf("Client sent JOIN packet but server is full\n");
-                    goto next_loop;
-                }
+    printf("stopping server receiver thread\n");
+}
 
-                uint16_t len = *data->len;
-                for (uint16_t i = 0; i < len; i++) { // len might have been decremented by the sender thread, but that's okay.
-                    if (SOCK_ADDR_IN_EQ(data->clnt_addrs[i], clnt_addr)) {
-                        printf("Client sent JOIN packet but has already joined\n");
-                        goto next_loop;
-                    }
-                }
+// The socket backend is picked at startup: io_uring where the kernel supports it, poll otherwise.
+// Setting NET_SOCKET_BACKEND=poll forces the poll backend.
+static void server_init_backend(Server *const data) {
+    data->recv_ring = NULL;
+    data->send_ring = NULL;
 
-                long now;
-                if (!time_get_monotonic(&now))
-                    EXIT_PRINT("Failed to get time: %s", threads_get_error());
+    char const *const backend = getenv("NET_SOCKET_BACKEND");
+    if (backend != NULL && strcmp(backend, "poll") == 0) {
+        printf("using poll socket backend\n");
+        return;
+    }
 
-                mutex_lock(&data->len_mutex);
-                len = *data->len; // in case it was changed
-
-                data->clnt_addrs[len]  = clnt_addr;
-                data->clnt_last[len]   = now;
-                data->clnt_states[len] = JOINING;
-                data->players[len]     = (Player) {
-                    .id = next_id++,//rand(),
-                    .pos.x = 0,
-                    .pos.y = 0,
-                };
-                *data->len = len + 1;
-                mutex_unlock(&data->len_mutex);
+    if (!uring_init(&data->recv_ring, data->serv_fd, true, sizeof (C2SPacket), (uring_received_t *) server_handle_packet, (uring_sent_t *) server_sent, data)) {
+        printf("io_uring socket backend unavailable, using poll: %s\n", uring_get_error());
+        data->recv_ring = NULL;
+        return;
+    }
 
-                printf("Added player %u\n", data->players[len].id);
-            } break;
-            case REJOIN: {
-                uint32_t id = ntohl(packet.r_player.id);
+    if (!uring_init(&data->send_ring, data->serv_fd, false, 0, NULL, (uring_sent_t *) server_sent, data)) {
+        printf("io_uring socket backend unavailable, using poll: %s\n", uring_get_error());
+        uring_close(data->recv_ring);
+        data->recv_ring = NULL;
+        data->send_ring = NULL;
+        return;
+    }
 
-                DEBUG_PRINT(">>> Received REJOIN packet");
+    printf("using io_uring socket backend\n");
+}
 
-                if (*data->len == data->max) {
-                    printf("Client sent REJOIN packet but server is full\n");
-                    goto next_loop;
-                }
+// UDP segmentation offload is used where the kernel supports it.
+// Setting NET_UDP_OFFLOAD=off disables it.
+static bool udp_offload_allowed(void) {
+    char const *const offload = getenv("NET_UDP_OFFLOAD");
+    return offload == NULL || strcmp(offload, "off") != 0;
+}
 
-                uint16_t len = *data->len;
-                for (uint16_t i = 0; i < len; i++) {
-                    if (data->players[i].id == id) {
-                        if (!SOCK_ADDR_IN_EQ(data->clnt_addrs[i], clnt_addr)) {
-                            printf("Client sent REJOIN packet but is already joined with a different address\n");
-                            goto next_loop;
-                        }
+// Snapshots are encoded by the sender and one worker per other processor.
+// Setting NET_ENCODE_THREADS=<n> runs `n` workers instead.
+static int encode_threads(void) {
+    char const *const threads = getenv("NET_ENCODE_THREADS");
+    return threads != NULL ? atoi(threads) : -1;
+}
 
-                        printf("Client sent REJOIN packet and is already joined\n");
-                        goto next_loop;
-                    }
-                }
+// The client table of a server that doesn't keep it in a file is one block of memory sized for `max` clients up front.
+// Setting NET_HUGE_PAGES=on puts it on huge pages, so walking the arrays of a large match misses the TLB less.
+static bool huge_pages_wanted(void) {
+    char const *const huge = getenv("NET_HUGE_PAGES");
+    return huge != NULL && strcmp(huge, "on") == 0;
+}
 
-                long now;
-                if (!time_get_monotonic(&now))
-                    EXIT_PRINT("Failed to get time: %s", threads_get_error());
+// Setting NET_LOW_LATENCY=on turns on low-latency mode, and NET_LOW_LATENCY=<receiver cpu>,<sender cpu> also pins the threads.
+// Setting NET_REALTIME_PRIORITY=<1-99> runs them under SCHED_FIFO in low-latency mode, give each its own processor then.
+static LowLatency low_latency_setting(void) {
+    LowLatency ll = {.on = false, .receiver_cpu = -1, .sender_cpu = -1, .priority = 0};
 
-                mutex_lock(&data->len_mutex);
-                len = *data->len; // in case it was changed
-
-                data->clnt_addrs[len]  = clnt_addr;
-                data->clnt_last[len]   = now;
-                data->clnt_states[len] = PLAYING; // We don't need to send ACCEPT packets, so just go straight to PLAYING.
-                data->players[len]     = (Player) {
-                    .id = id,
-                    .pos.x = ntohl(packet.r_player.pos.x),
-                    .pos.y = ntohl(packet.r_player.pos.y),
-                };
-                *data->len = len + 1;
-                mutex_unlock(&data->len_mutex);
+    char const *const mode = getenv("NET_LOW_LATENCY");
+    if (mode == NULL || strcmp(mode, "off") == 0) return ll;
 
-                printf("Rejoined player %u\n", id);
-            } break;
-            case POSITION: {
-                uint16_t len = *data->len;
-                for (uint16_t i = 0; i < len; i++) {
-                    if (SOCK_ADDR_IN_EQ(data->clnt_addrs[i], clnt_addr)) {
-                        uint32_t id = data->players[i].id;
-
-                        DEBUG_PRINT(">>> Received POSITION packet for player %u", id);
-                
-                        long now;
-                        if (!time_get_monotonic(&now))
-                            EXIT_PRINT("Failed to get time: %s", threads_get_error());
-
-                        // If the sender thread disconnects the client,
-                        // then this will set the values to the wrong client.
-                        // TODO: Is this a problem?
-
-                        data->clnt_last[i]   = now;
-                        data->clnt_states[i] = PLAYING;
-                        data->players[i].pos.x = ntohl(packet.p_pos.x);
-                        data->players[i].pos.y = ntohl(packet.p_pos.y);
-                        
-                        DEBUG_PRINT("Updated player %u position to (%u, %u)", id, data->players[i].pos.x, data->players[i].pos.y);
-                    }
-                }
+    ll.on = true;
+    if (strcmp(mode, "on") != 0 && sscanf(mode, "%d,%d", &ll.receiver_cpu, &ll.sender_cpu) != 2) {
+        printf("NET_LOW_LATENCY must be on or <receiver cpu>,<sender cpu>, not pinning threads\n");
+        ll.receiver_cpu = -1;
+        ll.sender_cpu = -1;
+    }
 
-                goto next_loop;
-            } break;
-        }
+    char const *const priority = getenv("NET_REALTIME_PRIORITY");
+    if (priority != NULL) ll.priority = atoi(priority);
 
-        // if first connection
-        if (*data->len == 1) {
-            if (!thread_spawn(&data->sender, (void (*)(void *)) server_thread_sender, data))
-                EXIT_PRINT("Failed to create server sender thread: %s", threads_get_error());
-        }
+    return ll;
+}
+
+// Sets up what is tied to this build of the code: packet buffers, io_uring instances calling back into it, and threads.
+static void server_start(Server *const data) {
+    // Every packet buffer is allocated here, the packet path never allocates.
+    int const capacity = sizeof (S2CPacket) + data->max_budget * sizeof (Player);
+    if (!pool_init(&data->pool, SERVER_POOL_BUFFERS, capacity > (int) sizeof (C2SPacket) ? capacity : (int) sizeof (C2SPacket)))
+        EXIT_PRINT("Failed to allocate packet pool");
+    if (!queue_init(&data->send_queue, SERVER_POOL_BUFFERS))
+        EXIT_PRINT("Failed to allocate send queue");
+
+    data->encode_tasks = malloc(ENCODE_BATCH * sizeof (EncodeTask));
+    data->encode_len = 0;
+    if (!jobs_init(&data->jobs, encode_threads()))
+        EXIT_PRINT("Failed to start encoding threads: %s", threads_get_error());
+
+    server_init_backend(data);
+
+    data->should_stop = false;
+    data->sender = THREAD_NULL;
+    data->sending = false;
+
+    if (!thread_spawn(&data->receiver, (void (*)(void *)) server_thread_receiver, data))
+        EXIT_PRINT("Failed to create server receiver thread: %s", threads_get_error());
+
+    mutex_lock(&data->len_mutex);
+    if (*data->len > 0) server_start_sender(data);
+    mutex_unlock(&data->len_mutex);
+}
+
+// Undoes `server_start`, leaving the socket, clients and players as they are.
+static void server_stop(Server *const data) {
+    data->should_stop = true;
+
+    // The receiver first, since it starts senders.
+    if (!thread_is_null(data->receiver) && !thread_close(data->receiver))
+        EXIT_PRINT("Failed to join server receiver thread: %s", threads_get_error());
+
+    if (!thread_is_null(data->sender) && !thread_close(data->sender))
+        EXIT_PRINT("Failed to join server sender thread: %s", threads_get_error());
+
+    data->receiver = THREAD_NULL;
+    data->sender = THREAD_NULL;
+    data->sending = false;
+
+    if (!jobs_close(data->jobs))
+        EXIT_PRINT("Failed to stop encoding threads: %s", threads_get_error());
+    free(data->encode_tasks);
+
+    // Before the pool is freed, since sends in flight still point into it.
+    if (data->recv_ring != NULL && !uring_close(data->recv_ring))
+        EXIT_PRINT("Failed to close io_uring: %s", uring_get_error());
+    if (data->send_ring != NULL && !uring_close(data->send_ring))
+        EXIT_PRINT("Failed to close io_uring: %s", uring_get_error());
+    data->recv_ring = NULL;
+    data->send_ring = NULL;
+
+    queue_close(&data->send_queue);
+    pool_close(&data->pool);
+}
+
+// Points the `clnt_*` arrays and `table_players` into the client table at `base`, or only measures it if `base` is NULL.
+// Returns the size of the table in bytes.
+static size_t table_layout(Server *const data, char *const base) {
+    size_t at = 0;
+
+#define TABLE_ARRAY(array, bytes) { \
+    if (base != NULL) array = (void *) (base + at); \
+    at += ((bytes) + TABLE_ALIGN - 1) & ~(size_t) (TABLE_ALIGN - 1); \
+}
+    TABLE_ARRAY(data->table,         sizeof (ClientTable));
+    TABLE_ARRAY(data->clnt_states,   data->max * sizeof *data->clnt_states);
+    TABLE_ARRAY(data->clnt_last,     data->max * sizeof *data->clnt_last);
+    TABLE_ARRAY(data->clnt_addrs,    data->max * sizeof *data->clnt_addrs);
+    TABLE_ARRAY(data->clnt_tokens,   data->max * sizeof *data->clnt_tokens);
+    TABLE_ARRAY(data->clnt_moved,    data->max * sizeof *data->clnt_moved);
+    TABLE_ARRAY(data->session_slots, data->max * sizeof *data->session_slots);
+    TABLE_ARRAY(data->session_index, data->max * sizeof *data->session_index);
+    TABLE_ARRAY(data->clnt_rates,    data->max * sizeof *data->clnt_rates);
+    TABLE_ARRAY(data->clnt_traces,   data->max * sizeof *data->clnt_traces);
+    TABLE_ARRAY(data->clnt_peers,    data->max * sizeof *data->clnt_peers);
+    TABLE_ARRAY(data->table_players, data->max * sizeof *data->table_players);
+#undef TABLE_ARRAY
+
+    return at;
+}
+
+// Whether the mapped client table was left with clients in it by a server like this one, between changes.
+static bool table_reusable(ClientTable const *const table, size_t const size, uint16_t const max) {
+    return memcmp(table->magic, TABLE_MAGIC, sizeof table->magic) == 0
+        && table->version == NET_STATE_VERSION
+        && table->size == size
+        && table->max == max
+        && table->len > 0
+        && table->len <= max
+        && !table->changing;
+}
+
+// Takes over the clients of a table a previous server process left behind.
+// Their timers restart, and clients in lockstep mode are sent a SYNC since the frame history is gone.
+static void server_restore(Server *const data, long const now) {
+    uint16_t const len = data->table->len;
+    memcpy(data->players, data->table_players, len * sizeof (Player));
+    data->next_id = data->table->next_id;
+
+    for (uint16_t i = 0; i < len; i++) {
+        data->clnt_last[i] = now;
+        data->clnt_rates[i].next_send = now;
+        data->clnt_traces[i] = 0;
+        peer_init(&data->clnt_peers[i], now);
     }
 
-    printf("stopping server receriver thread\n");
+    *data->len = len;
 }
 
-Server *net_server_spawn(Player *const players, uint16_t *const len_players, uint16_t const max_players, uint16_t const port) {
+Server *net_server_spawn(Player *const players, _Atomic uint16_t *const len_players, uint16_t const max_players, uint16_t const port) {
     if (max_players == 0)
         EXIT_PRINT("Player list must have at least one player");
+    if (*len_players != 0)
+        EXIT_PRINT("Player list must be empty");
 
     Server *const data = malloc(sizeof (Server));
 
+    data->version = NET_STATE_VERSION;
     data->max = max_players;
+    data->max_budget = max_players < PACKET_MAX_PLAYERS ? max_players : PACKET_MAX_PLAYERS;
     data->len = len_players;
     data->players = players;
 
     if (!mutex_init(&data->len_mutex))
         EXIT_PRINT("Failed to initialize player list mutex: %s", threads_get_error());
 
-    data->clnt_states = malloc(max_players * sizeof (clnt_state));
-    data->clnt_last   = malloc(max_players * sizeof (time_t));
-    data->clnt_addrs  = malloc(max_players * sizeof (Address ));
+    data->limiter = calloc(LIMIT_SLOTS, sizeof (SourceBucket));
+    data->next_id = 0;
+
+    long now;
+    if (!time_get_monotonic(&now))
+        EXIT_PRINT("Failed to get time: %s", threads_get_error());
+    cookie_jar_init(&data->cookies, now);
+
+    /* Set up the client table */ {
+        size_t const size = table_layout(data, NULL);
+        bool restored = false;
+
+        // Setting NET_TABLE=<file> keeps the client table in the file, so a server restarted with it keeps its clients.
+        // Stores into the mapping survive the process, so nothing is written explicitly.
+        data->persistent = false;
+        char const *const path = getenv("NET_TABLE");
+        if (path != NULL) {
+            if (file_map_open(&data->table_file, path, size)) {
+                data->persistent = true;
+                restored = table_reusable(data->table_file.data, size, max_players);
+            }
+            else {
+                printf("Failed to map client table %s: %s\n", path, files_get_error());
+            }
+        }
+
+        if (!data->persistent) {
+            bool const huge = huge_pages_wanted();
+            if (!memory_map(&data->table_file, size, huge))
+                EXIT_PRINT("Failed to allocate client table: %s", files_get_error());
+            if (huge)
+                printf("client table of %zu bytes %s\n", data->table_file.size, data->table_file.huge ? "on huge pages" : "on regular pages, no huge pages reserved");
+        }
+
+        table_layout(data, data->table_file.data);
+
+        if (restored) {
+            server_restore(data, now);
+            printf("restored %u clients from %s\n", (unsigned) *data->len, path);
+        }
+        else {
+            *data->table = (ClientTable) {
+                .version = NET_STATE_VERSION,
+                .size = size,
+                .max = max_players,
+            };
+            memcpy(data->table->magic, TABLE_MAGIC, sizeof data->table->magic);
+            for (uint16_t slot = 0; slot < max_players; slot++)
+                data->session_slots[slot] = slot;
+        }
+    }
 
     if (!socket_startup())
         EXIT_PRINT("Failed to start up socket code: %s", sockets_get_error());
@@ -389,24 +1900,60 @@ Server *net_server_spawn(Player *const players, uint16_t *const len_players, uin
         EXIT_PRINT("Failed to bind socket: %s", sockets_get_error());
     printf("server socket bound to port %d\n", (int) ntohs(serv_addr.sin_port));
 
-    data->should_stop = false;
+    // Inbound traffic is one small datagram per client and tick, so there is nothing for GRO to coalesce on the server.
+    data->gso = false;
+    if (udp_offload_allowed()) {
+        data->gso = socket_enable_gso(data->serv_fd);
+        if (data->gso)
+            printf("using UDP segmentation offload\n");
+        else
+            printf("UDP segmentation offload unavailable: %s\n", sockets_get_error());
+    }
 
-    if (!thread_spawn(&data->receiver, (void (*)(void *)) server_thread_receiver, data))
-        EXIT_PRINT("Failed to create server receiver thread: %s", threads_get_error());
+    data->low_latency = low_latency_setting();
+    if (data->low_latency.on) {
+        printf(
+            "using low-latency mode, receiver on processor %d, sender on processor %d, real-time priority %d\n",
+            data->low_latency.receiver_cpu, data->low_latency.sender_cpu, data->low_latency.priority
+        );
+        if (!socket_enable_busy_poll(data->serv_fd, BUSY_POLL))
+            printf("Busy polling unavailable: %s\n", sockets_get_error());
+    }
 
-    data->sender = THREAD_NULL;
+    atomic_init(&data->trace, 0);
+
+    // Setting NET_MODEL=lockstep relays inputs instead of sending positions, see lockstep.h.
+    data->lockstep = false;
+    data->relay = (LockstepRelay) {0};
+    char const *const model = getenv("NET_MODEL");
+    if (model != NULL && strcmp(model, "lockstep") == 0) {
+        if (max_players > LOCKSTEP_MAX_PLAYERS) {
+            printf("lockstep network model is limited to %d players, sending positions\n", LOCKSTEP_MAX_PLAYERS);
+        }
+        else {
+            printf("using lockstep network model\n");
+            data->lockstep = true;
+            data->relay.inputs = malloc(LOCKSTEP_HISTORY * max_players);
+            data->relay.checksums = malloc(LOCKSTEP_HISTORY * sizeof (uint32_t));
+            data->relay.plans = calloc(max_players, sizeof (LockstepPlan));
+            data->relay.sync_players = malloc(max_players * sizeof (Player));
+        }
+    }
+
+    // Setting NET_REPLAY=<file> records the match to it.
+    data->replay.last = NULL;
+    char const *const replay = getenv("NET_REPLAY");
+    if (replay != NULL)
+        replay_record_start(&data->replay, replay, max_players, SENDER_TICK);
+
+    server_start(data);
 
     return data;
 }
 
 void net_server_close(Server *const data) {
-    data->should_stop = true;
-
-    if (!thread_is_null(data->sender) && !thread_close(data->sender))
-        EXIT_PRINT("Failed to send cancel request to server sender thread: %s", threads_get_error());
-
-    if (!thread_is_null(data->receiver) && !thread_close(data->receiver))
-        EXIT_PRINT("Failed to send cancel request to server receiver thread: %s", threads_get_error());
+    server_stop(data);
+    replay_record_stop(&data->replay);
 
     if (!mutex_close(&data->len_mutex))
         EXIT_PRINT("Failed to destroy server mutex: %s", threads_get_error());
@@ -417,23 +1964,89 @@ void net_server_close(Server *const data) {
     if (!socket_cleanup())
         EXIT_PRINT("Failed to clean up socket code: %s", sockets_get_error());
 
-    free(data->clnt_states);
-    free(data->clnt_last);
-    free(data->clnt_addrs);
+    // Closed on purpose, so a server started with the same table starts empty.
+    if (data->persistent)
+        data->table->len = 0;
+    if (!file_unmap(&data->table_file))
+        printf("Failed to close client table: %s\n", files_get_error());
+
+    free(data->limiter);
+    free(data->relay.inputs);
+    free(data->relay.checksums);
+    free(data->relay.plans);
+    free(data->relay.sync_players);
     free(data);
 }
 
+void net_server_suspend(Server *const data) {
+    server_stop(data);
+    printf("server suspended with %u players\n", (unsigned) *data->len);
+}
+
+void net_server_resume(Server *const data) {
+    if (data->version != NET_STATE_VERSION)
+        EXIT_PRINT("Server has state version %u, this code has %u", data->version, NET_STATE_VERSION);
+
+    server_start(data);
+    printf("server resumed with %u players\n", (unsigned) *data->len);
+}
+
+uint32_t net_server_take_trace(Server *const data) {
+    return atomic_exchange_explicit(&data->trace, 0, memory_order_relaxed);
+}
+
+// Writes an INPUTS packet with the inputs the server hasn't acknowledged, the newest `LOCKSTEP_INPUT_WINDOW` of them.
+// Returns false if the server doesn't relay inputs, positions are sent then.
+static bool client_write_inputs(Client *const data, C2SPacket *const packet, uint32_t const trace) {
+    LockstepClient *const ls = &data->lockstep;
+
+    mutex_lock(&ls->mutex);
+    bool const on = ls->on;
+    if (on) {
+        uint32_t const unacked = ls->input_seq - ls->input_acked;
+        uint8_t const count = unacked < LOCKSTEP_INPUT_WINDOW ? unacked : LOCKSTEP_INPUT_WINDOW;
+        uint32_t const first = ls->input_seq - count;
+
+        packet->tag = INPUTS;
+        packet->i_token = data->token;
+        packet->i_seq = first;
+        packet->i_received = ls->received;
+        packet->i_roster = ls->roster;
+        packet->i_frame = ls->simulated;
+        packet->i_checksum = ls->checksum;
+        packet->i_trace = trace;
+        packet->i_number = data->sent;
+        packet->i_count = count;
+        for (uint8_t i = 0; i < count; i++)
+            packet->i_inputs[i] = ls->inputs[(first + i) % LOCKSTEP_INPUT_WINDOW];
+    }
+    mutex_unlock(&ls->mutex);
+
+    return on;
+}
+
+// Forgets the inputs before `ack`, `mutex` must be held.
+static void client_ack_inputs(LockstepClient *const ls, uint32_t const ack) {
+    if ((int32_t) (ack - ls->input_acked) > 0 && (int32_t) (ack - ls->input_seq) <= 0)
+        ls->input_acked = ack;
+}
+
 static void client_thread_sender(Client *const data) {
     printf("starting client sender thread\n");
 
-    C2SPacket packet;
+    PacketBuffer *const buf = pool_acquire(&data->pool);
+    if (buf == NULL)
+        EXIT_PRINT("Packet pool exhausted");
+
+    C2SPacket *const packet = (C2SPacket *) buf->data;
 
     while (true) {
         if (data->should_stop) break;
 
         fflush(stdout);
 
-        thread_sleep_ms(SENDER_DELAY);
+        event_wait(&data->wake, SENDER_DELAY);
+        if (data->should_stop) break;
 
         short ev;
         if (!socket_poll(data->clnt_fd, POLLOUT, &ev, POLL_TIMEOUT))
@@ -444,114 +2057,315 @@ static void client_thread_sender(Client *const data) {
             continue;
         }
 
-        size_t packet_size = sizeof (C2SPacket);
+        uint32_t trace = 0;
+        data->sent++;
 
         switch (data->clnt_state) {
             case JOINING: {
-                packet_size = sizeof (PacketTag);
-                packet.tag = JOIN;
+                packet->tag = JOIN;
+                packet->j_cookie = data->cookie;
 
                 DEBUG_PRINT("<<< Sending JOIN packet to %s:%d", inet_ntoa(data->serv_addr.sin_addr), ntohs(data->serv_addr.sin_port));
             } break;
             case REJOINING: {
-                packet_size = sizeof (C2SPacket);
-                packet.tag = REJOIN;
-                packet.r_player = (Player) {
-                    .id = htonl(data->player->id),
-                    .pos.x = htonl(data->player->pos.x),
-                    .pos.y = htonl(data->player->pos.y),
-                };
+                packet->tag = REJOIN;
+                packet->r_player = *data->player;
+                packet->r_cookie = data->cookie;
+                packet->r_token = data->token;
+                packet->r_number = data->sent;
 
                 DEBUG_PRINT("<<< Sending REJOIN packet to %s:%d", inet_ntoa(data->serv_addr.sin_addr), ntohs(data->serv_addr.sin_port));
             } break;
             case PLAYING: {
-                //packet_size = sizeof (C2SPacket);
-                packet.tag = POSITION;
-                packet.p_pos.x = htonl(data->player->pos.x);
-                packet.p_pos.y = htonl(data->player->pos.y);
+                // Taken before the position or the inputs are read, so they include the traced input.
+                trace = atomic_exchange_explicit(&data->trace_input, 0, memory_order_acquire);
+
+                if (client_write_inputs(data, packet, trace)) {
+                    DEBUG_PRINT("<<< Sending INPUTS packet to %s:%d", inet_ntoa(data->serv_addr.sin_addr), ntohs(data->serv_addr.sin_port));
+                    break;
+                }
+
+                long now;
+                if (!time_get_monotonic(&now))
+                    EXIT_PRINT("Failed to get time: %s", threads_get_error());
+
+                long const ack_delay = now - data->recv_at;
+
+                packet->tag = POSITION;
+                packet->p_token = data->token;
+                packet->p_pos = data->player->pos;
+                packet->p_ack_seq = data->recv_seq;
+                packet->p_ack_delay = ack_delay < UINT16_MAX ? ack_delay : UINT16_MAX;
+                packet->p_ack_time = data->recv_time;
+                packet->p_recv_count = data->recv_count;
+                packet->p_trace = trace;
+                packet->p_number = data->sent;
 
                 DEBUG_PRINT("<<< Sending POSITION packet to %s:%d", inet_ntoa(data->serv_addr.sin_addr), ntohs(data->serv_addr.sin_port));
             } break;
         }
 
-        if (!socket_sendto_inet(data->clnt_fd, &packet, packet_size, &data->serv_addr))
+        size_t const packet_size = c2s_encode(packet);
+        if (!socket_sendto_inet(data->clnt_fd, packet, packet_size, &data->serv_addr))
             EXIT_PRINT("Failed to send to server: %s", sockets_get_error());
+        trace_mark(trace, TRACE_CLIENT_SEND);
 
         DEBUG_PRINT("< Send %zu bytes to %s:%d", packet_size, inet_ntoa(data->serv_addr.sin_addr), ntohs(data->serv_addr.sin_port));
     }
 
     printf("stopping client sender thread\n");
+
+    pool_release(&data->pool, buf);
+}
+
+// Handles one datagram, `len` bytes of `packet`, which is converted to host order in place.
+static void client_handle_packet(Client *const data, S2CPacket *const packet, int const len) {
+    if (!s2c_decode(packet, len)) {
+        DEBUG_PRINT("Dropped packet with unknown tag or shorter than its fields say, %d bytes", len);
+        return;
+    }
+
+    switch (packet->tag) {
+        case ACCEPT: {
+            DEBUG_PRINT(">>> Received ACCEPT packet with id %u", data->player->id);
+
+            if (data->clnt_state != JOINING && data->clnt_state != REJOINING) {
+                printf("Received ACCEPT packet but is not joining or rejoining\n");
+                return;
+            }
+            data->player->id = packet->a_id;
+            data->token = packet->a_token;
+            data->clnt_state = PLAYING;
+        } break;
+        case CHALLENGE: {
+            DEBUG_PRINT(">>> Received CHALLENGE packet");
+
+            if (data->clnt_state != JOINING && data->clnt_state != REJOINING) {
+                printf("Received CHALLENGE packet but is not joining or rejoining\n");
+                return;
+            }
+            data->cookie = packet->c_cookie;
+        } break;
+        case POSITIONS: {
+            DEBUG_PRINT(">>> Received POSITIONS packet with %u of %u players", packet->p_len, packet->p_total);
+
+            if (data->clnt_state != PLAYING && data->clnt_state != REJOINING)
+                EXIT_PRINT("Received POSITIONS packet but is not playing or rejoining");
+
+            data->clnt_state = PLAYING;
+
+            /* Record what to acknowledge in the next POSITION packet */ {
+                long now;
+                if (!time_get_monotonic(&now))
+                    EXIT_PRINT("Failed to get time: %s", threads_get_error());
+
+                uint16_t const seq = packet->p_seq;
+                if (data->recv_count == 0 || (int16_t) (seq - data->recv_seq) > 0) {
+                    data->recv_seq = seq;
+                    data->recv_time = packet->p_time;
+                    data->recv_at = now;
+                }
+                data->recv_count++;
+            }
+
+            uint32_t const trace = packet->p_trace;
+            if (trace != 0) {
+                trace_mark(trace, TRACE_CLIENT_RECEIVE);
+                atomic_store_explicit(&data->trace_received, trace, memory_order_relaxed);
+            }
+
+            bool const ends_pass = packet->p_offset + packet->p_len >= packet->p_total;
+            if (!entities_update(&data->entities, packet->p_players, packet->p_len, packet->p_seq, ends_pass)) {
+                DEBUG_PRINT("Dropped POSITIONS packet, the game hasn't let go of the entity table for too long");
+            }
+        } break;
+        case SYNC: {
+            uint16_t const count = packet->s_len;
+
+            DEBUG_PRINT(">>> Received SYNC packet with %u players", count);
+
+            if (data->clnt_state == JOINING) {
+                DEBUG_PRINT("Dropped SYNC packet, not accepted yet");
+                return;
+            }
+
+            if (count > LOCKSTEP_MAX_PLAYERS) {
+                DEBUG_PRINT("Dropped SYNC packet with invalid player count");
+                return;
+            }
+
+            data->clnt_state = PLAYING;
+
+            LockstepClient *const ls = &data->lockstep;
+            uint32_t const frame = packet->s_frame;
+            uint32_t const roster = packet->s_roster;
+
+            mutex_lock(&ls->mutex);
+            // The server repeats a SYNC until it hears the client got it.
+            if (!ls->on || roster != ls->roster || frame != ls->synced) {
+                ls->on = true;
+                ls->roster = roster;
+                ls->synced = frame;
+                ls->received = frame;
+                ls->taken = frame;
+                ls->len = count;
+                memcpy(ls->sync_players, packet->s_players, count * sizeof (Player));
+                ls->sync_pending = true;
+            }
+            client_ack_inputs(ls, packet->s_input_ack);
+            mutex_unlock(&ls->mutex);
+        } break;
+        case FRAMES: {
+            uint16_t const count = packet->f_count;
+            uint16_t const players = packet->f_len;
+
+            DEBUG_PRINT(">>> Received FRAMES packet with %u frames", count);
+
+            if (data->clnt_state == JOINING) {
+                DEBUG_PRINT("Dropped FRAMES packet, not accepted yet");
+                return;
+            }
+
+            data->clnt_state = PLAYING;
+
+            LockstepClient *const ls = &data->lockstep;
+            uint32_t const first = packet->f_frame;
+
+            mutex_lock(&ls->mutex);
+            // Frames after a SYNC that hasn't arrived don't apply to what the client has.
+            if (ls->on && packet->f_roster == ls->roster && players == ls->len) {
+                for (uint16_t i = 0; i < count; i++) {
+                    if (first + i != ls->received + 1) continue;
+                    if (ls->received - ls->taken == LOCKSTEP_CLIENT_FRAMES) break; // the game is behind, the server repeats the rest
+
+                    memcpy(&ls->frames[(first + i) % LOCKSTEP_CLIENT_FRAMES * LOCKSTEP_MAX_PLAYERS], &packet->f_inputs[i * players], players);
+                    ls->received++;
+                }
+            }
+            client_ack_inputs(ls, packet->f_input_ack);
+            mutex_unlock(&ls->mutex);
+
+            uint32_t const trace = packet->f_trace;
+            if (trace != 0) {
+                trace_mark(trace, TRACE_CLIENT_RECEIVE);
+                atomic_store_explicit(&data->trace_received, trace, memory_order_relaxed);
+            }
+        } break;
+    }
 }
 
 static void client_thread_receiver(Client *const data) {
     printf("starting client receiver thread\n");
 
-    uint16_t players_max = 0;
-    uint16_t players_len = 0;
-    S2CPacket *packet = malloc(sizeof (S2CPacket));
+    // Received into and parsed in place, big enough for any datagram.
+    PacketBuffer *const buf = pool_acquire(&data->pool);
+    if (buf == NULL)
+        EXIT_PRINT("Packet pool exhausted");
+
+    long last_received;
+    if (!time_get_monotonic(&last_received))
+        EXIT_PRINT("Failed to get time: %s", threads_get_error());
 
-next_loop:
     while (true) {
         if (data->should_stop) break;
 
         fflush(stdout);
 
+        // Polled in shorter waits than the disconnect timeout, so stopping the client doesn't wait it out.
         short ev;
-        if (!socket_poll(data->clnt_fd, POLLIN, &ev, DISCONNECT_TIMEOUT))
+        if (!socket_poll(data->clnt_fd, POLLIN, &ev, POLL_TIMEOUT))
             EXIT_PRINT("Failed to poll for read on client socket: %s", sockets_get_error());
 
+        long now;
+        if (!time_get_monotonic(&now))
+            EXIT_PRINT("Failed to get time: %s", threads_get_error());
+
         if (ev == 0) {
-            printf("receive loop timed out\n");
-            data->clnt_state = REJOINING;
-            goto next_loop;
+            if (now - last_received >= DISCONNECT_TIMEOUT) {
+                printf("receive loop timed out\n");
+                data->clnt_state = REJOINING;
+                last_received = now;
+            }
+            continue;
         }
 
-        Address serv_addr;
-        int nread;
-        if (!socket_recvfrom_inet(data->clnt_fd, packet, sizeof (S2CPacket) + players_len * sizeof (Player), &nread, &serv_addr))
+        int segment;
+        if (!socket_recvfrom_segments_inet(data->clnt_fd, buf->data, data->pool.capacity, &buf->len, &segment, &buf->addr))
             EXIT_PRINT("Failed to receive from server: %s", sockets_get_error());
+        last_received = now;
+
+        DEBUG_PRINT("> Received %ld bytes from %s:%d", (long) buf->len, inet_ntoa(buf->addr.sin_addr), ntohs(buf->addr.sin_port));
 
-        DEBUG_PRINT("> Received %ld bytes from %s:%d", (long) nread, inet_ntoa(serv_addr.sin_addr), ntohs(serv_addr.sin_port));
+        // With GRO a burst of POSITIONS segments arrives in one read, each `segment` bytes long except the last.
+        for (int at = 0; at < buf->len; at += segment) {
+            int const size = buf->len - at < segment ? buf->len - at : segment;
+            client_handle_packet(data, (S2CPacket *) (buf->data + at), size);
+        }
+    }
 
-        switch (packet->tag) {
-            case ACCEPT: {
-                DEBUG_PRINT(">>> Received ACCEPT packet with id %u", data->player->id);
+    printf("stopping client receiver thread\n");
 
-                if (data->clnt_state != JOINING) {
-                    printf("Received ACCEPT packet but is not joining\n");
-                    continue;
-                }
-                players_max = ntohs(packet->a_max);
-                data->player->id = ntohl(packet->a_id);
-                data->clnt_state = PLAYING;
+    pool_release(&data->pool, buf);
+}
 
-                packet = realloc(packet, sizeof (S2CPacket) + players_max * sizeof (Player));
-            } break;
-            case POSITIONS: {
-                DEBUG_PRINT(">>> Received POSITIONS packet with %u players", players_len);
+// Sets up what is tied to this build of the code: packet buffers and threads.
+static void client_start(Client *const data) {
+    if (!pool_init(&data->pool, CLIENT_POOL_BUFFERS, PACKET_MAX))
+        EXIT_PRINT("Failed to allocate packet pool");
 
-                if (data->clnt_state != PLAYING && data->clnt_state != REJOINING)
-                    EXIT_PRINT("Received POSITIONS packet but is not playing or rejoining");
+    data->should_stop = false;
+    event_init(&data->wake);
 
-                data->clnt_state = PLAYING;
+    if (!thread_spawn(&data->sender, (void (*)(void *)) client_thread_sender, data))
+        EXIT_PRINT("Failed to create client sender thread: %s", threads_get_error());
 
-                players_len = ntohs(packet->p_len);
+    if (!thread_spawn(&data->receiver, (void (*)(void *)) client_thread_receiver, data))
+        EXIT_PRINT("Failed to create client receiver thread: %s", threads_get_error());
+}
 
-                // TODO: Do something with the data
-            } break;
-        }
-    }
+// Undoes `client_start`, leaving the socket and the session as they are.
+static void client_stop(Client *const data) {
+    data->should_stop = true;
+    event_signal(&data->wake);
 
-    printf("stopping client receiver thread\n");
+    if (!thread_is_null(data->sender) && !thread_close(data->sender))
+        EXIT_PRINT("Failed to join client sender thread: %s", threads_get_error());
+
+    if (!thread_is_null(data->receiver) && !thread_close(data->receiver))
+        EXIT_PRINT("Failed to join client receiver thread: %s", threads_get_error());
 
-    free(packet);
+    data->sender = THREAD_NULL;
+    data->receiver = THREAD_NULL;
+
+    pool_close(&data->pool);
 }
 
 Client *net_client_spawn(Player *const player, uint16_t const port) {
     Client *data = malloc(sizeof (Client));
 
+    data->version    = NET_STATE_VERSION;
     data->clnt_state = JOINING;
     data->player     = player;
+    data->cookie     = 0;
+    data->token      = 0;
+    data->sent       = 0;
+    data->recv_seq   = 0;
+    data->recv_count = 0;
+    data->recv_time  = 0;
+    data->recv_at    = 0;
+    atomic_init(&data->trace_input, 0);
+    atomic_init(&data->trace_received, 0);
+
+    data->lockstep = (LockstepClient) {
+        .roster = LOCKSTEP_NEVER,
+        .frames = malloc(LOCKSTEP_CLIENT_FRAMES * LOCKSTEP_MAX_PLAYERS),
+        .sync_players = malloc(LOCKSTEP_MAX_PLAYERS * sizeof (Player)),
+    };
+    if (!mutex_init(&data->lockstep.mutex))
+        EXIT_PRINT("Failed to initialize lockstep mutex: %s", threads_get_error());
+
+    if (!entities_init(&data->entities))
+        EXIT_PRINT("Failed to allocate entity table");
 
     if (!socket_startup())
         EXIT_PRINT("Failed to start up socket code: %s", sockets_get_error());
@@ -560,31 +2374,23 @@ Client *net_client_spawn(Player *const player, uint16_t const port) {
     if (!socket_init_udp(&data->clnt_fd))
         EXIT_PRINT("Failed to create socket: %s", sockets_get_error());
 
+    // Lets a burst of POSITIONS segments from the server be read at once.
+    if (udp_offload_allowed() && !socket_enable_gro(data->clnt_fd))
+        printf("UDP receive offload unavailable: %s\n", sockets_get_error());
+
     printf("setting server address to port %d\n", (int) port);
     data->serv_addr = (Address ) {0};
     data->serv_addr.sin_family = AF_INET;
     data->serv_addr.sin_port = htons(port);
     inet_pton(AF_INET, "127.0.0.1", &data->serv_addr.sin_addr);
 
-    data->should_stop = false;
-
-    if (!thread_spawn(&data->sender, (void (*)(void *)) client_thread_sender, data))
-        EXIT_PRINT("Failed to create client sender thread: %s", threads_get_error());
-
-    if (!thread_spawn(&data->receiver, (void (*)(void *)) client_thread_receiver, data))
-        EXIT_PRINT("Failed to create client receiver thread: %s", threads_get_error());
+    client_start(data);
 
     return data;
 }
 
 void net_client_close(Client *const data) {
-    data->should_stop = true;
-
-    if (!thread_is_null(data->sender) && !thread_close(data->sender))
-        EXIT_PRINT("Failed to send cancel request to client sender thread: %s", threads_get_error());
-
-    if (!thread_is_null(data->receiver) && !thread_close(data->receiver))
-        EXIT_PRINT("Failed to send cancel request to client receiver thread: %s", threads_get_error());
+    client_stop(data);
 
     if (!socket_close(data->clnt_fd))
         EXIT_PRINT("Failed to close client socket: %s", sockets_get_error());
@@ -592,6 +2398,104 @@ void net_client_close(Client *const data) {
     if (!socket_cleanup())
         EXIT_PRINT("Failed to clean up socket code: %s", sockets_get_error());
 
+    if (!mutex_close(&data->lockstep.mutex))
+        EXIT_PRINT("Failed to destroy lockstep mutex: %s", threads_get_error());
+    free(data->lockstep.frames);
+    free(data->lockstep.sync_players);
+    entities_close(&data->entities);
     free(data);
 }
-#endif
+
+void net_client_suspend(Client *const data) {
+    client_stop(data);
+    printf("client suspended\n");
+}
+
+void net_client_resume(Client *const data) {
+    if (data->version != NET_STATE_VERSION)
+        EXIT_PRINT("Client has state version %u, this code has %u", data->version, NET_STATE_VERSION);
+
+    client_start(data);
+    printf("client resumed\n");
+}
+
+void net_client_trace_input(Client *const data, uint32_t const trace) {
+    if (trace == 0) return;
+    atomic_store_explicit(&data->trace_input, trace, memory_order_release);
+    event_signal(&data->wake);
+}
+
+uint32_t net_client_take_trace(Client *const data) {
+    return atomic_exchange_explicit(&data->trace_received, 0, memory_order_relaxed);
+}
+
+void net_client_input(Client *const data, uint8_t const input) {
+    LockstepClient *const ls = &data->lockstep;
+
+    mutex_lock(&ls->mutex);
+    bool const on = ls->on;
+    if (on) ls->inputs[ls->input_seq++ % LOCKSTEP_INPUT_WINDOW] = input;
+    mutex_unlock(&ls->mutex);
+
+    // Sent right away, so it reaches the server before the frame it is for.
+    if (on) event_signal(&data->wake);
+}
+
+bool net_client_next_frame(Client *const data, Player *const players, LockstepFrame *const frame) {
+    LockstepClient *const ls = &data->lockstep;
+    bool taken = true;
+
+    mutex_lock(&ls->mutex);
+    if (ls->sync_pending) {
+        memcpy(players, ls->sync_players, ls->len * sizeof (Player));
+        frame->frame = ls->synced;
+        frame->len = ls->len;
+        frame->sync = true;
+        ls->sync_pending = false;
+    }
+    else if (ls->taken != ls->received) {
+        ls->taken++;
+        frame->frame = ls->taken;
+        frame->len = ls->len;
+        frame->sync = false;
+        memcpy(frame->inputs, &ls->frames[ls->taken % LOCKSTEP_CLIENT_FRAMES * LOCKSTEP_MAX_PLAYERS], ls->len);
+    }
+    else {
+        taken = false;
+    }
+    mutex_unlock(&ls->mutex);
+
+    return taken;
+}
+
+void net_client_frame_done(Client *const data, uint32_t const frame, uint32_t const checksum) {
+    LockstepClient *const ls = &data->lockstep;
+
+    mutex_lock(&ls->mutex);
+    ls->simulated = frame;
+    ls->checksum = checksum;
+    mutex_unlock(&ls->mutex);
+}
+
+EntityTable *net_client_entities(Client *const data) {
+    return &data->entities;
+}
+
+NetApi const net_api = {
+    .state_version      = NET_STATE_VERSION,
+    .server_spawn       = net_server_spawn,
+    .server_close       = net_server_close,
+    .server_suspend     = net_server_suspend,
+    .server_resume      = net_server_resume,
+    .server_take_trace  = net_server_take_trace,
+    .client_spawn       = net_client_spawn,
+    .client_close       = net_client_close,
+    .client_suspend     = net_client_suspend,
+    .client_resume      = net_client_resume,
+    .client_trace_input = net_client_trace_input,
+    .client_take_trace  = net_client_take_trace,
+    .client_input       = net_client_input,
+    .client_next_frame  = net_client_next_frame,
+    .client_frame_done  = net_client_frame_done,
+    .client_entities    = net_client_entities,
+};
@@ -1,28 +1,92 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <stdbool.h>
+
 #include "player.h"
+#include "lockstep.h"
+#include "entities.h"
 
 typedef struct Server Server;
 
-#if !defined(HOTRELOADING) || !defined(__linux__)
-Server *net_server_spawn(Player *players, uint16_t *len_players, uint16_t max_players, uint16_t port);
+// `*len_players` is changed by the server's threads, so it is atomic.
+// `players` must have room for `max_players`, which can be anything up to `UINT16_MAX`. Every table is sized for them here and never grows.
+// A server started with the client table a crashed one left behind (see NET_TABLE in net.c) fills in its players first.
+Server *net_server_spawn(Player *players, _Atomic uint16_t *len_players, uint16_t max_players, uint16_t port);
 
 void net_server_close(Server *data);
-#else
-typedef ServerData *net_server_spawn_t(Player *players, uint16_t *len_players, uint16_t max_players, uint16_t);
 
-typedef void net_server_close_t(ServerData *data);
-#endif
+// Stops the server's threads and frees what is tied to this build of the code.
+// The socket, the clients and the player list are kept, so the server can be resumed by a rebuilt net.so.
+void net_server_suspend(Server *data);
+
+// Restarts a suspended server, which must have been spawned by code with the same `state_version`.
+void net_server_resume(Server *data);
+
+// Returns the trace id of the newest traced position received since the last call, or 0.
+uint32_t net_server_take_trace(Server *data);
 
 typedef struct Client Client;
 
-#if !defined(HOTRELOADING) || !defined(__linux__)
 Client *net_client_spawn(Player *player, uint16_t port);
 
 void net_client_close(Client *data);
-#else
-typedef ClientData *net_client_spawn_t(Player *player, uint16_t port);
 
-typedef void net_client_close_t(ClientData *data);
-#endif
+// Like `net_server_suspend`, the socket and the session are kept.
+void net_client_suspend(Client *data);
+
+// Like `net_server_resume`.
+void net_client_resume(Client *data);
+
+// Sends `trace` along with the next POSITION packet, call it after changing the player.
+// A traced input is sent right away instead of waiting for the next regular send.
+void net_client_trace_input(Client *data, uint32_t trace);
+
+// Returns the trace id of the newest input echoed back by the server since the last call, or 0.
+uint32_t net_client_take_trace(Client *data);
+
+// Queues the input of one simulated frame, sent if the server runs in lockstep mode (see lockstep.h) and dropped otherwise.
+void net_client_input(Client *data, uint8_t input);
+
+// A frame to simulate in lockstep mode.
+typedef struct {
+    uint32_t frame;
+    uint16_t len;  // players
+    bool sync;     // the players were replaced with the server's as of `frame` instead, there is nothing to step
+    uint8_t inputs[LOCKSTEP_MAX_PLAYERS]; // to step the players with, one each
+} LockstepFrame;
+
+// Takes the next frame the server relayed, `players` must have room for `LOCKSTEP_MAX_PLAYERS`.
+// Returns false if there is none yet, which is always the case unless the server runs in lockstep mode.
+bool net_client_next_frame(Client *data, Player *players, LockstepFrame *frame);
+
+// Reports the checksum of the players after simulating `frame`, the server sends them again if it doesn't match its own.
+void net_client_frame_done(Client *data, uint32_t frame, uint32_t checksum);
+
+// Returns the players the client has heard of from the server, kept up to date by its receiver thread.
+// Read it with `entities_acquire` and `entities_release` from one thread, see entities.h. Empty in lockstep mode.
+EntityTable *net_client_entities(Client *data);
+
+// The functions above as one table, so code calling them can be pointed at a net.so loaded or reloaded at runtime.
+// Only ever extended at the end, so `state_version` can be read from the table of any build.
+typedef struct {
+    uint32_t state_version; // servers and clients are only handed over between builds with the same version
+    Server *(*server_spawn)(Player *players, _Atomic uint16_t *len_players, uint16_t max_players, uint16_t port);
+    void (*server_close)(Server *data);
+    void (*server_suspend)(Server *data);
+    void (*server_resume)(Server *data);
+    uint32_t (*server_take_trace)(Server *data);
+    Client *(*client_spawn)(Player *player, uint16_t port);
+    void (*client_close)(Client *data);
+    void (*client_suspend)(Client *data);
+    void (*client_resume)(Client *data);
+    void (*client_trace_input)(Client *data, uint32_t trace);
+    uint32_t (*client_take_trace)(Client *data);
+    void (*client_input)(Client *data, uint8_t input);
+    bool (*client_next_frame)(Client *data, Player *players, LockstepFrame *frame);
+    void (*client_frame_done)(Client *data, uint32_t frame, uint32_t checksum);
+    EntityTable *(*client_entities)(Client *data);
+} NetApi;
 
+// The table of this build.
+extern NetApi const net_api;
@@ -0,0 +1,322 @@
+#ifdef __linux__
+#define _GNU_SOURCE // mremap
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "./files.h"
+#include "../util.h"
+
+#define HUGE_PAGE (2 << 20) // bytes, the default huge page size on x86-64 and arm64
+
+static char error_buffer[1024];
+
+#define FAIL(string) { \
+    if (sizeof string > 1024) \
+        EXIT_PRINT("Error message too long for buffer"); \
+    memcpy(error_buffer, string, sizeof string); \
+    return false; \
+}
+
+#define FAIL_WITH_ERROR(string, error) { \
+    snprintf(error_buffer, 1024, string " (code: %d, '%s')", error, strerror(error)); \
+    return false; \
+}
+
+char *files_get_error() {
+    return error_buffer;
+}
+
+bool file_map_new(MappedFile *const file, char const *const path, size_t const size) {
+    int const fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        FAIL_WITH_ERROR("Failed to open file", errno);
+
+    if (ftruncate(fd, (off_t) size) == -1) {
+        int const error = errno;
+        close(fd);
+        FAIL_WITH_ERROR("Failed to size file", error);
+    }
+
+    void *const data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        int const error = errno;
+        close(fd);
+        FAIL_WITH_ERROR("Failed to map file", error);
+    }
+
+    *file = (MappedFile) {.data = data, .size = size, .fd = fd};
+    return true;
+}
+
+bool file_map_open(MappedFile *const file, char const *const path, size_t const size) {
+    int const fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        FAIL_WITH_ERROR("Failed to open file", errno);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int const error = errno;
+        close(fd);
+        FAIL_WITH_ERROR("Failed to get file size", error);
+    }
+
+    if ((size_t) st.st_size < size && ftruncate(fd, (off_t) size) == -1) {
+        int const error = errno;
+        close(fd);
+        FAIL_WITH_ERROR("Failed to size file", error);
+    }
+
+    void *const data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        int const error = errno;
+        close(fd);
+        FAIL_WITH_ERROR("Failed to map file", error);
+    }
+
+    *file = (MappedFile) {.data = data, .size = size, .fd = fd};
+    return true;
+}
+
+bool file_map_existing(MappedFile *const file, char const *const path) {
+    int const fd = open(path, O_RDONLY);
+    if (fd == -1)
+        FAIL_WITH_ERROR("Failed to open file", errno);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int const error = errno;
+        close(fd);
+        FAIL_WITH_ERROR("Failed to get file size", error);
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        FAIL("File is empty");
+    }
+
+    void *const data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        int const error = errno;
+        close(fd);
+        FAIL_WITH_ERROR("Failed to map file", error);
+    }
+
+    *file = (MappedFile) {.data = data, .size = (size_t) st.st_size, .fd = fd};
+    return true;
+}
+
+bool file_map_resize(MappedFile *const file, size_t const size) {
+    if (ftruncate(file->fd, (off_t) size) == -1)
+        FAIL_WITH_ERROR("Failed to size file", errno);
+
+    void *const data = mremap(file->data, file->size, size, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED)
+        FAIL_WITH_ERROR("Failed to map file", errno);
+
+    file->data = data;
+    file->size = size;
+    return true;
+}
+
+bool file_map_flush(MappedFile *const file) {
+    if (msync(file->data, file->size, MS_ASYNC) == -1)
+        FAIL_WITH_ERROR("Failed to flush mapped file", errno);
+    return true;
+}
+
+bool file_unmap(MappedFile *const file) {
+    if (munmap(file->data, file->size) == -1)
+        FAIL_WITH_ERROR("Failed to unmap file", errno);
+    if (file->fd != -1 && close(file->fd) == -1)
+        FAIL_WITH_ERROR("Failed to close file", errno);
+    return true;
+}
+
+bool memory_map(MappedFile *const file, size_t const size, bool const huge) {
+    // Huge pages only come from the pool reserved in /proc/sys/vm/nr_hugepages, which is usually empty.
+    if (huge) {
+        size_t const rounded = (size + HUGE_PAGE - 1) & ~(size_t) (HUGE_PAGE - 1);
+        void *const data = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED) {
+            *file = (MappedFile) {.data = data, .size = rounded, .huge = true, .fd = -1};
+            return true;
+        }
+    }
+
+    long const page = sysconf(_SC_PAGESIZE);
+    size_t const rounded = (size + page - 1) & ~(size_t) (page - 1);
+    void *const data = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        FAIL_WITH_ERROR("Failed to map memory", errno);
+
+    // Transparent huge pages are the next best thing, a hint that is ignored where they are disabled.
+    if (huge) madvise(data, rounded, MADV_HUGEPAGE);
+
+    *file = (MappedFile) {.data = data, .size = rounded, .huge = false, .fd = -1};
+    return true;
+}
+#endif
+
+#ifdef _WIN64
+#include <string.h>
+#include <winioctl.h>
+
+#include "./files.h"
+#include "../util.h"
+
+static char error_buffer[1024];
+
+#define FAIL_AND_GET_LAST_ERROR(string) { \
+    LPSTR last_error = NULL; \
+    TCHAR nstored = FormatMessage( \
+        FORMAT_MESSAGE_FROM_SYSTEM \
+        | FORMAT_MESSAGE_IGNORE_INSERTS \
+        | FORMAT_MESSAGE_ALLOCATE_BUFFER, \
+        NULL, GetLastError(), \
+        MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US), \
+        (LPSTR) &last_error, \
+        0, NULL \
+    ); \
+    if (nstored == 0) \
+        EXIT_PRINT("Failed to format error message"); \
+    snprintf(error_buffer, 1024, string " (code: %lu, '%s')", GetLastError(), last_error); \
+    LocalFree(last_error); \
+    return false; \
+}
+
+char *files_get_error() {
+    return error_buffer;
+}
+
+// Maps `size` bytes of `file->file`, growing the file if it is shorter.
+static bool map(MappedFile *const file, size_t const size, bool const writable) {
+    file->mapping = CreateFileMappingA(file->file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, (DWORD) (size >> 32), (DWORD) size, NULL);
+    if (file->mapping == NULL)
+        FAIL_AND_GET_LAST_ERROR("Failed to create file mapping");
+
+    file->data = MapViewOfFile(file->mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+    if (file->data == NULL) {
+        CloseHandle(file->mapping);
+        FAIL_AND_GET_LAST_ERROR("Failed to map file");
+    }
+
+    file->size = size;
+    return true;
+}
+
+bool file_map_new(MappedFile *const file, char const *const path, size_t const size) {
+    file->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->file == INVALID_HANDLE_VALUE)
+        FAIL_AND_GET_LAST_ERROR("Failed to open file");
+
+    // Like on Linux, space is only taken by the pages written. File systems without sparse files just don't.
+    DWORD returned;
+    DeviceIoControl(file->file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+
+    if (!map(file, size, true)) {
+        CloseHandle(file->file);
+        return false;
+    }
+    return true;
+}
+
+bool file_map_open(MappedFile *const file, char const *const path, size_t const size) {
+    file->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->file == INVALID_HANDLE_VALUE)
+        FAIL_AND_GET_LAST_ERROR("Failed to open file");
+
+    // The mapping grows a shorter file and leaves a longer one as it is.
+    if (!map(file, size, true)) {
+        CloseHandle(file->file);
+        return false;
+    }
+    return true;
+}
+
+bool file_map_existing(MappedFile *const file, char const *const path) {
+    file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->file == INVALID_HANDLE_VALUE)
+        FAIL_AND_GET_LAST_ERROR("Failed to open file");
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file->file, &size)) {
+        CloseHandle(file->file);
+        FAIL_AND_GET_LAST_ERROR("Failed to get file size");
+    }
+
+    if (size.QuadPart == 0) {
+        CloseHandle(file->file);
+        memcpy(error_buffer, "File is empty", sizeof "File is empty");
+        return false;
+    }
+
+    if (!map(file, (size_t) size.QuadPart, false)) {
+        CloseHandle(file->file);
+        return false;
+    }
+    return true;
+}
+
+bool file_map_resize(MappedFile *const file, size_t const size) {
+    // A file can't be resized while it is mapped.
+    if (!UnmapViewOfFile(file->data))
+        FAIL_AND_GET_LAST_ERROR("Failed to unmap file");
+    if (!CloseHandle(file->mapping))
+        FAIL_AND_GET_LAST_ERROR("Failed to close file mapping");
+
+    LARGE_INTEGER end = {.QuadPart = (LONGLONG) size};
+    if (!SetFilePointerEx(file->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file->file))
+        FAIL_AND_GET_LAST_ERROR("Failed to size file");
+
+    return map(file, size, true);
+}
+
+bool file_map_flush(MappedFile *const file) {
+    if (!FlushViewOfFile(file->data, 0))
+        FAIL_AND_GET_LAST_ERROR("Failed to flush mapped file");
+    return true;
+}
+
+bool file_unmap(MappedFile *const file) {
+    // Memory from `memory_map` has no mapping object.
+    if (file->mapping == NULL) {
+        if (!VirtualFree(file->data, 0, MEM_RELEASE))
+            FAIL_AND_GET_LAST_ERROR("Failed to free memory");
+        return true;
+    }
+
+    if (!UnmapViewOfFile(file->data))
+        FAIL_AND_GET_LAST_ERROR("Failed to unmap file");
+    if (!CloseHandle(file->mapping))
+        FAIL_AND_GET_LAST_ERROR("Failed to close file mapping");
+    if (!CloseHandle(file->file))
+        FAIL_AND_GET_LAST_ERROR("Failed to close file");
+    return true;
+}
+
+bool memory_map(MappedFile *const file, size_t const size, bool const huge) {
+    // Large pages need the "Lock pages in memory" privilege, which accounts don't have by default.
+    SIZE_T const large_page = GetLargePageMinimum();
+    if (huge && large_page > 0) {
+        size_t const rounded = (size + large_page - 1) & ~(size_t) (large_page - 1);
+        void *const data = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (data != NULL) {
+            *file = (MappedFile) {.data = data, .size = rounded, .huge = true, .file = INVALID_HANDLE_VALUE, .mapping = NULL};
+            return true;
+        }
+    }
+
+    void *const data = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (data == NULL)
+        FAIL_AND_GET_LAST_ERROR("Failed to allocate memory");
+
+    *file = (MappedFile) {.data = data, .size = size, .huge = false, .file = INVALID_HANDLE_VALUE, .mapping = NULL};
+    return true;
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef _WIN64
+#include <WinSock2.h>
+#endif
+
+// A file mapped into memory. Stores into a writable mapping reach the file without any write calls,
+// the operating system writes dirty pages back in the background.
+typedef struct {
+    void *data;
+    size_t size; // bytes mapped, which is the size of the file
+    bool huge;   // only set by `memory_map`, whether the memory is on huge pages
+#ifdef __linux__
+    int fd;
+#elif defined(_WIN64)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+char *files_get_error(void);
+
+// Creates or truncates the file at `path`, sizes it to `size` bytes and maps it for reading and writing.
+// The file is sparse, only the pages written take space on disk.
+bool file_map_new(MappedFile *file, char const *path, size_t size);
+
+// Opens or creates the file at `path`, keeping what is in it, grows it to at least `size` bytes
+// and maps the first `size` bytes for reading and writing.
+bool file_map_open(MappedFile *file, char const *path, size_t size);
+
+// Maps the whole of the existing file at `path` for reading.
+bool file_map_existing(MappedFile *file, char const *path);
+
+// Grows or shrinks the file of a mapping made by `file_map_new` to `size` bytes and maps all of it, `data` may move.
+bool file_map_resize(MappedFile *file, size_t size);
+
+// Starts writing dirty pages back to the file, without waiting for it to finish.
+bool file_map_flush(MappedFile *file);
+
+// Unmaps a file or memory mapped by `memory_map`.
+bool file_unmap(MappedFile *file);
+
+// Maps `size` bytes of zeroed memory that belong to no file, rounding `size` up to whole pages.
+// With `huge` it is put on huge pages if the system has them to spare, and falls back to regular pages otherwise.
+bool memory_map(MappedFile *file, size_t size, bool huge);
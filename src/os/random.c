@@ -0,0 +1,65 @@
+#ifdef __linux__
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/random.h>
+
+#include "./random.h"
+#include "../util.h"
+
+static char error_buffer[1024];
+
+#define FAIL_AND_GET_ERROR(string) { \
+    snprintf(error_buffer, 1024, string " (code: %d, '%s')", errno, strerror(errno)); \
+    return false; \
+}
+
+char *random_get_error() {
+    return error_buffer;
+}
+
+bool random_fill(void *const buf, size_t const len) {
+    size_t filled = 0;
+    while (filled < len) {
+        ssize_t const n = getrandom((char *) buf + filled, len - filled, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            FAIL_AND_GET_ERROR("Failed to get random bytes");
+        }
+        filled += n;
+    }
+    return true;
+}
+#endif
+
+#ifdef _WIN64
+#define _CRT_RAND_S
+#include <stdlib.h>
+#include <string.h>
+
+#include "./random.h"
+#include "../util.h"
+
+static char error_buffer[1024];
+
+#define FAIL_WITH_ERROR(string, error) { \
+    snprintf(error_buffer, 1024, string " (code: %d, '%s')", error, strerror(error)); \
+    return false; \
+}
+
+char *random_get_error() {
+    return error_buffer;
+}
+
+bool random_fill(void *const buf, size_t const len) {
+    for (size_t i = 0; i < len; i += sizeof (unsigned int)) {
+        unsigned int value;
+        errno_t const error = rand_s(&value);
+        if (error != 0)
+            FAIL_WITH_ERROR("Failed to get random bytes", error);
+        memcpy((char *) buf + i, &value, len - i < sizeof value ? len - i : sizeof value);
+    }
+    return true;
+}
+#endif
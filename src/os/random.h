@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+char *random_get_error(void);
+
+// Fills the buffer with cryptographically secure random bytes from the operating system.
+bool random_fill(void *buffer, size_t length);
@@ -0,0 +1,574 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <poll.h>
+
+typedef pthread_mutex_t Lock;
+typedef pthread_cond_t Cond;
+#define LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+
+static void lock(Lock *const l)   { pthread_mutex_lock(l); }
+static void unlock(Lock *const l) { pthread_mutex_unlock(l); }
+static void cond_init(Cond *const c)  { pthread_cond_init(c, NULL); }
+static void cond_close(Cond *const c) { pthread_cond_destroy(c); }
+static void cond_wait(Cond *const c, Lock *const l) { pthread_cond_wait(c, l); }
+static void cond_signal(Cond *const c) { pthread_cond_signal(c); }
+#endif
+
+#ifdef _WIN64
+#include <WinSock2.h>
+
+typedef SRWLOCK Lock;
+typedef CONDITION_VARIABLE Cond;
+#define LOCK_INIT SRWLOCK_INIT
+
+static void lock(Lock *const l)   { AcquireSRWLockExclusive(l); }
+static void unlock(Lock *const l) { ReleaseSRWLockExclusive(l); }
+static void cond_init(Cond *const c)  { InitializeConditionVariable(c); }
+static void cond_close(Cond *const c) { (void) c; }
+static void cond_wait(Cond *const c, Lock *const l) { SleepConditionVariableSRW(c, l, INFINITE, 0); }
+static void cond_signal(Cond *const c) { WakeConditionVariable(c); }
+#endif
+
+#include "./simnet.h"
+#include "./sockets.h"
+#include "./threads.h"
+#include "../util.h"
+
+static char error_buffer[1024];
+
+#define FAIL(string) { \
+    if (sizeof string > 1024) \
+        EXIT_PRINT("Error message too long for buffer"); \
+    memcpy(error_buffer, string, sizeof string); \
+    return false; \
+}
+
+#define FAIL_AND_UNLOCK(string) { \
+    unlock(&sim_lock); \
+    FAIL(string); \
+}
+
+#define EPOCH (1000000000LL)    // microseconds, the virtual clock starts here so that no timestamp is 0
+#define NEVER (INT64_MAX)
+#define RECV_QUEUE_MAX (4096)   // datagrams waiting on one socket before new ones are dropped
+#define BACKLOG_MAX (1000000LL) // microseconds of data queued on a link before new datagrams are dropped
+#define EPHEMERAL_PORT (49152)
+
+typedef enum {
+    RUNNING,
+    READY,    // spawned, runs from `wake` on
+    SLEEPING, // until `wake`
+    POLLING,  // until `socket` has a datagram or `wake`
+    JOINING,  // until `target` finished
+    FINISHED,
+} Activity;
+
+typedef struct Participant {
+    Activity activity;
+    int64_t wake; // microseconds
+    int socket;
+    struct Participant *target;
+    Cond turn;
+} Participant;
+
+typedef struct Datagram {
+    struct Datagram *next;
+    int64_t at;     // microseconds
+    uint64_t order; // breaks ties between datagrams arriving at the same time
+    Address source;
+    int len;
+    uint8_t data[];
+} Datagram;
+
+typedef struct {
+    bool open;
+    bool bound;
+    Address addr;
+    int64_t link_free; // microseconds, when the last datagram has left the socket
+    Datagram *queue;   // sorted by arrival
+    int queued;
+} SimSocket;
+
+static Lock sim_lock = LOCK_INIT;
+
+// Everything below is protected by `sim_lock`.
+// Only the thread in `running` may change it, the others wait for their turn.
+static struct {
+    bool started;
+    SimLink link;
+    SimStats stats;
+    uint64_t random;
+    int64_t now; // microseconds
+    uint64_t order;
+    uint16_t next_port;
+    Participant *running;
+    Participant **participants;
+    int participants_len;
+    SimSocket *sockets;
+    int sockets_len;
+} sim;
+
+static _Thread_local Participant *self = NULL;
+
+char *simnet_get_error() {
+    return error_buffer;
+}
+
+/* Scheduling */
+
+// splitmix64, so the same seed gives the same link behaviour on every platform
+static uint64_t random_next(void) {
+    uint64_t z = (sim.random += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+static bool random_chance(float const probability) {
+    if (probability <= 0.0f) return false;
+    return (random_next() >> 40) < (uint64_t) (probability * (float) (1 << 24));
+}
+
+static Participant *participant_new(Activity const activity) {
+    Participant *const p = calloc(1, sizeof (Participant));
+    if (p == NULL)
+        EXIT_PRINT("Failed to allocate simulated thread");
+    p->activity = activity;
+    p->wake = sim.now;
+    cond_init(&p->turn);
+
+    Participant **const participants = realloc(sim.participants, (sim.participants_len + 1) * sizeof (Participant *));
+    if (participants == NULL)
+        EXIT_PRINT("Failed to allocate simulated thread");
+    sim.participants = participants;
+    sim.participants[sim.participants_len++] = p;
+    return p;
+}
+
+static int64_t wakes_at(Participant const *const p) {
+    switch (p->activity) {
+        case READY:
+        case SLEEPING: return p->wake;
+        case POLLING: {
+            Datagram const *const head = sim.sockets[p->socket].queue;
+            return head != NULL && head->at < p->wake ? head->at : p->wake;
+        }
+        case JOINING: return p->target->activity == FINISHED ? sim.now : NEVER;
+        default: return NEVER;
+    }
+}
+
+// Hands the turn to the thread that wakes up first, the earliest spawned one on ties, and advances the clock to it.
+// The caller must have set its own activity.
+static void schedule(void) {
+    Participant *next = NULL;
+    int64_t next_at = NEVER;
+    for (int i = 0; i < sim.participants_len; i++) {
+        int64_t const at = wakes_at(sim.participants[i]);
+        if (at < next_at) {
+            next = sim.participants[i];
+            next_at = at;
+        }
+    }
+
+    if (next == NULL)
+        EXIT_PRINT("Simulation deadlocked, no thread can wake up");
+
+    if (next_at > sim.now) sim.now = next_at;
+    sim.running = next;
+    cond_signal(&next->turn);
+}
+
+static void wait_for_turn(void) {
+    while (sim.running != self)
+        cond_wait(&self->turn, &sim_lock);
+    self->activity = RUNNING;
+}
+
+static void yield(void) {
+    schedule();
+    wait_for_turn();
+}
+
+static void check_self(void) {
+    if (self == NULL)
+        EXIT_PRINT("Thread was not spawned within the simulation");
+}
+
+static void *sched_spawned(void) {
+    lock(&sim_lock);
+    Participant *const p = participant_new(READY);
+    unlock(&sim_lock);
+    return p;
+}
+
+static void sched_started(void *const thread) {
+    lock(&sim_lock);
+    self = thread;
+    wait_for_turn();
+    unlock(&sim_lock);
+}
+
+static void sched_finished(void *const thread) {
+    lock(&sim_lock);
+    self->activity = FINISHED;
+    schedule();
+    unlock(&sim_lock);
+    self = NULL;
+}
+
+static void sched_joining(void *const thread) {
+    lock(&sim_lock);
+    check_self();
+    self->activity = JOINING;
+    self->target = thread;
+    yield();
+    unlock(&sim_lock);
+}
+
+static bool sched_sleep_ms(long const ms) {
+    lock(&sim_lock);
+    check_self();
+    self->activity = SLEEPING;
+    self->wake = sim.now + ms * 1000LL;
+    yield();
+    unlock(&sim_lock);
+    return true;
+}
+
+static bool sched_get_monotonic(long *const millis) {
+    lock(&sim_lock);
+    *millis = sim.now / 1000;
+    unlock(&sim_lock);
+    return true;
+}
+
+static Scheduler const scheduler = {
+    .spawned = sched_spawned,
+    .started = sched_started,
+    .finished = sched_finished,
+    .joining = sched_joining,
+    .sleep_ms = sched_sleep_ms,
+    .get_monotonic = sched_get_monotonic,
+};
+
+/* Link */
+
+static SimSocket *socket_get(Socket const s) {
+    if (s.socket < 0 || s.socket >= sim.sockets_len || !sim.sockets[s.socket].open)
+        return NULL;
+    return &sim.sockets[s.socket];
+}
+
+static SimSocket *socket_find(Address const *const addr) {
+    for (int i = 0; i < sim.sockets_len; i++) {
+        SimSocket *const s = &sim.sockets[i];
+        if (s->open && s->bound && s->addr.sin_port == addr->sin_port
+            && (s->addr.sin_addr.s_addr == htonl(INADDR_ANY) || s->addr.sin_addr.s_addr == addr->sin_addr.s_addr))
+            return s;
+    }
+    return NULL;
+}
+
+static bool socket_readable(SimSocket const *const s) {
+    return s->queue != NULL && s->queue->at <= sim.now;
+}
+
+static void bind_ephemeral(SimSocket *const s) {
+    Address addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    do addr.sin_port = htons(sim.next_port++);
+    while (socket_find(&addr) != NULL);
+
+    s->addr = addr;
+    s->bound = true;
+}
+
+static void deliver(SimSocket *const dest, int64_t const at, Address const *const source, void const *const buf, int const len) {
+    if (dest->queued >= RECV_QUEUE_MAX) {
+        sim.stats.lost++;
+        return;
+    }
+
+    Datagram *const d = malloc(sizeof (Datagram) + len);
+    if (d == NULL)
+        EXIT_PRINT("Failed to allocate simulated datagram");
+    d->at = at;
+    d->order = sim.order++;
+    d->source = *source;
+    d->len = len;
+    memcpy(d->data, buf, len);
+
+    Datagram **at_link = &dest->queue;
+    while (*at_link != NULL && (*at_link)->at <= at)
+        at_link = &(*at_link)->next;
+    d->next = *at_link;
+    *at_link = d;
+
+    dest->queued++;
+    sim.stats.delivered++;
+}
+
+static char *link_get_error(void) {
+    return error_buffer;
+}
+
+static bool link_init_udp(Socket *const s) {
+    lock(&sim_lock);
+
+    int index = 0;
+    while (index < sim.sockets_len && sim.sockets[index].open) index++;
+
+    if (index == sim.sockets_len) {
+        SimSocket *const sockets = realloc(sim.sockets, (sim.sockets_len + 1) * sizeof (SimSocket));
+        if (sockets == NULL)
+            FAIL_AND_UNLOCK("Failed to allocate simulated socket");
+        sim.sockets = sockets;
+        sim.sockets_len++;
+    }
+
+    sim.sockets[index] = (SimSocket) {.open = true};
+    s->socket = index;
+
+    unlock(&sim_lock);
+    return true;
+}
+
+static bool link_close(Socket const s) {
+    lock(&sim_lock);
+
+    SimSocket *const sock = socket_get(s);
+    if (sock == NULL)
+        FAIL_AND_UNLOCK("Invalid simulated socket");
+
+    while (sock->queue != NULL) {
+        Datagram *const d = sock->queue;
+        sock->queue = d->next;
+        free(d);
+    }
+    sock->open = false;
+
+    unlock(&sim_lock);
+    return true;
+}
+
+static bool link_bind(Socket const s, Address *const addr) {
+    lock(&sim_lock);
+
+    SimSocket *const sock = socket_get(s);
+    if (sock == NULL)
+        FAIL_AND_UNLOCK("Invalid simulated socket");
+
+    if (sock->bound)
+        FAIL_AND_UNLOCK("Simulated socket is already bound");
+
+    if (addr->sin_port == 0) {
+        bind_ephemeral(sock);
+        sock->addr.sin_addr = addr->sin_addr;
+    }
+    else {
+        if (socket_find(addr) != NULL)
+            FAIL_AND_UNLOCK("Simulated address is already in use");
+        sock->addr = *addr;
+        sock->bound = true;
+    }
+
+    unlock(&sim_lock);
+    return true;
+}
+
+static bool link_sendto_inet(Socket const s, void const *const buf, int const len, Address const *const dest) {
+    lock(&sim_lock);
+
+    SimSocket *const sock = socket_get(s);
+    if (sock == NULL)
+        FAIL_AND_UNLOCK("Invalid simulated socket");
+
+    if (!sock->bound) bind_ephemeral(sock);
+
+    Address source = sock->addr;
+    if (source.sin_addr.s_addr == htonl(INADDR_ANY))
+        source.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    sim.stats.sent++;
+    SimLink const *const link = &sim.link;
+
+    /* The datagram leaves once the link has sent everything before it */ {
+        int64_t departs = sim.now;
+        if (link->bandwidth > 0) {
+            int64_t const start = sock->link_free > sim.now ? sock->link_free : sim.now;
+            if (start - sim.now > BACKLOG_MAX) {
+                sim.stats.lost++;
+                unlock(&sim_lock);
+                return true;
+            }
+            sock->link_free = start + (int64_t) len * 1000000 / link->bandwidth;
+            departs = sock->link_free;
+        }
+
+        if (random_chance(link->loss)) {
+            sim.stats.lost++;
+            unlock(&sim_lock);
+            return true;
+        }
+
+        int const copies = random_chance(link->duplicate) ? 2 : 1;
+        if (copies == 2) sim.stats.duplicated++;
+
+        for (int i = 0; i < copies; i++) {
+            int64_t at = departs + link->latency * 1000LL;
+            if (link->jitter > 0)
+                at += random_next() % (uint64_t) (link->jitter * 1000LL + 1);
+            if (random_chance(link->reorder))
+                at += link->latency * 1000LL;
+
+            // Like UDP, nobody listening means the datagram is gone.
+            SimSocket *const dest_sock = socket_find(dest);
+            if (dest_sock == NULL) {
+                sim.stats.lost++;
+                continue;
+            }
+            deliver(dest_sock, at, &source, buf, len);
+        }
+    }
+
+    unlock(&sim_lock);
+    return true;
+}
+
+static bool link_recvfrom_inet(Socket const s, void *const buf, int const len, int *const read, Address *const src) {
+    lock(&sim_lock);
+
+    SimSocket *const sock = socket_get(s);
+    if (sock == NULL)
+        FAIL_AND_UNLOCK("Invalid simulated socket");
+
+    if (!socket_readable(sock))
+        FAIL_AND_UNLOCK("Failed to receive data (would block)");
+
+    Datagram *const d = sock->queue;
+    sock->queue = d->next;
+    sock->queued--;
+
+    // Like UDP, the rest of a datagram that does not fit is discarded.
+    int const n = d->len < len ? d->len : len;
+    memcpy(buf, d->data, n);
+    *read = n;
+    *src = d->source;
+    free(d);
+
+    unlock(&sim_lock);
+    return true;
+}
+
+// This function blocks execution, in virtual time.
+static bool link_poll(Socket const s, short const ev_req, short *const ev_ret, int const timeout) {
+    lock(&sim_lock);
+    check_self();
+
+    SimSocket *const sock = socket_get(s);
+    if (sock == NULL)
+        FAIL_AND_UNLOCK("Invalid simulated socket");
+
+    // Sending never blocks, the link queues or drops instead.
+    short ev = ev_req & POLLOUT;
+
+    if ((ev_req & POLLIN) && ev == 0 && !socket_readable(sock) && timeout != 0) {
+        self->activity = POLLING;
+        self->socket = s.socket;
+        self->wake = timeout < 0 ? NEVER : sim.now + timeout * 1000LL;
+        yield();
+    }
+
+    if ((ev_req & POLLIN) && socket_readable(sock))
+        ev |= POLLIN;
+
+    *ev_ret = ev;
+    unlock(&sim_lock);
+    return true;
+}
+
+static SocketTransport const transport = {
+    .get_error = link_get_error,
+    .init_udp = link_init_udp,
+    .close = link_close,
+    .bind = link_bind,
+    .sendto_inet = link_sendto_inet,
+    .recvfrom_inet = link_recvfrom_inet,
+    .poll = link_poll,
+};
+
+/* Control */
+
+bool simnet_start(SimLink const *const link) {
+    lock(&sim_lock);
+
+    if (sim.started)
+        FAIL_AND_UNLOCK("Simulation is already running");
+
+    memset(&sim, 0, sizeof sim);
+    sim.started = true;
+    sim.link = *link;
+    sim.random = link->seed;
+    sim.now = EPOCH;
+    sim.next_port = EPHEMERAL_PORT;
+
+    self = participant_new(RUNNING);
+    sim.running = self;
+
+    unlock(&sim_lock);
+
+    socket_set_transport(&transport);
+    thread_set_scheduler(&scheduler);
+    return true;
+}
+
+bool simnet_stop() {
+    lock(&sim_lock);
+
+    if (!sim.started)
+        FAIL_AND_UNLOCK("Simulation is not running");
+
+    for (int i = 0; i < sim.participants_len; i++) {
+        if (sim.participants[i] != self && sim.participants[i]->activity != FINISHED)
+            FAIL_AND_UNLOCK("Simulated threads are still running");
+    }
+
+    for (int i = 0; i < sim.sockets_len; i++) {
+        if (sim.sockets[i].open)
+            FAIL_AND_UNLOCK("Simulated sockets are still open");
+    }
+
+    thread_set_scheduler(NULL);
+    socket_set_transport(NULL);
+
+    for (int i = 0; i < sim.participants_len; i++) {
+        cond_close(&sim.participants[i]->turn);
+        free(sim.participants[i]);
+    }
+    free(sim.participants);
+    free(sim.sockets);
+
+    memset(&sim, 0, sizeof sim);
+    self = NULL;
+
+    unlock(&sim_lock);
+    return true;
+}
+
+void simnet_set_link(SimLink const *const link) {
+    lock(&sim_lock);
+    sim.link = *link;
+    unlock(&sim_lock);
+}
+
+void simnet_get_stats(SimStats *const stats) {
+    lock(&sim_lock);
+    *stats = sim.stats;
+    unlock(&sim_lock);
+}
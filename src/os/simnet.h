@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// An in-memory UDP link with a virtual clock.
+// While running, every socket goes through the link and every thread spawned runs in virtual time,
+// one at a time, so a session with the same seed and link plays out exactly the same way and
+// takes no longer than its computation.
+
+typedef struct {
+    uint64_t seed;   // only read by `simnet_start`
+    long latency;    // milliseconds, one way
+    long jitter;     // milliseconds, up to this much is added to the latency
+    float loss;      // probability that a datagram is dropped
+    float duplicate; // probability that a datagram is delivered twice
+    float reorder;   // probability that a datagram is held back by another `latency`
+    long bandwidth;  // bytes per second leaving each socket, 0 for unlimited
+} SimLink;
+
+typedef struct {
+    long sent;
+    long delivered;
+    long lost;       // by `loss`, a full link or a full receive queue
+    long duplicated;
+} SimStats;
+
+char *simnet_get_error(void);
+
+// The calling thread keeps running, the others only run while it sleeps, polls or joins.
+// Fails if the simulation is already running.
+bool simnet_start(SimLink const *link);
+
+// Every thread spawned since `simnet_start` must have finished and every socket must be closed.
+bool simnet_stop(void);
+
+// Changes the link conditions, datagrams already in flight keep their delivery time.
+void simnet_set_link(SimLink const *link);
+
+void simnet_get_stats(SimStats *stats);
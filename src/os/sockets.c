@@ -4,10 +4,23 @@
 #include <unistd.h>
 #include <errno.h>
 #include <poll.h>
+#include <stdint.h>
+#include <netinet/udp.h>
 
 #include "./sockets.h"
 #include "../util.h"
 
+// Older libc headers lack these even on kernels that support them.
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT (103)
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO (104)
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL (69)
+#endif
+
 static char error_buffer[1024];
 
 #define FAIL(string) { \
@@ -22,10 +35,29 @@ static char error_buffer[1024];
     return false; \
 }
 
+// Copies the transport's error so `sockets_get_error` keeps working.
+#define TRANSPORT_CALL(call) { \
+    if (!transport->call) { \
+        snprintf(error_buffer, 1024, "%s", transport->get_error()); \
+        return false; \
+    } \
+    return true; \
+}
+
+static SocketTransport const *transport = NULL;
+
 char *sockets_get_error() {
     return error_buffer;
 }
 
+void socket_set_transport(SocketTransport const *const t) {
+    transport = t;
+}
+
+bool socket_has_transport() {
+    return transport != NULL;
+}
+
 bool socket_startup() {
     return true;
 }
@@ -35,6 +67,8 @@ bool socket_cleanup() {
 }
 
 bool socket_init_udp(Socket *const s) {
+    if (transport != NULL) TRANSPORT_CALL(init_udp(s));
+
     s->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, AF_UNSPEC);
     if (s->socket == -1)
         FAIL_AND_GET_ERROR("Failed to initialize socket");
@@ -42,18 +76,24 @@ bool socket_init_udp(Socket *const s) {
 }
 
 bool socket_close(Socket const s) {
+    if (transport != NULL) TRANSPORT_CALL(close(s));
+
     if (close(s.socket) == -1)
         FAIL_AND_GET_ERROR("Failed to close socket");
     return true;
 }
 
 bool socket_bind(Socket const s, struct sockaddr_in *const addr) {
+    if (transport != NULL) TRANSPORT_CALL(bind(s, addr));
+
     if (bind(s.socket, (struct sockaddr *) addr, sizeof (struct sockaddr_in)) == -1)
         FAIL_AND_GET_ERROR("Failed to bind socket");
     return true;
 }
 
 bool socket_sendto_inet(Socket const s, void const *const buf, int const len, struct sockaddr_in const *const dest) {
+    if (transport != NULL) TRANSPORT_CALL(sendto_inet(s, buf, len, dest));
+
     int const n = sendto(s.socket, buf, len, 0, (struct sockaddr *) dest, sizeof (struct sockaddr_in));
 
     if (n == -1)
@@ -66,6 +106,8 @@ bool socket_sendto_inet(Socket const s, void const *const buf, int const len, st
 }
 
 bool socket_recvfrom_inet(Socket const s, void *const buf, int const len, int *const read, struct sockaddr_in *const src) {
+    if (transport != NULL) TRANSPORT_CALL(recvfrom_inet(s, buf, len, read, src));
+
     socklen_t addr_len = sizeof (struct sockaddr_in);
     int const n = recvfrom(s.socket, buf, len, 0, (struct sockaddr *) src, &addr_len);
 
@@ -79,8 +121,143 @@ bool socket_recvfrom_inet(Socket const s, void *const buf, int const len, int *c
     return true;
 }
 
+bool socket_enable_gso(Socket const s) {
+    if (transport != NULL)
+        FAIL("UDP segmentation offload is not available with a socket transport");
+
+    // A segment size of 0 leaves plain sends alone, so this only checks that the kernel knows the option.
+    int const size = 0;
+    if (setsockopt(s.socket, SOL_UDP, UDP_SEGMENT, &size, sizeof size) == -1)
+        FAIL_AND_GET_ERROR("Failed to enable UDP segmentation offload");
+    return true;
+}
+
+bool socket_enable_gro(Socket const s) {
+    if (transport != NULL)
+        FAIL("UDP receive offload is not available with a socket transport");
+
+    int const enabled = 1;
+    if (setsockopt(s.socket, SOL_UDP, UDP_GRO, &enabled, sizeof enabled) == -1)
+        FAIL_AND_GET_ERROR("Failed to enable UDP receive offload");
+    return true;
+}
+
+bool socket_enable_busy_poll(Socket const s, int const micros) {
+    if (transport != NULL)
+        FAIL("Busy polling is not available with a socket transport");
+
+    if (setsockopt(s.socket, SOL_SOCKET, SO_BUSY_POLL, &micros, sizeof micros) == -1)
+        FAIL_AND_GET_ERROR("Failed to enable busy polling");
+
+    // Only known since Linux 5.11, without it busy polling still works but competes with interrupts.
+    int const prefer = 1;
+    setsockopt(s.socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof prefer);
+    return true;
+}
+
+bool socket_sendto_segments_inet(Socket const s, void const *const *const bufs, int const *const lens, int const count, struct sockaddr_in const *const dest) {
+    if (count == 1)
+        return socket_sendto_inet(s, bufs[0], lens[0], dest);
+
+    if (count > SOCKET_SEGMENTS_MAX)
+        FAIL("Too many segments");
+
+    struct iovec iov[SOCKET_SEGMENTS_MAX];
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        iov[i] = (struct iovec) {
+            .iov_base = (void *) bufs[i],
+            .iov_len = lens[i],
+        };
+        total += lens[i];
+    }
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof (uint16_t))];
+    } control = {0};
+
+    struct msghdr msg = {
+        .msg_name = (void *) dest,
+        .msg_namelen = sizeof (struct sockaddr_in),
+        .msg_iov = iov,
+        .msg_iovlen = count,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof control.buf,
+    };
+
+    // The kernel splits the payload into datagrams of this size, regardless of the iovec boundaries.
+    struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (uint16_t));
+    uint16_t const segment = lens[0];
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof segment);
+
+    ssize_t const n = sendmsg(s.socket, &msg, 0);
+
+    if (n == -1)
+        FAIL_AND_GET_ERROR("Failed to send data");
+
+    if (n < total)
+        FAIL("Did not send all data");
+
+    return true;
+}
+
+bool socket_recvfrom_segments_inet(Socket const s, void *const buf, int const len, int *const read, int *const segment, struct sockaddr_in *const src) {
+    if (transport != NULL) {
+        if (!socket_recvfrom_inet(s, buf, len, read, src))
+            return false;
+        *segment = *read;
+        return true;
+    }
+
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = len,
+    };
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof (int))];
+    } control;
+
+    struct msghdr msg = {
+        .msg_name = src,
+        .msg_namelen = sizeof (struct sockaddr_in),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof control.buf,
+    };
+
+    ssize_t const n = recvmsg(s.socket, &msg, 0);
+
+    if (n == -1)
+        FAIL_AND_GET_ERROR("Failed to receive data");
+
+    if (msg.msg_namelen != sizeof (struct sockaddr_in) || src->sin_family != AF_INET)
+        FAIL("Received data from non-IPv4 source");
+
+    *read = n;
+    *segment = n;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof size);
+            if (size > 0) *segment = size;
+        }
+    }
+
+    return true;
+}
+
 // This function blocks execution.
 bool socket_poll(Socket const s, short const ev_req, short *const ev_ret, int const timeout) {
+    if (transport != NULL) TRANSPORT_CALL(poll(s, ev_req, ev_ret, timeout));
+
     struct pollfd pfd = {
         .fd = s.socket,
         .events = ev_req,
@@ -157,10 +334,29 @@ static char error_buffer[1024];
     return false; \
 }
 
+// Copies the transport's error so `sockets_get_error` keeps working.
+#define TRANSPORT_CALL(call) { \
+    if (!transport->call) { \
+        snprintf(error_buffer, 1024, "%s", transport->get_error()); \
+        return false; \
+    } \
+    return true; \
+}
+
+static SocketTransport const *transport = NULL;
+
 char *sockets_get_error() {
     return error_buffer;
 }
 
+void socket_set_transport(SocketTransport const *const t) {
+    transport = t;
+}
+
+bool socket_has_transport() {
+    return transport != NULL;
+}
+
 bool socket_startup() {
     WSADATA wsaData;
     int const error = WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -176,6 +372,8 @@ bool socket_cleanup() {
 }
 
 bool socket_init_udp(Socket *const s) {
+    if (transport != NULL) TRANSPORT_CALL(init_udp(s));
+
     s->socket = socket(AF_INET, SOCK_DGRAM, AF_UNSPEC);
     if (s->socket == SOCKET_ERROR)
         FAIL_AND_GET_LAST_ERROR("Failed to initialize socket");
@@ -188,18 +386,24 @@ bool socket_init_udp(Socket *const s) {
 }
 
 bool socket_close(Socket const s) {
+    if (transport != NULL) TRANSPORT_CALL(close(s));
+
     if (closesocket(s.socket) == SOCKET_ERROR)
         FAIL_AND_GET_LAST_ERROR("Failed to close socket");
     return true;
 }
 
 bool socket_bind(Socket const s, struct sockaddr_in *const addr) {
+    if (transport != NULL) TRANSPORT_CALL(bind(s, addr));
+
     if (bind(s.socket, (struct sockaddr *) addr, sizeof (struct sockaddr_in)) == SOCKET_ERROR)
         FAIL_AND_GET_LAST_ERROR("Failed to bind socket");
     return true;
 }
 
 bool socket_sendto_inet(Socket const s, void const *const buf, int const len, struct sockaddr_in const *const dest) {
+    if (transport != NULL) TRANSPORT_CALL(sendto_inet(s, buf, len, dest));
+
     int const n = sendto(s.socket, buf, len, 0, (struct sockaddr *) dest, sizeof (struct sockaddr_in));
 
     if (n == -1)
@@ -212,6 +416,8 @@ bool socket_sendto_inet(Socket const s, void const *const buf, int const len, st
 }
 
 bool socket_recvfrom_inet(Socket const s, void *const buf, int const len, int *const read, struct sockaddr_in *const src) {
+    if (transport != NULL) TRANSPORT_CALL(recvfrom_inet(s, buf, len, read, src));
+
     int addr_len = sizeof (struct sockaddr_in);
     int const n = recvfrom(s.socket, buf, len, 0, (struct sockaddr *) src, &addr_len);
 
@@ -226,8 +432,38 @@ bool socket_recvfrom_inet(Socket const s, void *const buf, int const len, int *c
     return true;
 }
 
+bool socket_enable_gso(Socket const s) {
+    FAIL("UDP segmentation offload is only supported on Linux");
+}
+
+bool socket_enable_gro(Socket const s) {
+    FAIL("UDP receive offload is only supported on Linux");
+}
+
+bool socket_enable_busy_poll(Socket const s, int const micros) {
+    FAIL("Busy polling is only supported on Linux");
+}
+
+// Without offload, so the datagrams go out one call each.
+bool socket_sendto_segments_inet(Socket const s, void const *const *const bufs, int const *const lens, int const count, struct sockaddr_in const *const dest) {
+    for (int i = 0; i < count; i++) {
+        if (!socket_sendto_inet(s, bufs[i], lens[i], dest))
+            return false;
+    }
+    return true;
+}
+
+bool socket_recvfrom_segments_inet(Socket const s, void *const buf, int const len, int *const read, int *const segment, struct sockaddr_in *const src) {
+    if (!socket_recvfrom_inet(s, buf, len, read, src))
+        return false;
+    *segment = *read;
+    return true;
+}
+
 // This function blocks execution.
 bool socket_poll(Socket const s, short const ev_req, short *const ev_ret, int const timeout) {
+    if (transport != NULL) TRANSPORT_CALL(poll(s, ev_req, ev_ret, timeout));
+
     WSAPOLLFD pfd = {
         .fd = s.socket,
         .events = ev_req,
@@ -15,8 +15,28 @@ typedef struct { SOCKET socket; } Socket;
 typedef struct sockaddr_in Address;
 #endif
 
+// Most datagrams passed to one `socket_sendto_segments_inet` call.
+#define SOCKET_SEGMENTS_MAX (64)
+
 char *sockets_get_error(void);
 
+// Replaces the operating system's UDP sockets, e.g. with a simulated link.
+// Each function mirrors the `socket_*` function of the same name, errors are read through `get_error`.
+typedef struct {
+    char *(*get_error)(void);
+    bool (*init_udp)(Socket *socket);
+    bool (*close)(Socket socket);
+    bool (*bind)(Socket socket, Address *address);
+    bool (*sendto_inet)(Socket socket, void const *buffer, int length, Address const *destination);
+    bool (*recvfrom_inet)(Socket socket, void *buffer, int length, int *read, Address *source);
+    bool (*poll)(Socket socket, short events_requested, short *events_returned, int timeout_millis);
+} SocketTransport;
+
+// Routes the socket functions through `transport`, or back to the operating system with NULL.
+// No socket may be open while switching. Offload is unavailable with a transport.
+void socket_set_transport(SocketTransport const *transport);
+bool socket_has_transport(void);
+
 bool socket_startup();
 bool socket_cleanup();
 
@@ -27,5 +47,26 @@ bool socket_bind(Socket socket, Address *address);
 bool socket_sendto_inet(Socket socket, void const *buffer, int length, Address const *destination);
 bool socket_recvfrom_inet(Socket socket, void *buffer, int length, int *read, Address *source);
 
+// UDP segmentation offload: a run of equal-sized datagrams to one destination is handed to the kernel in one call.
+// Fails when the kernel or platform does not support it.
+bool socket_enable_gso(Socket socket);
+
+// UDP receive offload: a burst of datagrams from one source may be read at once.
+// Fails when the kernel or platform does not support it.
+bool socket_enable_gro(Socket socket);
+
+// Lets a receive waiting on the socket spin on the network device's queue for up to `micros` microseconds before sleeping,
+// preferring that over interrupts. Raising it above the net.core.busy_read sysctl needs CAP_NET_ADMIN.
+// Fails when the kernel or platform does not support it.
+bool socket_enable_busy_poll(Socket socket, int micros);
+
+// Sends `count` datagrams, all but the last exactly `lengths[0]` bytes long and the last at most that.
+// With more than one datagram `socket_enable_gso` must have succeeded on the socket.
+bool socket_sendto_segments_inet(Socket socket, void const *const *buffers, int const *lengths, int count, Address const *destination);
+
+// Like `socket_recvfrom_inet`, but `buffer` may hold several datagrams, each `segment` bytes long except the last.
+// `segment` is `read` unless `socket_enable_gro` succeeded on the socket.
+bool socket_recvfrom_segments_inet(Socket socket, void *buffer, int length, int *read, int *segment, Address *source);
+
 bool socket_poll(Socket socket, short events_requested, short *const events_returned, int timeout_millis);
 
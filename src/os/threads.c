@@ -1,9 +1,14 @@
 #ifdef __linux__
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #include <threads.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "./threads.h"
 #include "../util.h"
@@ -27,10 +32,16 @@ static char error_buffer[1024];
     return false; \
 }
 
+static Scheduler const *scheduler = NULL;
+
 char *threads_get_error() {
     return error_buffer;
 }
 
+void thread_set_scheduler(Scheduler const *const s) {
+    scheduler = s;
+}
+
 bool mutex_init(Mutex *const m) {
     int const error = pthread_mutex_init(&m->handle, NULL);
     if (error != 0)
@@ -57,12 +68,61 @@ bool mutex_unlock(Mutex *const m) {
     return true;
 }
 
+bool condvar_init(Condvar *const c) {
+    int const error = pthread_cond_init(&c->handle, NULL);
+    if (error != 0)
+        FAIL_WITH_ERROR("Failed to initialize condition variable", error);
+    return true;
+}
+
+bool condvar_close(Condvar *const c) {
+    int const error = pthread_cond_destroy(&c->handle);
+    if (error != 0)
+        FAIL_WITH_ERROR("Failed to close condition variable", error);
+    return true;
+}
+
+bool condvar_wait(Condvar *const c, Mutex *const m) {
+    int const error = pthread_cond_wait(&c->handle, &m->handle);
+    if (error != 0)
+        FAIL_WITH_ERROR("Failed to wait on condition variable", error);
+    return true;
+}
+
+bool condvar_wake_one(Condvar *const c) {
+    int const error = pthread_cond_signal(&c->handle);
+    if (error != 0)
+        FAIL_WITH_ERROR("Failed to wake condition variable", error);
+    return true;
+}
+
+bool condvar_wake_all(Condvar *const c) {
+    int const error = pthread_cond_broadcast(&c->handle);
+    if (error != 0)
+        FAIL_WITH_ERROR("Failed to wake condition variable", error);
+    return true;
+}
+
+// Sleeps while `*address` is `expected`, for at most `millis` milliseconds if not negative. Can return early.
+static void futex_wait(_Atomic uint32_t *const address, uint32_t const expected, long const millis) {
+    struct timespec const ts = {.tv_sec = millis / 1000, .tv_nsec = millis % 1000 * 1000000};
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, millis >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake_one(_Atomic uint32_t *const address) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 typedef struct {
     void (*function)(void *);
     void *context;
+    Scheduler const *scheduler;
+    void *scheduled;
 } WrapperContext;
 static void *wrapper(WrapperContext *const c) {
+    if (c->scheduled != NULL) c->scheduler->started(c->scheduled);
     c->function(c->context);
+    if (c->scheduled != NULL) c->scheduler->finished(c->scheduled);
     free(c);
     return NULL;
 }
@@ -70,9 +130,11 @@ static void *wrapper(WrapperContext *const c) {
 bool thread_is_null(Thread const thread) {
     return thread.handle == THREAD_NULL.handle;
 }
-bool thread_spawn(Thread *const t, void (*const function)(void *context), void *const context) {
+// Spawns a thread that runs under the scheduler if `scheduled` is its handle from `spawned`, or on its own if NULL.
+static bool spawn(Thread *const t, void (*const function)(void *context), void *const context, void *const scheduled) {
     WrapperContext *const wrapper_context = malloc(sizeof (WrapperContext));
-    *wrapper_context = (WrapperContext) {function, context};
+    *wrapper_context = (WrapperContext) {function, context, scheduler, scheduled};
+    t->scheduled = scheduled;
 
     int const error = pthread_create(&t->handle, NULL, (void *(*)(void *)) wrapper, wrapper_context);
     if (error != 0)
@@ -80,7 +142,13 @@ bool thread_spawn(Thread *const t, void (*const function)(void *context), void *
     return true;
 }
 
+bool thread_spawn(Thread *const t, void (*const function)(void *context), void *const context) {
+    return spawn(t, function, context, scheduler != NULL ? scheduler->spawned() : NULL);
+}
+
 bool thread_close(Thread t) {
+    if (t.scheduled != NULL && scheduler != NULL) scheduler->joining(t.scheduled);
+
     int const error = pthread_join(t.handle, NULL);
     if (error != 0)
         FAIL_WITH_ERROR("Failed to join thread", error);
@@ -95,19 +163,79 @@ bool thread_detach(Thread t) {
 }
 
 bool thread_sleep_ms(long const ms) {
+    if (scheduler != NULL) return scheduler->sleep_ms(ms);
+
     struct timespec const ts = {.tv_sec = 0, .tv_nsec = ms * 1000000};
     if (thrd_sleep(&ts, NULL) != 0)
         FAIL("Failed to sleep");
     return true;
 }
 
+bool thread_pin(int const cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int const error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (error != 0)
+        FAIL_WITH_ERROR("Failed to pin thread", error);
+    return true;
+}
+
+bool thread_set_realtime(int const priority) {
+    struct sched_param const param = {.sched_priority = priority};
+    int const error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0)
+        FAIL_WITH_ERROR("Failed to set real-time scheduling", error);
+    return true;
+}
+
+void thread_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile ("yield");
+#endif
+}
+
 bool time_get_monotonic(long *const millis) {
+    if (scheduler != NULL) return scheduler->get_monotonic(millis);
+
     struct timespec ts;
     if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
         FAIL_AND_GET_ERROR("Failed to get time");
     *millis = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
     return true;
 }
+
+bool time_get_monotonic_us(long long *const micros) {
+    if (scheduler != NULL) {
+        long millis;
+        if (!scheduler->get_monotonic(&millis)) return false;
+        *micros = millis * 1000LL;
+        return true;
+    }
+
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        FAIL_AND_GET_ERROR("Failed to get time");
+    *micros = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    return true;
+}
+
+uint64_t time_get_precise_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int cpu_count(void) {
+    long const count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+}
+
+static void yield(void) {
+    sched_yield();
+}
 #endif
 
 #ifdef _WIN64
@@ -144,46 +272,82 @@ static char error_buffer[1024];
     return false; \
 }
 
+static Scheduler const *scheduler = NULL;
+
 char *threads_get_error() {
     return error_buffer;
 }
 
+void thread_set_scheduler(Scheduler const *const s) {
+    scheduler = s;
+}
+
+// A critical section rather than a mutex object, so condition variables can wait on it.
 bool mutex_init(Mutex *const m) {
-    m->handle = CreateMutex(NULL, false, NULL);
-    if (m->handle == NULL)
-        FAIL_AND_GET_LAST_ERROR("Failed to initialize mutex");
+    InitializeCriticalSection(&m->handle);
     return true;
 }
 
 bool mutex_close(Mutex *const m) {
-    if (CloseHandle(m->handle) == 0)
-        FAIL_AND_GET_LAST_ERROR("Failed to close mutex");
+    DeleteCriticalSection(&m->handle);
     return true;
 }
 
 // This function blocks execution.
 bool mutex_lock(Mutex *const m) {
-    switch (WaitForSingleObject(m->handle, INFINITE)) {
-        case WAIT_OBJECT_0:  return true;
-        case WAIT_TIMEOUT:   FAIL("Failed to lock mutex (timed out)");
-        case WAIT_ABANDONED: FAIL("Failed to lock mutex (owning thread was terminated)");
-        case WAIT_FAILED:    FAIL_AND_GET_LAST_ERROR("Failed to lock mutex");
-        default:             FAIL("Failed to lock mutex (unknown cause)");
-    }
+    EnterCriticalSection(&m->handle);
+    return true;
 }
 
 bool mutex_unlock(Mutex *const m) {
-    if (ReleaseMutex(m->handle) == 0)
-        FAIL_AND_GET_LAST_ERROR("Failed to unlock mutex");
+    LeaveCriticalSection(&m->handle);
+    return true;
+}
+
+bool condvar_init(Condvar *const c) {
+    InitializeConditionVariable(&c->handle);
+    return true;
+}
+
+bool condvar_close(Condvar *const c) {
+    return true;
+}
+
+bool condvar_wait(Condvar *const c, Mutex *const m) {
+    if (!SleepConditionVariableCS(&c->handle, &m->handle, INFINITE))
+        FAIL_AND_GET_LAST_ERROR("Failed to wait on condition variable");
+    return true;
+}
+
+bool condvar_wake_one(Condvar *const c) {
+    WakeConditionVariable(&c->handle);
     return true;
 }
 
+bool condvar_wake_all(Condvar *const c) {
+    WakeAllConditionVariable(&c->handle);
+    return true;
+}
+
+// Sleeps while `*address` is `expected`, for at most `millis` milliseconds if not negative. Can return early.
+static void futex_wait(_Atomic uint32_t *const address, uint32_t const expected, long const millis) {
+    WaitOnAddress((volatile void *) address, (void *) &expected, sizeof expected, millis >= 0 ? (DWORD) millis : INFINITE);
+}
+
+static void futex_wake_one(_Atomic uint32_t *const address) {
+    WakeByAddressSingle((void *) address);
+}
+
 typedef struct {
     void (*function)(void *);
     void *context;
+    Scheduler const *scheduler;
+    void *scheduled;
 } WrapperContext;
 static unsigned int __stdcall wrapper(WrapperContext *const c) {
+    if (c->scheduled != NULL) c->scheduler->started(c->scheduled);
     c->function(c->context);
+    if (c->scheduled != NULL) c->scheduler->finished(c->scheduled);
     free(c);
     _endthreadex(0);
     return 0;
@@ -193,9 +357,11 @@ bool thread_is_null(Thread const t) {
     return t.handle == THREAD_NULL.handle;
 }
 
-bool thread_spawn(Thread *const t, void (*const function)(void *), void *const context) {
+// Spawns a thread that runs under the scheduler if `scheduled` is its handle from `spawned`, or on its own if NULL.
+static bool spawn(Thread *const t, void (*const function)(void *), void *const context, void *const scheduled) {
     WrapperContext *wrapper_context = malloc(sizeof (WrapperContext));
-    *wrapper_context = (WrapperContext) {function, context};
+    *wrapper_context = (WrapperContext) {function, context, scheduler, scheduled};
+    t->scheduled = scheduled;
 
     t->handle = (HANDLE) _beginthreadex(
         NULL, 0,
@@ -208,7 +374,13 @@ bool thread_spawn(Thread *const t, void (*const function)(void *), void *const c
     return true;
 }
 
+bool thread_spawn(Thread *const t, void (*const function)(void *), void *const context) {
+    return spawn(t, function, context, scheduler != NULL ? scheduler->spawned() : NULL);
+}
+
 bool thread_close(Thread t) {
+    if (t.scheduled != NULL && scheduler != NULL) scheduler->joining(t.scheduled);
+
     if (WaitForSingleObject(t.handle, INFINITE) != WAIT_OBJECT_0)
         FAIL_AND_GET_LAST_ERROR("Failed to join thread");
     if (CloseHandle(t.handle) == 0)
@@ -223,12 +395,321 @@ bool thread_detach(Thread t) {
 }
 
 bool thread_sleep_ms(long const ms) {
+    if (scheduler != NULL) return scheduler->sleep_ms(ms);
+
     Sleep((DWORD) ms);
     return true;
 }
 
+bool thread_pin(int const cpu) {
+    if (cpu >= 64)
+        FAIL("Failed to pin thread: only the first 64 processors can be picked");
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu) == 0)
+        FAIL_AND_GET_LAST_ERROR("Failed to pin thread");
+    return true;
+}
+
+bool thread_set_realtime(int const priority) {
+    if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+        FAIL_AND_GET_LAST_ERROR("Failed to set real-time scheduling");
+    return true;
+}
+
+void thread_pause(void) {
+    YieldProcessor();
+}
+
 bool time_get_monotonic(long *const millis) {
+    if (scheduler != NULL) return scheduler->get_monotonic(millis);
+
     *millis = GetTickCount();
     return true;
 }
+
+bool time_get_monotonic_us(long long *const micros) {
+    if (scheduler != NULL) {
+        long millis;
+        if (!scheduler->get_monotonic(&millis)) return false;
+        *micros = millis * 1000LL;
+        return true;
+    }
+
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    *micros = counter.QuadPart / frequency.QuadPart * 1000000LL + counter.QuadPart % frequency.QuadPart * 1000000LL / frequency.QuadPart;
+    return true;
+}
+
+uint64_t time_get_precise_ns(void) {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) (counter.QuadPart / frequency.QuadPart * 1000000000LL + counter.QuadPart % frequency.QuadPart * 1000000000LL / frequency.QuadPart);
+}
+
+static int cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+}
+
+static void yield(void) {
+    SwitchToThread();
+}
+#endif
+
+#if defined(__linux__) || defined(_WIN64)
+#include <stdlib.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#define EVENT_SLEEP (5) // milliseconds, the steps an event is polled in under a scheduler
+
+// 0 while clear, 1 while signalled, 2 while clear and the waiter might be asleep.
+void event_init(Event *const e) {
+    atomic_init(&e->state, 0);
+}
+
+void event_signal(Event *const e) {
+    if (atomic_exchange(&e->state, 1) == 2)
+        futex_wake_one(&e->state);
+}
+
+bool event_wait(Event *const e, long const millis) {
+    if (scheduler != NULL) {
+        long waited = 0;
+        while (true) {
+            uint32_t signalled = 1;
+            if (atomic_compare_exchange_strong(&e->state, &signalled, 0)) return true;
+            if (millis >= 0 && waited >= millis) return false;
+
+            long const step = millis >= 0 && millis - waited < EVENT_SLEEP ? millis - waited : EVENT_SLEEP;
+            if (!scheduler->sleep_ms(step)) return false;
+            waited += step;
+        }
+    }
+
+    uint64_t const start = time_get_precise_ns();
+    while (true) {
+        uint32_t state = atomic_load(&e->state);
+        if (state == 1) {
+            if (atomic_compare_exchange_strong(&e->state, &state, 0)) return true;
+            continue;
+        }
+        if (state == 0 && !atomic_compare_exchange_strong(&e->state, &state, 2)) continue;
+
+        long remaining = -1;
+        if (millis >= 0) {
+            long const elapsed = (long) ((time_get_precise_ns() - start) / 1000000);
+            if (elapsed >= millis) return false;
+            remaining = millis - elapsed;
+        }
+        futex_wait(&e->state, 2, remaining);
+    }
+}
+
+#define JOBS_MAX_WORKERS (15)
+#define JOBS_DEQUE (64) // power of two, halving a 32-bit range never nests deeper
+#define CACHE_LINE (64)
+
+// Chase-Lev work-stealing deque of index ranges, packed as `begin << 32 | end`.
+// The owning thread pushes and pops at the bottom, any other thread steals from the top.
+typedef struct {
+    alignas(CACHE_LINE) _Atomic int64_t top;
+    alignas(CACHE_LINE) _Atomic int64_t bottom;
+    _Atomic uint64_t ranges[JOBS_DEQUE];
+} Deque;
+
+typedef struct {
+    JobPool *pool;
+    int index; // of its deque
+} Worker;
+
+struct JobPool {
+    Deque deques[JOBS_MAX_WORKERS + 1]; // the first one belongs to whoever calls `jobs_parallel_for`
+    Worker workers[JOBS_MAX_WORKERS];
+    Thread threads[JOBS_MAX_WORKERS];
+    int worker_count;
+
+    // The loop being run, only changed while `remaining` is 0.
+    job_t *body;
+    void *context;
+    uint32_t grain;
+
+    alignas(CACHE_LINE) _Atomic uint32_t remaining; // join counter, indices not yet run
+    _Atomic uint32_t generation;                    // bumped for every loop, idle workers sleep until it changes
+    _Atomic bool stopping;
+    Mutex mutex;
+    Condvar wake;
+};
+
+// Returns false if the deque is full.
+static bool deque_push(Deque *const d, uint64_t const range) {
+    int64_t const b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t const t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= JOBS_DEQUE) return false;
+
+    atomic_store_explicit(&d->ranges[b & (JOBS_DEQUE - 1)], range, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+static bool deque_pop(Deque *const d, uint64_t *const range) {
+    int64_t const b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return false;
+    }
+
+    *range = atomic_load_explicit(&d->ranges[b & (JOBS_DEQUE - 1)], memory_order_relaxed);
+    if (t < b) return true;
+
+    // The last range, a thief might be taking it at the same time.
+    bool const won = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+static bool deque_steal(Deque *const d, uint64_t *const range) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t const b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) return false;
+
+    *range = atomic_load_explicit(&d->ranges[t & (JOBS_DEQUE - 1)], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// Runs a range, first pushing its upper halves for others to steal until it is no bigger than the grain.
+static void jobs_run(JobPool *const pool, int const self, uint64_t const range) {
+    uint32_t const begin = (uint32_t) (range >> 32);
+    uint32_t end = (uint32_t) range;
+
+    while (end - begin > pool->grain) {
+        uint32_t const middle = begin + (end - begin) / 2;
+        if (!deque_push(&pool->deques[self], (uint64_t) middle << 32 | end)) break;
+        end = middle;
+    }
+
+    pool->body(pool->context, begin, end);
+    atomic_fetch_sub_explicit(&pool->remaining, end - begin, memory_order_release);
+}
+
+// Takes ranges from its own deque, then from the others, until every index of the loop has run.
+static void jobs_help(JobPool *const pool, int const self) {
+    int const deques = pool->worker_count + 1;
+    int victim = self;
+
+    while (atomic_load_explicit(&pool->remaining, memory_order_acquire) > 0) {
+        uint64_t range;
+        if (deque_pop(&pool->deques[self], &range)) {
+            jobs_run(pool, self, range);
+            continue;
+        }
+
+        bool stolen = false;
+        for (int i = 0; i < deques && !stolen; i++) {
+            victim = (victim + 1) % deques;
+            if (victim != self) stolen = deque_steal(&pool->deques[victim], &range);
+        }
+
+        if (stolen) jobs_run(pool, self, range);
+        else yield();
+    }
+}
+
+static void jobs_worker(Worker *const worker) {
+    JobPool *const pool = worker->pool;
+    uint32_t seen = 0;
+
+    while (true) {
+        mutex_lock(&pool->mutex);
+        while (atomic_load(&pool->generation) == seen && !atomic_load(&pool->stopping))
+            condvar_wait(&pool->wake, &pool->mutex);
+        mutex_unlock(&pool->mutex);
+
+        if (atomic_load(&pool->stopping)) break;
+        seen = atomic_load(&pool->generation);
+
+        jobs_help(pool, worker->index);
+    }
+}
+
+bool jobs_init(JobPool **const pool_ptr, int workers) {
+    if (workers < 0) workers = cpu_count() - 1;
+    if (workers > JOBS_MAX_WORKERS) workers = JOBS_MAX_WORKERS;
+
+    JobPool *const pool = calloc(1, sizeof (JobPool));
+    if (pool == NULL)
+        FAIL("Failed to allocate job pool");
+
+    if (!mutex_init(&pool->mutex)) {
+        free(pool);
+        return false;
+    }
+    if (!condvar_init(&pool->wake)) {
+        mutex_close(&pool->mutex);
+        free(pool);
+        return false;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pool->workers[i] = (Worker) {.pool = pool, .index = i + 1};
+        // Workers only ever compute, so they run outside the scheduler and leave a simulation's threads and clock alone.
+        if (!spawn(&pool->threads[i], (void (*)(void *)) jobs_worker, &pool->workers[i], NULL)) {
+            jobs_close(pool);
+            return false;
+        }
+        pool->worker_count++;
+    }
+
+    *pool_ptr = pool;
+    return true;
+}
+
+bool jobs_close(JobPool *const pool) {
+    mutex_lock(&pool->mutex);
+    atomic_store(&pool->stopping, true);
+    condvar_wake_all(&pool->wake);
+    mutex_unlock(&pool->mutex);
+
+    bool ok = true;
+    for (int i = 0; i < pool->worker_count; i++)
+        ok = thread_close(pool->threads[i]) && ok;
+
+    ok = condvar_close(&pool->wake) && ok;
+    ok = mutex_close(&pool->mutex) && ok;
+    free(pool);
+    return ok;
+}
+
+int jobs_worker_count(JobPool const *const pool) {
+    return pool->worker_count;
+}
+
+void jobs_parallel_for(JobPool *const pool, uint32_t const count, uint32_t const grain, job_t *const body, void *const context) {
+    if (count == 0) return;
+    if (pool->worker_count == 0 || count <= grain) {
+        body(context, 0, count);
+        return;
+    }
+
+    pool->body = body;
+    pool->context = context;
+    pool->grain = grain > 0 ? grain : 1;
+    atomic_store_explicit(&pool->remaining, count, memory_order_release);
+    deque_push(&pool->deques[0], count);
+
+    mutex_lock(&pool->mutex);
+    atomic_fetch_add(&pool->generation, 1);
+    condvar_wake_all(&pool->wake);
+    mutex_unlock(&pool->mutex);
+
+    jobs_help(pool, 0);
+}
 #endif
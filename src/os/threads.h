@@ -2,28 +2,66 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #ifdef __linux__
 #include <pthread.h>
 
 typedef struct { pthread_mutex_t handle; } Mutex;
-typedef struct { pthread_t handle; } Thread;
+typedef struct { pthread_cond_t handle; } Condvar;
+typedef struct { pthread_t handle; void *scheduled; } Thread;
 #define THREAD_NULL ((Thread) { 0 })
 #elif defined(_WIN64)
 #include <WinSock2.h>
 
-typedef struct { HANDLE handle; } Mutex, Thread;
+typedef struct { CRITICAL_SECTION handle; } Mutex;
+typedef struct { CONDITION_VARIABLE handle; } Condvar;
+typedef struct { HANDLE handle; void *scheduled; } Thread;
 #define THREAD_NULL ((Thread) { NULL })
 #endif
 
+// Auto-reset event for one waiting thread, backed by a futex (WaitOnAddress on Windows).
+// Signalling an event nobody waits on costs one atomic exchange, the signal is kept until the next wait.
+typedef struct { _Atomic uint32_t state; } Event;
+
 char *threads_get_error(void);
 
+// Takes over the clock, sleeping and the hand-off between threads, e.g. to run a simulation in virtual time.
+// `spawned` runs on the spawning thread and returns a handle for the new thread, which is passed to the others.
+typedef struct {
+    void *(*spawned)(void);
+    void (*started)(void *thread);  // first thing on the new thread
+    void (*finished)(void *thread); // last thing on the new thread
+    void (*joining)(void *thread);  // before waiting for the thread to finish
+    bool (*sleep_ms)(long millis);
+    bool (*get_monotonic)(long *millis);
+} Scheduler;
+
+// Hands threads spawned from now on and every sleep and clock read to `scheduler`, or back to the operating system with NULL.
+void thread_set_scheduler(Scheduler const *scheduler);
+
 bool mutex_init(Mutex *mutex);
 bool mutex_close(Mutex *mutex);
 
 bool mutex_lock(Mutex *mutex);
 bool mutex_unlock(Mutex *mutex);
 
+// Condition variables are not seen by the scheduler, so threads running under one must not wait on them.
+bool condvar_init(Condvar *condvar);
+bool condvar_close(Condvar *condvar);
+
+// Unlocks `mutex` while waiting, which must be locked. Can return without being woken, so wait in a loop.
+bool condvar_wait(Condvar *condvar, Mutex *mutex);
+bool condvar_wake_one(Condvar *condvar);
+bool condvar_wake_all(Condvar *condvar);
+
+void event_init(Event *event);
+void event_signal(Event *event);
+
+// Waits until the event is signalled and resets it, for at most `millis` milliseconds, or without limit if negative.
+// Returns whether it was signalled. Under a scheduler the wait is a series of short sleeps, so it runs in virtual time.
+bool event_wait(Event *event, long millis);
+
 bool thread_is_null(Thread thread);
 bool thread_spawn(Thread *thread, void function(void *constext), void *context);
 
@@ -34,5 +72,40 @@ bool thread_close(Thread thread);
 bool thread_detach(Thread thread);
 
 bool thread_sleep_ms(long millis);
+
+// Keeps the calling thread on processor `cpu`, counting from 0.
+bool thread_pin(int cpu);
+
+// Puts the calling thread under the real-time FIFO policy at `priority` (1 to 99), so it runs ahead of every normal thread
+// for as long as it wants. Usually needs CAP_SYS_NICE or an rtprio limit. On Windows it gets time critical priority instead.
+bool thread_set_realtime(int priority);
+
+// Tells the processor the calling thread is spinning, which spares the other hyperthread of its core and the memory bus.
+void thread_pause(void);
 bool time_get_monotonic(long *millis);
 
+// Same clock in microseconds, only as fine as the scheduler's clock while one is set.
+bool time_get_monotonic_us(long long *micros);
+
+// Nanoseconds from a raw hardware clock, for timing short stretches of code.
+// Not affected by clock adjustments or the scheduler.
+uint64_t time_get_precise_ns(void);
+
+// A fixed set of worker threads that split loops with the thread running them.
+// Each worker has its own deque of index ranges and steals from the others once it runs dry, so uneven work evens out.
+typedef struct JobPool JobPool;
+
+// Runs the indices from `begin` up to `end` of a loop.
+typedef void job_t(void *context, uint32_t begin, uint32_t end);
+
+// Starts `workers` threads, or one per processor besides the calling thread if negative.
+// With 0 workers every loop runs on the calling thread.
+bool jobs_init(JobPool **pool, int workers);
+bool jobs_close(JobPool *pool);
+
+int jobs_worker_count(JobPool const *pool);
+
+// Runs `body` over the indices from 0 up to `count`, in ranges of at most `grain` indices spread over the workers,
+// and returns once they have all run. The calling thread runs ranges too, and runs the whole loop itself if it is
+// no bigger than `grain`. Only one thread at a time may run loops on a pool, and nothing is allocated per loop.
+void jobs_parallel_for(JobPool *pool, uint32_t count, uint32_t grain, job_t *body, void *context);
@@ -0,0 +1,566 @@
+#ifdef __linux__
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/udp.h>
+#include <linux/io_uring.h>
+
+#include "./uring.h"
+#include "../util.h"
+
+static char error_buffer[1024];
+
+#define FAIL(string) { \
+    if (sizeof string > 1024) \
+        EXIT_PRINT("Error message too long for buffer"); \
+    memcpy(error_buffer, string, sizeof string); \
+    return false; \
+}
+
+#define FAIL_WITH_ERROR(string, error) { \
+    snprintf(error_buffer, 1024, string " (code: %d, '%s')", error, strerror(error)); \
+    return false; \
+}
+
+#define FAIL_AND_GET_ERROR(string) { \
+    snprintf(error_buffer, 1024, string " (code: %d, '%s')", errno, strerror(errno)); \
+    return false; \
+}
+
+#define RING_ENTRIES (256)
+#define RECV_BUFFERS (256) // power of two
+#define BUFFER_GROUP (0)
+#define RECV_TAG (UINT64_MAX)
+#define CANCEL_TAG (UINT64_MAX - 1)
+#define CLOSE_WAITS (10)   // waits for outstanding operations when closing
+#define CLOSE_WAIT (100)   // milliseconds
+#define NO_SLOT (UINT32_MAX)
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT (103)
+#endif
+
+typedef struct {
+    struct msghdr msg;
+    struct iovec iov[SOCKET_SEGMENTS_MAX];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof (uint16_t))];
+    } control;
+    struct sockaddr_in addr;
+    void *users[SOCKET_SEGMENTS_MAX];
+    int count;
+    size_t total;
+    uint32_t next_free;
+} SendSlot;
+
+struct Uring {
+    int fd;
+    Socket socket;
+    uring_received_t *received;
+    uring_sent_t *sent;
+    void *context;
+
+    void *rings; // submission and completion rings share one mapping
+    size_t rings_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // includes queued entries not yet published to the kernel
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    SendSlot *slots;
+    uint32_t free_slot;
+    uint32_t sending; // slots in flight
+
+    bool receive;
+    bool recv_armed;
+    struct msghdr recv_msg;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *buffers;
+    size_t buffer_size;
+};
+
+char *uring_get_error() {
+    return error_buffer;
+}
+
+static int sys_setup(unsigned const entries, struct io_uring_params *const params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int const fd, unsigned const to_submit, unsigned const min_complete, unsigned const flags, void *const arg, size_t const arg_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_register(int const fd, unsigned const opcode, void *const arg, unsigned const nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static struct io_uring_sqe *get_sqe(Uring *const r) {
+    unsigned const head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries)
+        return NULL;
+
+    struct io_uring_sqe *const sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    r->sq_local_tail++;
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+// Makes queued entries visible to the kernel and returns how many there are.
+static unsigned publish(Uring *const r) {
+    unsigned const tail = *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    return r->sq_local_tail - tail;
+}
+
+static bool enter(Uring *const r, unsigned const min_complete, int const timeout) {
+    unsigned const to_submit = publish(r);
+    if (to_submit == 0 && min_complete == 0)
+        return true;
+
+    int ret;
+    if (timeout >= 0) {
+        struct __kernel_timespec ts = {
+            .tv_sec = timeout / 1000,
+            .tv_nsec = (timeout % 1000) * 1000000L,
+        };
+        struct io_uring_getevents_arg arg = {
+            .sigmask = 0,
+            .sigmask_sz = _NSIG / 8,
+            .ts = (uint64_t) (uintptr_t) &ts,
+        };
+        ret = sys_enter(r->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+    }
+    else {
+        ret = sys_enter(r->fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }
+
+    // Timeouts and signals are fine, and a busy completion queue is drained by the caller reaping it.
+    if (ret == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        FAIL_AND_GET_ERROR("Failed to enter io_uring");
+    return true;
+}
+
+static bool arm_recv(Uring *const r) {
+    struct io_uring_sqe *const sqe = get_sqe(r);
+    if (sqe == NULL)
+        FAIL("Submission queue is full");
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = r->socket.socket;
+    sqe->addr = (uint64_t) (uintptr_t) &r->recv_msg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = RECV_TAG;
+
+    r->recv_armed = true;
+    return true;
+}
+
+static void recycle(Uring *const r, unsigned const bid) {
+    unsigned short const tail = r->buf_ring->tail;
+    struct io_uring_buf *const buf = &r->buf_ring->bufs[tail & (RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (r->buffers + bid * r->buffer_size);
+    buf->len = r->buffer_size;
+    buf->bid = bid;
+    __atomic_store_n(&r->buf_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+static bool handle_recv(Uring *const r, struct io_uring_cqe const *const cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        r->recv_armed = false;
+
+    if (cqe->res < 0) {
+        if (cqe->res == -ENOBUFS) // every buffer is in use, rearmed once they are back
+            return true;
+        if (cqe->res == -ECANCELED) // by `uring_close`
+            return true;
+        FAIL_WITH_ERROR("Failed to receive data", -cqe->res);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        FAIL("Received data without a provided buffer");
+
+    unsigned const bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t *const buf = r->buffers + bid * r->buffer_size;
+    struct io_uring_recvmsg_out const *const out = (void *) buf;
+
+    if (out->namelen == sizeof (struct sockaddr_in) && !(out->flags & MSG_TRUNC)) {
+        struct sockaddr_in src;
+        memcpy(&src, buf + sizeof *out, sizeof src);
+
+        if (src.sin_family == AF_INET)
+            r->received(r->context, buf + sizeof *out + r->recv_msg.msg_namelen + r->recv_msg.msg_controllen, out->payloadlen, &src);
+    }
+
+    recycle(r, bid);
+    return true;
+}
+
+static bool handle_sent(Uring *const r, struct io_uring_cqe const *const cqe) {
+    SendSlot *const slot = &r->slots[cqe->user_data];
+    uint32_t const index = cqe->user_data;
+
+    for (int i = 0; i < slot->count; i++)
+        r->sent(r->context, slot->users[i]);
+    slot->next_free = r->free_slot;
+    r->free_slot = index;
+    r->sending--;
+
+    if (cqe->res < 0)
+        FAIL_WITH_ERROR("Failed to send data", -cqe->res);
+
+    if ((size_t) cqe->res < slot->total)
+        FAIL("Did not send all data");
+
+    return true;
+}
+
+// Handles every available completion.
+// The head is advanced before each callback, so callbacks may send (and thereby reap) themselves.
+static bool reap(Uring *const r) {
+    while (true) {
+        unsigned const head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+            break;
+
+        struct io_uring_cqe const cqe = r->cqes[head & r->cq_mask];
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (cqe.user_data == RECV_TAG) {
+            if (!handle_recv(r, &cqe)) return false;
+        }
+        else if (cqe.user_data == CANCEL_TAG) {
+            // Only the receive it cancelled matters.
+        }
+        else {
+            if (!handle_sent(r, &cqe)) return false;
+        }
+    }
+
+    if (r->receive && !r->recv_armed)
+        return arm_recv(r);
+
+    return true;
+}
+
+static bool setup(Uring *const r, Socket const s, bool const receive, int const max_payload) {
+    struct io_uring_params params = {0};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = RING_ENTRIES * 4; // multishot receives complete many times per submission
+
+    r->fd = sys_setup(RING_ENTRIES, &params);
+    if (r->fd == -1)
+        FAIL_AND_GET_ERROR("Failed to set up io_uring");
+
+    unsigned const required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required)
+        FAIL("Kernel io_uring lacks required features");
+
+    /* map the rings */ {
+        size_t const sq_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+        size_t const cq_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+        r->rings_size = sq_size > cq_size ? sq_size : cq_size;
+
+        r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+        if (r->rings == MAP_FAILED) {
+            r->rings = NULL;
+            FAIL_AND_GET_ERROR("Failed to map io_uring rings");
+        }
+
+        r->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+        r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+        if (r->sqes == MAP_FAILED) {
+            r->sqes = NULL;
+            FAIL_AND_GET_ERROR("Failed to map io_uring submission entries");
+        }
+
+        uint8_t *const base = r->rings;
+        r->sq_head = (unsigned *) (base + params.sq_off.head);
+        r->sq_tail = (unsigned *) (base + params.sq_off.tail);
+        r->sq_mask = *(unsigned *) (base + params.sq_off.ring_mask);
+        r->sq_entries = params.sq_entries;
+        r->sq_local_tail = *r->sq_tail;
+
+        // Ring slot i always refers to submission entry i.
+        unsigned *const array = (unsigned *) (base + params.sq_off.array);
+        for (unsigned i = 0; i < params.sq_entries; i++)
+            array[i] = i;
+
+        r->cq_head = (unsigned *) (base + params.cq_off.head);
+        r->cq_tail = (unsigned *) (base + params.cq_off.tail);
+        r->cq_mask = *(unsigned *) (base + params.cq_off.ring_mask);
+        r->cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+    }
+
+    /* check for the operations used */ {
+        size_t const probe_size = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op);
+        struct io_uring_probe *const probe = calloc(1, probe_size);
+        if (sys_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+            free(probe);
+            FAIL_AND_GET_ERROR("Failed to probe io_uring operations");
+        }
+
+        bool const supported = probe->last_op >= IORING_OP_RECVMSG
+            && (probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED)
+            && (probe->ops[IORING_OP_RECVMSG].flags & IO_URING_OP_SUPPORTED);
+        free(probe);
+
+        if (!supported)
+            FAIL("Kernel io_uring does not support sendmsg and recvmsg");
+    }
+
+    /* send slots */ {
+        r->slots = calloc(RING_ENTRIES, sizeof (SendSlot));
+        if (r->slots == NULL)
+            FAIL("Failed to allocate send slots");
+
+        for (uint32_t i = 0; i < RING_ENTRIES; i++)
+            r->slots[i].next_free = i + 1 < RING_ENTRIES ? i + 1 : NO_SLOT;
+        r->free_slot = 0;
+    }
+
+    // io_uring honours O_NONBLOCK on sockets and would complete with -EAGAIN instead of waiting for data.
+    int const flags = fcntl(s.socket, F_GETFL);
+    if (flags == -1 || fcntl(s.socket, F_SETFL, flags & ~O_NONBLOCK) == -1)
+        FAIL_AND_GET_ERROR("Failed to make socket blocking");
+
+    r->receive = receive;
+    if (!receive)
+        return true;
+
+    /* provided buffer ring */ {
+        r->buffer_size = sizeof (struct io_uring_recvmsg_out) + sizeof (struct sockaddr_in) + max_payload;
+        r->buffers = malloc(RECV_BUFFERS * r->buffer_size);
+        if (r->buffers == NULL)
+            FAIL("Failed to allocate receive buffers");
+
+        r->buf_ring_size = RECV_BUFFERS * sizeof (struct io_uring_buf);
+        r->buf_ring = mmap(NULL, r->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (r->buf_ring == MAP_FAILED) {
+            r->buf_ring = NULL;
+            FAIL_AND_GET_ERROR("Failed to map buffer ring");
+        }
+
+        struct io_uring_buf_reg reg = {
+            .ring_addr = (uint64_t) (uintptr_t) r->buf_ring,
+            .ring_entries = RECV_BUFFERS,
+            .bgid = BUFFER_GROUP,
+        };
+        if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+            FAIL_AND_GET_ERROR("Failed to register buffer ring");
+
+        r->buf_ring->tail = 0;
+        for (unsigned bid = 0; bid < RECV_BUFFERS; bid++)
+            recycle(r, bid);
+    }
+
+    r->recv_msg = (struct msghdr) {
+        .msg_namelen = sizeof (struct sockaddr_in),
+        .msg_controllen = 0,
+    };
+
+    // An unsupported multishot receive fails as soon as it is issued, so this catches kernels without it.
+    if (!arm_recv(r)) return false;
+    if (!enter(r, 0, -1)) return false;
+    if (!reap(r)) return false;
+
+    return true;
+}
+
+static void destroy(Uring *const r) {
+    if (r->fd >= 0) close(r->fd);
+    if (r->rings != NULL) munmap(r->rings, r->rings_size);
+    if (r->sqes != NULL) munmap(r->sqes, r->sqes_size);
+    if (r->buf_ring != NULL) munmap(r->buf_ring, r->buf_ring_size);
+    free(r->buffers);
+    free(r->slots);
+    free(r);
+}
+
+bool uring_init(Uring **const ring, Socket const s, bool const receive, int const max_payload, uring_received_t *const received, uring_sent_t *const sent, void *const context) {
+    if (socket_has_transport())
+        FAIL("io_uring needs operating system sockets");
+
+    Uring *const r = calloc(1, sizeof (Uring));
+    if (r == NULL)
+        FAIL("Failed to allocate io_uring");
+
+    r->fd = -1;
+    r->socket = s;
+    r->received = received;
+    r->sent = sent;
+    r->context = context;
+
+    if (!setup(r, s, receive, max_payload)) {
+        destroy(r);
+        // A failed setup leaves the socket as it was, so the poll backend can take over.
+        int const flags = fcntl(s.socket, F_GETFL);
+        if (flags != -1) fcntl(s.socket, F_SETFL, flags | O_NONBLOCK);
+        return false;
+    }
+
+    *ring = r;
+    return true;
+}
+
+bool uring_close(Uring *const r) {
+    // The kernel lets go of the socket and of sent buffers only once their operations complete,
+    // which a closed ring leaves to happen in the background. So they are waited for here,
+    // letting the caller reuse the buffers or bind the port again as soon as this returns.
+    r->receive = false; // not rearmed when reaping
+    if (r->recv_armed) {
+        struct io_uring_sqe *sqe = get_sqe(r);
+        if (sqe == NULL) {
+            if (!enter(r, 0, -1)) return false;
+            sqe = get_sqe(r);
+        }
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = RECV_TAG;
+            sqe->user_data = CANCEL_TAG;
+        }
+    }
+
+    for (int i = 0; i < CLOSE_WAITS && (r->recv_armed || r->sending > 0); i++) {
+        if (!enter(r, 1, CLOSE_WAIT) || !reap(r))
+            break;
+    }
+
+    destroy(r);
+    return true;
+}
+
+bool uring_send(Uring *const r, void const *const *const bufs, int const *const lens, int const count, Address const *const dest, void *const *const users) {
+    if (count < 1 || count > SOCKET_SEGMENTS_MAX)
+        FAIL("Invalid segment count");
+
+    while (r->free_slot == NO_SLOT) {
+        if (!enter(r, 1, -1)) return false;
+        if (!reap(r)) return false;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (sqe == NULL) {
+        if (!enter(r, 0, -1)) return false;
+        sqe = get_sqe(r);
+        if (sqe == NULL)
+            FAIL("Submission queue is full");
+    }
+
+    uint32_t const index = r->free_slot;
+    SendSlot *const slot = &r->slots[index];
+    r->free_slot = slot->next_free;
+
+    slot->addr = *dest;
+    slot->count = count;
+    slot->total = 0;
+    for (int i = 0; i < count; i++) {
+        slot->iov[i] = (struct iovec) {
+            .iov_base = (void *) bufs[i],
+            .iov_len = lens[i],
+        };
+        slot->users[i] = users[i];
+        slot->total += lens[i];
+    }
+    slot->msg = (struct msghdr) {
+        .msg_name = &slot->addr,
+        .msg_namelen = sizeof (struct sockaddr_in),
+        .msg_iov = slot->iov,
+        .msg_iovlen = count,
+    };
+
+    // Several datagrams go out as one UDP_SEGMENT send, see `socket_sendto_segments_inet`.
+    if (count > 1) {
+        memset(&slot->control, 0, sizeof slot->control);
+        slot->msg.msg_control = slot->control.buf;
+        slot->msg.msg_controllen = sizeof slot->control.buf;
+
+        struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&slot->msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof (uint16_t));
+        uint16_t const segment = lens[0];
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof segment);
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = r->socket.socket;
+    sqe->addr = (uint64_t) (uintptr_t) &slot->msg;
+    sqe->len = 1;
+    sqe->user_data = index;
+    r->sending++;
+
+    return true;
+}
+
+bool uring_submit(Uring *const r) {
+    if (!enter(r, 0, -1)) return false;
+    return reap(r);
+}
+
+bool uring_wait(Uring *const r, int const timeout) {
+    if (!enter(r, 1, timeout)) return false;
+    return reap(r);
+}
+#endif
+
+#ifdef _WIN64
+#include <string.h>
+
+#include "./uring.h"
+#include "../util.h"
+
+static char error_buffer[1024];
+
+#define FAIL(string) { \
+    if (sizeof string > 1024) \
+        EXIT_PRINT("Error message too long for buffer"); \
+    memcpy(error_buffer, string, sizeof string); \
+    return false; \
+}
+
+char *uring_get_error() {
+    return error_buffer;
+}
+
+bool uring_init(Uring **const ring, Socket const s, bool const receive, int const max_payload, uring_received_t *const received, uring_sent_t *const sent, void *const context) {
+    FAIL("io_uring is only available on Linux");
+}
+
+bool uring_close(Uring *const r) {
+    FAIL("io_uring is only available on Linux");
+}
+
+bool uring_send(Uring *const r, void const *const *const bufs, int const *const lens, int const count, Address const *const dest, void *const *const users) {
+    FAIL("io_uring is only available on Linux");
+}
+
+bool uring_submit(Uring *const r) {
+    FAIL("io_uring is only available on Linux");
+}
+
+bool uring_wait(Uring *const r, int const timeout) {
+    FAIL("io_uring is only available on Linux");
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "./sockets.h"
+
+// An io_uring instance bound to one UDP socket.
+// Inbound datagrams arrive through a multishot recvmsg into a ring of provided buffers,
+// outbound datagrams are queued as sendmsg operations and submitted in batches.
+// An instance must only be used by one thread at a time.
+typedef struct Uring Uring;
+
+// Called for every received datagram. `data` is only valid until the callback returns.
+typedef void uring_received_t(void *context, void *data, int length, Address const *source);
+
+// Called once the kernel is done with a buffer passed to `uring_send`, once per buffer.
+typedef void uring_sent_t(void *context, void *user);
+
+char *uring_get_error(void);
+
+// Fails if the kernel lacks io_uring or any of the features used (provided buffer rings, multishot recvmsg).
+// With `receive` set, `received` is called for inbound datagrams from `uring_wait`.
+bool uring_init(Uring **ring, Socket socket, bool receive, int max_payload, uring_received_t *received, uring_sent_t *sent, void *context);
+// Cancels the armed receive and waits a little for it and for sends in flight, calling `received` and `sent` for them.
+bool uring_close(Uring *ring);
+
+// Queues `count` datagrams to one destination, laid out as for `socket_sendto_segments_inet`.
+// Each of `buffers` must stay valid until `sent` is called with the matching entry of `users`.
+// Only submits when the submission queue is full, call `uring_submit` or `uring_wait` after a batch.
+bool uring_send(Uring *ring, void const *const *buffers, int const *lengths, int count, Address const *destination, void *const *users);
+
+// Submits queued operations and handles completions without blocking.
+bool uring_submit(Uring *ring);
+
+// This function blocks execution.
+// Submits queued operations and waits until at least one completion arrives or the timeout passes.
+bool uring_wait(Uring *ring, int timeout_millis);
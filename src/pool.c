@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN64
+#include <malloc.h>
+#endif
+
+#include "./pool.h"
+
+static void *allocate_aligned(size_t const size) {
+    size_t const rounded = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+#ifdef _WIN64
+    return _aligned_malloc(rounded, CACHE_LINE);
+#else
+    return aligned_alloc(CACHE_LINE, rounded);
+#endif
+}
+
+static void free_aligned(void *const memory) {
+#ifdef _WIN64
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+bool pool_init(PacketPool *const pool, uint32_t const count, int const capacity) {
+    if (count == 0 || count == UINT32_MAX || capacity <= 0)
+        return false;
+
+    size_t const stride = ((size_t) capacity + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+    pool->count = count;
+    pool->capacity = capacity;
+    pool->buffers = allocate_aligned(count * sizeof (PacketBuffer));
+    pool->storage = allocate_aligned(count * stride);
+
+    if (pool->buffers == NULL || pool->storage == NULL) {
+        free_aligned(pool->buffers);
+        free_aligned(pool->storage);
+        return false;
+    }
+
+    // Touch every page now so the packet path never faults them in.
+    memset(pool->storage, 0, count * stride);
+
+    for (uint32_t i = 0; i < count; i++) {
+        PacketBuffer *const b = &pool->buffers[i];
+        b->addr = (Address) {0};
+        b->len = 0;
+        b->index = i;
+        b->data = pool->storage + i * stride;
+        atomic_init(&b->next, i + 1 < count ? i + 2 : 0);
+    }
+    atomic_init(&pool->head, 1);
+
+    return true;
+}
+
+void pool_close(PacketPool *const pool) {
+    free_aligned(pool->buffers);
+    free_aligned(pool->storage);
+    pool->buffers = NULL;
+    pool->storage = NULL;
+}
+
+PacketBuffer *pool_acquire(PacketPool *const pool) {
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    while (true) {
+        uint32_t const index = (uint32_t) head;
+        if (index == 0) return NULL;
+
+        PacketBuffer *const b = &pool->buffers[index - 1];
+        uint32_t const next = atomic_load_explicit(&b->next, memory_order_relaxed);
+        uint64_t const new_head = ((head >> 32) + 1) << 32 | next;
+
+        if (atomic_compare_exchange_weak_explicit(&pool->head, &head, new_head, memory_order_acquire, memory_order_acquire)) {
+            b->len = 0;
+            return b;
+        }
+    }
+}
+
+void pool_release(PacketPool *const pool, PacketBuffer *const b) {
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    while (true) {
+        atomic_store_explicit(&b->next, (uint32_t) head, memory_order_relaxed);
+        uint64_t const new_head = ((head >> 32) + 1) << 32 | (b->index + 1);
+
+        if (atomic_compare_exchange_weak_explicit(&pool->head, &head, new_head, memory_order_release, memory_order_relaxed))
+            return;
+    }
+}
+
+bool queue_init(PacketQueue *const q, size_t const count) {
+    size_t size = 1;
+    while (size < count) size <<= 1;
+
+    q->cells = allocate_aligned(size * sizeof (QueueCell));
+    if (q->cells == NULL)
+        return false;
+
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].buffer = NULL;
+    }
+    q->mask = size - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+
+    return true;
+}
+
+void queue_close(PacketQueue *const q) {
+    free_aligned(q->cells);
+    q->cells = NULL;
+}
+
+bool queue_push(PacketQueue *const q, PacketBuffer *const b) {
+    QueueCell *cell;
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        size_t const seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t const diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->buffer = b;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+PacketBuffer *queue_pop(PacketQueue *const q) {
+    QueueCell *cell;
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        size_t const seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t const diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            return NULL;
+        }
+        else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    PacketBuffer *const b = cell->buffer;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return b;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "./os/sockets.h"
+
+#define CACHE_LINE (64)
+
+// A packet buffer from a `PacketPool`.
+// `data` is cache-line aligned and holds `capacity` bytes of the owning pool,
+// so packets can be received into it and parsed in place.
+typedef struct {
+    alignas(CACHE_LINE) Address addr; // source after receiving, destination before sending
+    int len;                          // bytes of `data` in use
+    _Atomic uint32_t next;            // free list link (index + 1, or 0), only used while free
+    uint32_t index;
+    uint8_t *data;
+} PacketBuffer;
+
+// Fixed-capacity pool of packet buffers, allocated once up front.
+// Acquiring and releasing are lock-free (a Treiber stack with an ABA tag), so any thread may do either.
+typedef struct {
+    alignas(CACHE_LINE) _Atomic uint64_t head; // (aba tag << 32) | (index + 1), index 0 means empty
+    alignas(CACHE_LINE) uint32_t count;
+    int capacity; // bytes per buffer
+    PacketBuffer *buffers;
+    uint8_t *storage;
+} PacketPool;
+
+bool pool_init(PacketPool *pool, uint32_t count, int capacity);
+void pool_close(PacketPool *pool);
+
+// Returns NULL when every buffer is in use.
+// A buffer has one owner at a time, whoever acquired it or was handed it through a queue.
+PacketBuffer *pool_acquire(PacketPool *pool);
+
+// Returns a buffer to the pool, called once by its owner.
+void pool_release(PacketPool *pool, PacketBuffer *buffer);
+
+typedef struct {
+    _Atomic size_t seq;
+    PacketBuffer *buffer;
+} QueueCell;
+
+// Bounded lock-free multi-producer multi-consumer queue of buffer references.
+// Buffers are handed over by reference, never copied.
+typedef struct {
+    QueueCell *cells;
+    size_t mask;
+    alignas(CACHE_LINE) _Atomic size_t tail; // next position to push
+    alignas(CACHE_LINE) _Atomic size_t head; // next position to pop
+} PacketQueue;
+
+// `count` is rounded up to a power of two.
+bool queue_init(PacketQueue *queue, size_t count);
+void queue_close(PacketQueue *queue);
+
+// Returns false if the queue is full.
+bool queue_push(PacketQueue *queue, PacketBuffer *buffer);
+
+// Returns NULL if the queue is empty.
+PacketBuffer *queue_pop(PacketQueue *queue);
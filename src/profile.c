@@ -0,0 +1,140 @@
+#include "./profile.h"
+
+#ifdef PROFILING
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "raylib.h"
+
+#include "./os/threads.h"
+
+#define GRAPH_SCALE (4.0f)   // pixels per millisecond
+#define GRAPH_BUDGET (16.7f) // milliseconds, the line drawn across the graph
+
+typedef struct {
+    uint64_t total;                // nanoseconds from this frame's start to the next one's
+    uint64_t zones[PROFILE_ZONES]; // nanoseconds
+} FrameProfile;
+
+static char const *const zone_names[PROFILE_ZONES] = {
+    [PROFILE_UPDATE] = "update",
+    [PROFILE_NET]    = "net",
+    [PROFILE_DRAW]   = "draw",
+    [PROFILE_RELOAD] = "reload",
+};
+
+static Color const zone_colors[PROFILE_ZONES] = {
+    [PROFILE_UPDATE] = {0, 121, 241, 255},
+    [PROFILE_NET]    = {255, 161, 0, 255},
+    [PROFILE_DRAW]   = {0, 228, 48, 255},
+    [PROFILE_RELOAD] = {200, 122, 255, 255},
+};
+
+static FrameProfile frames[PROFILE_FRAMES];
+static uint32_t frame_count = 0; // frames finished, `frames[frame_count % PROFILE_FRAMES]` is the current one
+static uint64_t frame_start = 0;
+static uint64_t zone_start[PROFILE_ZONES];
+static bool visible = false;
+
+void profile_frame(void) {
+    uint64_t const now = time_get_precise_ns();
+    if (frame_start != 0) {
+        frames[frame_count % PROFILE_FRAMES].total = now - frame_start;
+        frame_count++;
+    }
+    frames[frame_count % PROFILE_FRAMES] = (FrameProfile) {0};
+    frame_start = now;
+}
+
+void profile_begin(ProfileZone const zone) {
+    zone_start[zone] = time_get_precise_ns();
+}
+
+void profile_end(ProfileZone const zone) {
+    frames[frame_count % PROFILE_FRAMES].zones[zone] += time_get_precise_ns() - zone_start[zone];
+}
+
+static int compare_u64(void const *const a, void const *const b) {
+    uint64_t const x = *(uint64_t const *) a;
+    uint64_t const y = *(uint64_t const *) b;
+    return (x > y) - (x < y);
+}
+
+static float ms(uint64_t const ns) {
+    return ns / 1e6f;
+}
+
+void profile_overlay(void) {
+    if (IsKeyPressed(KEY_F3)) visible = !visible;
+    if (!visible) return;
+
+    // Only finished frames, oldest first.
+    uint32_t const count = frame_count < PROFILE_FRAMES ? frame_count : PROFILE_FRAMES;
+    uint32_t const first = frame_count - count;
+
+    int const x = 10;
+    int const y = 10;
+    int const graph_height = (int) (GRAPH_BUDGET * 2 * GRAPH_SCALE);
+    int const width = PROFILE_FRAMES * 2 + 20;
+    int const height = graph_height + 30 + (PROFILE_ZONES + 1) * 20;
+
+    DrawRectangle(x, y, width, height, Fade(BLACK, 0.75f));
+
+    /* draw graph, one stacked bar per frame with the time outside zones in gray */ {
+        int const top = y + 10;
+        int const base = top + graph_height;
+        for (uint32_t i = 0; i < count; i++) {
+            FrameProfile const *const f = &frames[(first + i) % PROFILE_FRAMES];
+            int const bar_x = x + 10 + i * 2;
+            int bar_y = base;
+
+            uint64_t zoned = 0;
+            for (int z = 0; z < PROFILE_ZONES; z++) {
+                int h = (int) (ms(f->zones[z]) * GRAPH_SCALE + 0.5f);
+                if (h > bar_y - top) h = bar_y - top;
+                bar_y -= h;
+                DrawRectangle(bar_x, bar_y, 2, h, zone_colors[z]);
+                zoned += f->zones[z];
+            }
+
+            int rest = f->total > zoned ? (int) (ms(f->total - zoned) * GRAPH_SCALE + 0.5f) : 0;
+            if (rest > bar_y - top) rest = bar_y - top;
+            if (rest > 0) DrawRectangle(bar_x, bar_y - rest, 2, rest, GRAY);
+        }
+
+        int const budget_y = base - (int) (GRAPH_BUDGET * GRAPH_SCALE);
+        DrawLine(x + 10, budget_y, x + 10 + PROFILE_FRAMES * 2, budget_y, RED);
+    }
+
+    /* draw frame time percentiles and average zone times */ {
+        char str[128];
+        int line_y = y + 20 + graph_height;
+
+        if (count == 0) return;
+
+        uint64_t sorted[PROFILE_FRAMES];
+        uint64_t zone_totals[PROFILE_ZONES] = {0};
+        for (uint32_t i = 0; i < count; i++) {
+            FrameProfile const *const f = &frames[(first + i) % PROFILE_FRAMES];
+            sorted[i] = f->total;
+            for (int z = 0; z < PROFILE_ZONES; z++)
+                zone_totals[z] += f->zones[z];
+        }
+        qsort(sorted, count, sizeof *sorted, compare_u64);
+
+        snprintf(
+            str, sizeof str, "frame ms  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f",
+            ms(sorted[count / 2]), ms(sorted[count * 95 / 100]), ms(sorted[count * 99 / 100]), ms(sorted[count - 1])
+        );
+        DrawText(str, x + 10, line_y, 20, WHITE);
+
+        for (int z = 0; z < PROFILE_ZONES; z++) {
+            line_y += 20;
+            snprintf(str, sizeof str, "%-6s avg %.3f ms", zone_names[z], ms(zone_totals[z] / count));
+            DrawText(str, x + 10, line_y, 20, zone_colors[z]);
+        }
+    }
+}
+#endif // PROFILING
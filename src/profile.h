@@ -0,0 +1,42 @@
+#pragma once
+
+// Frame profiler.
+// Zones time parts of a frame, their totals per frame are kept for the last `PROFILE_FRAMES` frames
+// and shown with frame time percentiles in an overlay toggled with F3.
+// Only built with DEBUG or PROFILE defined, otherwise every macro below compiles to nothing.
+// Must only be used from the thread running the game loop.
+
+#if defined(DEBUG) || defined(PROFILE)
+#define PROFILING
+#endif
+
+#define PROFILE_FRAMES (256)
+
+typedef enum {
+    PROFILE_UPDATE,
+    PROFILE_NET,    // taking what the network threads handed over
+    PROFILE_DRAW,
+    PROFILE_RELOAD, // checking for and doing hot reloads
+    PROFILE_ZONES,
+} ProfileZone;
+
+#ifdef PROFILING
+// Ends the previous frame and starts the next one, call it first thing every frame.
+void profile_frame(void);
+
+void profile_begin(ProfileZone zone);
+void profile_end(ProfileZone zone);
+
+// Draws the overlay if it is toggled on, call it between BeginDrawing and EndDrawing.
+void profile_overlay(void);
+
+#define PROFILE_FRAME() profile_frame()
+#define PROFILE_BEGIN(zone) profile_begin(zone)
+#define PROFILE_END(zone) profile_end(zone)
+#define PROFILE_OVERLAY() profile_overlay()
+#else
+#define PROFILE_FRAME() ((void) 0)
+#define PROFILE_BEGIN(zone) ((void) 0)
+#define PROFILE_END(zone) ((void) 0)
+#define PROFILE_OVERLAY() ((void) 0)
+#endif
@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "./replay.h"
+
+#define REPLAY_MAGIC "BBREPLAY"
+#define REPLAY_VERSION (1)
+#define REPLAY_FILE_SIZE ((size_t) 16 << 30) // bytes, sparse, so only the records written take space
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint16_t max_players;
+    uint16_t tick_interval;  // milliseconds
+    uint32_t keyframe_ticks;
+    uint32_t keyframes;      // entries in the index, only valid once `index_offset` is set
+    uint64_t records_end;    // updated after every record, so a file whose recording never stopped can still be read
+    uint64_t index_offset;   // 0 until recording stops
+    uint32_t ticks;
+    uint32_t duration;       // milliseconds
+} ReplayHeader;
+
+typedef enum : uint16_t {
+    RECORD_TICK,     // followed by `count` `ReplayChange`s
+    RECORD_KEYFRAME, // followed by `len` `Player`s
+} RecordKind;
+
+typedef struct {
+    uint32_t tick;
+    uint32_t time;  // milliseconds since the first tick
+    RecordKind kind;
+    uint16_t len;   // players after this tick
+    uint16_t count; // changes that follow
+    uint16_t reserved;
+} ReplayRecord;
+
+// A player slot that was added or moved. Slots past the record's `len` are gone.
+typedef struct {
+    uint32_t slot;
+    Player player;
+} ReplayChange;
+
+static ReplayHeader *header(MappedFile const *const file) {
+    return (ReplayHeader *) file->data;
+}
+
+static size_t record_size(ReplayRecord const *const record) {
+    if (record->kind == RECORD_KEYFRAME)
+        return sizeof (ReplayRecord) + record->len * sizeof (Player);
+    return sizeof (ReplayRecord) + record->count * sizeof (ReplayChange);
+}
+
+static void writer_free(ReplayWriter *const writer) {
+    free(writer->last);
+    free(writer->keyframes);
+    writer->last = NULL;
+    writer->keyframes = NULL;
+}
+
+bool replay_record_start(ReplayWriter *const writer, char const *const path, uint16_t const max_players, uint16_t const tick_interval) {
+    writer->last = malloc(max_players * sizeof (Player));
+    writer->keyframes = malloc(REPLAY_MAX_KEYFRAMES * sizeof (ReplayKeyframe));
+    if (writer->last == NULL || writer->keyframes == NULL) {
+        printf("Failed to allocate replay buffers\n");
+        writer_free(writer);
+        return false;
+    }
+
+    if (!file_map_new(&writer->file, path, REPLAY_FILE_SIZE)) {
+        printf("Failed to create replay file %s: %s\n", path, files_get_error());
+        writer_free(writer);
+        return false;
+    }
+
+    ReplayHeader *const h = header(&writer->file);
+    *h = (ReplayHeader) {
+        .version = REPLAY_VERSION,
+        .max_players = max_players,
+        .tick_interval = tick_interval,
+        .keyframe_ticks = REPLAY_KEYFRAME_TICKS,
+        .records_end = sizeof (ReplayHeader),
+    };
+    memcpy(h->magic, REPLAY_MAGIC, sizeof h->magic);
+
+    writer->end = sizeof (ReplayHeader);
+    writer->tick = 0;
+    writer->start = 0;
+    writer->max_players = max_players;
+    writer->last_len = 0;
+    writer->keyframes_len = 0;
+
+    printf("recording replay to %s\n", path);
+    return true;
+}
+
+bool replay_record_tick(ReplayWriter *const writer, long const now, Player const *const players, uint16_t const len) {
+    if (writer->last == NULL) return false;
+    if (len > writer->max_players) return false;
+
+    if (writer->tick == 0) writer->start = now;
+    uint32_t const time = (uint32_t) (now - writer->start);
+
+    bool const keyframe = writer->tick % REPLAY_KEYFRAME_TICKS == 0;
+
+    // Room for the worst case, every player changed.
+    if (writer->end + sizeof (ReplayRecord) + len * sizeof (ReplayChange) > writer->file.size) {
+        printf("Replay file is full, stopping the recording\n");
+        replay_record_stop(writer);
+        return false;
+    }
+    if (keyframe && writer->keyframes_len == REPLAY_MAX_KEYFRAMES) {
+        printf("Replay index is full, stopping the recording\n");
+        replay_record_stop(writer);
+        return false;
+    }
+
+    char *const at = (char *) writer->file.data + writer->end;
+    ReplayRecord *const record = (ReplayRecord *) at;
+    *record = (ReplayRecord) {.tick = writer->tick, .time = time, .len = len};
+
+    if (keyframe) {
+        record->kind = RECORD_KEYFRAME;
+        memcpy(at + sizeof (ReplayRecord), players, len * sizeof (Player));
+        writer->keyframes[writer->keyframes_len++] = (ReplayKeyframe) {.tick = writer->tick, .offset = writer->end};
+    } else {
+        record->kind = RECORD_TICK;
+        ReplayChange *const changes = (ReplayChange *) (at + sizeof (ReplayRecord));
+        uint16_t count = 0;
+        for (uint16_t i = 0; i < len; i++) {
+            if (i < writer->last_len && memcmp(&players[i], &writer->last[i], sizeof (Player)) == 0) continue;
+            changes[count++] = (ReplayChange) {.slot = i, .player = players[i]};
+        }
+        record->count = count;
+    }
+
+    ReplayHeader *const h = header(&writer->file);
+
+    // Ticks where nothing changed take no space.
+    if (keyframe || record->count > 0 || len != writer->last_len) {
+        writer->end += record_size(record);
+        h->records_end = writer->end;
+    }
+
+    memcpy(writer->last, players, len * sizeof (Player));
+    writer->last_len = len;
+    writer->tick++;
+
+    h->ticks = writer->tick;
+    h->duration = time;
+    return true;
+}
+
+void replay_record_stop(ReplayWriter *const writer) {
+    if (writer->last == NULL) return;
+
+    // The index goes after the records, aligned for its 64-bit offsets, and the file is cut down to fit.
+    size_t const index_offset = (writer->end + 7) & ~(size_t) 7;
+    size_t const size = index_offset + writer->keyframes_len * sizeof (ReplayKeyframe);
+
+    if (!file_map_resize(&writer->file, size)) {
+        printf("Failed to write replay index: %s\n", files_get_error());
+    } else {
+        memcpy((char *) writer->file.data + index_offset, writer->keyframes, writer->keyframes_len * sizeof (ReplayKeyframe));
+
+        ReplayHeader *const h = header(&writer->file);
+        h->keyframes = writer->keyframes_len;
+        h->index_offset = index_offset;
+
+        if (!file_map_flush(&writer->file))
+            printf("Failed to flush replay file: %s\n", files_get_error());
+
+        printf("replay recorded (%u ticks, %zu bytes)\n", (unsigned) writer->tick, size);
+    }
+
+    if (!file_unmap(&writer->file))
+        printf("Failed to close replay file: %s\n", files_get_error());
+
+    writer_free(writer);
+}
+
+// Checks that a record starting at `offset` lies within the records and describes no more than `max_players` players.
+static ReplayRecord const *record_at(ReplayReader const *const reader, size_t const offset) {
+    if (offset + sizeof (ReplayRecord) > reader->records_end) return NULL;
+
+    ReplayRecord const *const record = (ReplayRecord const *) ((char const *) reader->file.data + offset);
+    if (record->len > reader->max_players || record->count > reader->max_players) return NULL;
+    if (record->kind != RECORD_TICK && record->kind != RECORD_KEYFRAME) return NULL;
+    if (offset + record_size(record) > reader->records_end) return NULL;
+    return record;
+}
+
+// Rebuilds the index of a file whose recording never stopped. Returns false if it can't be allocated.
+static bool scan_keyframes(ReplayReader *const reader) {
+    uint32_t capacity = 64;
+    reader->scanned = malloc(capacity * sizeof (ReplayKeyframe));
+    reader->keyframes_len = 0;
+    if (reader->scanned == NULL) return false;
+
+    size_t offset = sizeof (ReplayHeader);
+    ReplayRecord const *record;
+    while ((record = record_at(reader, offset)) != NULL) {
+        if (record->kind == RECORD_KEYFRAME) {
+            if (reader->keyframes_len == capacity) {
+                capacity *= 2;
+                ReplayKeyframe *const grown = realloc(reader->scanned, capacity * sizeof (ReplayKeyframe));
+                if (grown == NULL) return false;
+                reader->scanned = grown;
+            }
+            reader->scanned[reader->keyframes_len++] = (ReplayKeyframe) {.tick = record->tick, .offset = offset};
+        }
+        offset += record_size(record);
+    }
+
+    reader->records_end = offset;
+    reader->keyframes = reader->scanned;
+    return true;
+}
+
+bool replay_open(ReplayReader *const reader, char const *const path) {
+    if (!file_map_existing(&reader->file, path)) {
+        printf("Failed to open replay file %s: %s\n", path, files_get_error());
+        return false;
+    }
+
+    ReplayHeader const *const h = header(&reader->file);
+    char const *problem = NULL;
+    if (reader->file.size < sizeof (ReplayHeader) || memcmp(h->magic, REPLAY_MAGIC, sizeof h->magic) != 0)
+        problem = "not a replay";
+    else if (h->version != REPLAY_VERSION)
+        problem = "unsupported version";
+    else if (h->max_players == 0 || h->records_end < sizeof (ReplayHeader) || h->records_end > reader->file.size)
+        problem = "corrupt header";
+    else if (h->index_offset != 0 && (h->index_offset % 8 != 0 || h->index_offset < h->records_end || h->index_offset + h->keyframes * sizeof (ReplayKeyframe) > reader->file.size))
+        problem = "corrupt index";
+
+    if (problem != NULL) {
+        printf("Failed to open replay file %s: %s\n", path, problem);
+        file_unmap(&reader->file);
+        return false;
+    }
+
+    reader->records_end = h->records_end;
+    reader->ticks = h->ticks;
+    reader->duration = h->duration;
+    reader->tick_interval = h->tick_interval;
+    reader->max_players = h->max_players;
+    reader->scanned = NULL;
+
+    if (h->index_offset != 0) {
+        reader->keyframes = (ReplayKeyframe const *) ((char const *) reader->file.data + h->index_offset);
+        reader->keyframes_len = h->keyframes;
+    } else {
+        printf("replay %s was not closed, rebuilding its index\n", path);
+        if (!scan_keyframes(reader)) {
+            printf("Failed to open replay file %s: out of memory for its index\n", path);
+            replay_close(reader);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void replay_close(ReplayReader *const reader) {
+    free(reader->scanned);
+    if (!file_unmap(&reader->file))
+        printf("Failed to close replay file: %s\n", files_get_error());
+}
+
+bool replay_seek(ReplayReader const *const reader, uint32_t const tick, Player *const players, uint16_t *const len, uint32_t *const time) {
+    if (tick >= reader->ticks) return false;
+
+    // The last keyframe at or before `tick`.
+    uint32_t lo = 0;
+    uint32_t hi = reader->keyframes_len;
+    while (lo < hi) {
+        uint32_t const mid = lo + (hi - lo) / 2;
+        if (reader->keyframes[mid].tick <= tick) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return false;
+
+    *len = 0;
+    *time = 0;
+    uint32_t last_tick = 0;
+
+    size_t offset = reader->keyframes[lo - 1].offset;
+    ReplayRecord const *record;
+    while ((record = record_at(reader, offset)) != NULL && record->tick <= tick) {
+        char const *const payload = (char const *) record + sizeof (ReplayRecord);
+
+        if (record->kind == RECORD_KEYFRAME) {
+            memcpy(players, payload, record->len * sizeof (Player));
+        } else {
+            ReplayChange const *const changes = (ReplayChange const *) payload;
+            for (uint16_t i = 0; i < record->count; i++) {
+                if (changes[i].slot < reader->max_players)
+                    players[changes[i].slot] = changes[i].player;
+            }
+        }
+
+        *len = record->len;
+        *time = record->time;
+        last_tick = record->tick;
+        offset += record_size(record);
+    }
+
+    // Ticks where nothing changed have no record.
+    *time += (tick - last_tick) * reader->tick_interval;
+    return true;
+}
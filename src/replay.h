@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "./player.h"
+#include "./os/files.h"
+
+// Match replays.
+// The server appends the players that changed every tick to a memory-mapped file, and every `REPLAY_KEYFRAME_TICKS`
+// ticks a keyframe with all of them. Recording a tick only copies into the mapping: the file is created sparse and
+// large enough for a long match, and the keyframe index is allocated up front, so nothing is resized or allocated
+// during a match. A match too long for either stops being recorded.
+// The players at any tick are rebuilt from the keyframe before it, found by binary search over an index written
+// when recording stops, or rebuilt from the records when opening a file whose recording never stopped.
+// Files are in the byte order of the machine that recorded them.
+
+#define REPLAY_KEYFRAME_TICKS (256)
+#define REPLAY_MAX_KEYFRAMES (65536) // so at most 16M ticks are recorded, almost a day at the server's tick rate
+
+typedef struct {
+    uint32_t tick;
+    uint32_t reserved;
+    uint64_t offset; // of the keyframe's record
+} ReplayKeyframe;
+
+typedef struct {
+    MappedFile file;
+    size_t end;           // bytes of records written, including the header
+    uint32_t tick;        // of the next record
+    long start;           // milliseconds, the time of the first tick
+    uint16_t max_players;
+    Player *last;         // players as of the last tick recorded, `max_players` entries, NULL while not recording
+    uint16_t last_len;
+    ReplayKeyframe *keyframes; // the index, `REPLAY_MAX_KEYFRAMES` entries, written to the file when recording stops
+    uint32_t keyframes_len;
+} ReplayWriter;
+
+// Starts recording to `path`, replacing the file. `tick_interval` is the milliseconds between ticks, for playback.
+// Prints why and returns false if the file can't be created or the index allocated.
+bool replay_record_start(ReplayWriter *writer, char const *path, uint16_t max_players, uint16_t tick_interval);
+
+// Records the players as of one tick, `now` in milliseconds.
+// Returns false if the file or the index is full, the recording is then stopped.
+bool replay_record_tick(ReplayWriter *writer, long now, Player const *players, uint16_t len);
+
+// Writes the index and closes the file.
+void replay_record_stop(ReplayWriter *writer);
+
+typedef struct {
+    MappedFile file;
+    ReplayKeyframe const *keyframes; // in the file, or `scanned`
+    ReplayKeyframe *scanned;         // the index rebuilt from the records if the file has none, otherwise NULL
+    uint32_t keyframes_len;
+    size_t records_end;
+    uint32_t ticks;         // recorded, ticks go from 0 to `ticks - 1`
+    uint32_t duration;      // milliseconds from the first to the last tick
+    uint16_t tick_interval; // milliseconds
+    uint16_t max_players;
+} ReplayReader;
+
+// Maps the replay at `path`. Prints why and returns false if it can't be read.
+bool replay_open(ReplayReader *reader, char const *path);
+void replay_close(ReplayReader *reader);
+
+// Rebuilds the players as of `tick` into `players`, which must have room for `max_players`.
+// `*time` is set to the milliseconds since the first tick. Returns false if `tick` is past the end.
+bool replay_seek(ReplayReader const *reader, uint32_t tick, Player *players, uint16_t *len, uint32_t *time);
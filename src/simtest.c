@@ -0,0 +1,141 @@
+// Whole sessions over the simulated network, faster than real time.
+// A server and a few clients play for a while over a lossy, jittery link, then the test checks that
+// everyone ended up with the same players, and that a second run with the same seed went exactly the same way.
+//
+// Usage: simtest [seed]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "./net.h"
+#include "./lockstep.h"
+#include "./entities.h"
+#include "./util.h"
+#include "./os/simnet.h"
+#include "./os/threads.h"
+
+#define SIM_PORT (1234)
+#define SIM_CLIENTS (3)
+#define SIM_MAX_PLAYERS (8)
+#define SIM_STEP (16)          // milliseconds of virtual time between moves
+#define SIM_MOVING_STEPS (600) // the clients move for this many steps
+#define SIM_SETTLE_STEPS (250) // then stand still this long, so every update gets through despite the loss
+#define DEFAULT_SEED (1)
+
+// What a session ended with, compared between two runs with the same seed.
+typedef struct {
+    SimStats stats;
+    uint16_t server_len;
+    Player server_players[SIM_MAX_PLAYERS];
+    Player own[SIM_CLIENTS];           // each client's own player
+    uint32_t views[SIM_CLIENTS];       // checksum of each client's entity table, in its order
+    uint32_t view_lens[SIM_CLIENTS];
+} SimResult;
+
+// Returns the player with this id, or NULL.
+static Player const *find_player(Player const *const players, uint16_t const len, uint32_t const id) {
+    for (uint16_t i = 0; i < len; i++)
+        if (players[i].id == id) return &players[i];
+    return NULL;
+}
+
+static void run_session(uint64_t const seed, SimResult *const result) {
+    SimLink const link = {
+        .seed = seed,
+        .latency = 40,
+        .jitter = 15,
+        .loss = 0.05f,
+        .duplicate = 0.01f,
+        .reorder = 0.02f,
+    };
+    if (!simnet_start(&link))
+        EXIT_PRINT("Failed to start the simulated network: %s", simnet_get_error());
+
+    Player players[SIM_MAX_PLAYERS];
+    _Atomic uint16_t len = 0;
+    Server *const server = net_server_spawn(players, &len, SIM_MAX_PLAYERS, SIM_PORT);
+
+    Player own[SIM_CLIENTS] = {0};
+    Client *clients[SIM_CLIENTS];
+    for (int i = 0; i < SIM_CLIENTS; i++)
+        clients[i] = net_client_spawn(&own[i], SIM_PORT);
+
+    // Every client walks its own way, at its own pace.
+    for (int step = 0; step < SIM_MOVING_STEPS + SIM_SETTLE_STEPS; step++) {
+        thread_sleep_ms(SIM_STEP);
+        if (step >= SIM_MOVING_STEPS) continue;
+
+        for (int i = 0; i < SIM_CLIENTS; i++) {
+            if (step % (i + 2) != 0) continue;
+            own[i].pos.x += i + 1;
+            own[i].pos.y += SIM_CLIENTS - i;
+        }
+    }
+
+    memset(result, 0, sizeof *result); // padding too, results are compared with memcmp
+    result->server_len = len;
+    memcpy(result->server_players, players, len * sizeof (Player));
+    memcpy(result->own, own, sizeof own);
+
+    for (int i = 0; i < SIM_CLIENTS; i++) {
+        EntityTable *const table = net_client_entities(clients[i]);
+        EntityStore const *const view = entities_acquire(table);
+        result->view_lens[i] = view->len;
+        result->views[i] = lockstep_checksum(view->players, (uint16_t) view->len);
+
+        // Every client sees every player where the server has it.
+        for (uint16_t j = 0; j < result->server_len; j++) {
+            Player const *const expected = &result->server_players[j];
+            int32_t const at = entities_find(view, expected->id);
+            if (at < 0)
+                EXIT_PRINT("Client %d never heard of player %u", i, expected->id);
+            if (view->players[at].pos.x != expected->pos.x || view->players[at].pos.y != expected->pos.y)
+                EXIT_PRINT("Client %d has player %u at (%u, %u), the server at (%u, %u)", i, expected->id, view->players[at].pos.x, view->players[at].pos.y, expected->pos.x, expected->pos.y);
+        }
+        if (view->len != result->server_len)
+            EXIT_PRINT("Client %d sees %u players, the server has %u", i, view->len, result->server_len);
+        entities_release(table);
+    }
+
+    for (int i = 0; i < SIM_CLIENTS; i++)
+        net_client_close(clients[i]);
+    net_server_close(server);
+
+    simnet_get_stats(&result->stats);
+    if (!simnet_stop())
+        EXIT_PRINT("Failed to stop the simulated network: %s", simnet_get_error());
+
+    // The server has every client's player where the client left it.
+    if (result->server_len != SIM_CLIENTS)
+        EXIT_PRINT("The server has %u players, %d clients joined", result->server_len, SIM_CLIENTS);
+    for (int i = 0; i < SIM_CLIENTS; i++) {
+        Player const *const player = find_player(result->server_players, result->server_len, own[i].id);
+        if (player == NULL)
+            EXIT_PRINT("The server has no player %u", own[i].id);
+        if (player->pos.x != own[i].pos.x || player->pos.y != own[i].pos.y)
+            EXIT_PRINT("The server has player %u at (%u, %u), its client at (%u, %u)", own[i].id, player->pos.x, player->pos.y, own[i].pos.x, own[i].pos.y);
+    }
+}
+
+int main(int const argc, char **const argv) {
+    uint64_t const seed = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_SEED;
+
+    // Line buffered, so the session's messages and the results appear in order.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    SimResult first, second;
+    run_session(seed, &first);
+    run_session(seed, &second);
+
+    if (memcmp(&first, &second, sizeof first) != 0)
+        EXIT_PRINT("Two sessions with seed %llu went differently", (unsigned long long) seed);
+
+    printf(
+        "simtest: seed %llu converged and replayed identically, %u players, %ld datagrams sent, %ld delivered, %ld lost, %ld duplicated\n",
+        (unsigned long long) seed, first.server_len,
+        first.stats.sent, first.stats.delivered, first.stats.lost, first.stats.duplicated
+    );
+    return 0;
+}
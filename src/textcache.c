@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "./textcache.h"
+
+#define TEXT_CACHE_WAYS (4) // slots probed per key
+
+bool text_cache_init(TextCache *const cache) {
+    cache->entries = calloc(TEXT_CACHE_SLOTS, sizeof (TextEntry));
+    cache->label_count = 0;
+    return cache->entries != NULL;
+}
+
+void text_cache_close(TextCache *const cache) {
+    for (int i = 0; i < cache->label_count; i++)
+        UnloadRenderTexture(cache->labels[i].target);
+    cache->label_count = 0;
+
+    free(cache->entries);
+    cache->entries = NULL;
+}
+
+TextEntry *text_cache_find(TextCache *const cache, uint64_t const key, uint64_t const inputs, int const font_size, bool *const fresh) {
+    uint32_t const home = (uint32_t) ((key * 0x9E3779B97F4A7C15ull) >> 32) & (TEXT_CACHE_SLOTS - 1);
+
+    TextEntry *entry = NULL;
+    for (uint32_t i = 0; i < TEXT_CACHE_WAYS; i++) {
+        TextEntry *const e = &cache->entries[(home + i) & (TEXT_CACHE_SLOTS - 1)];
+        if (e->font_size != 0 && e->key == key) {
+            entry = e;
+            break;
+        }
+        if (e->font_size == 0 && entry == NULL)
+            entry = e;
+    }
+    if (entry == NULL)
+        entry = &cache->entries[home];
+
+    *fresh = entry->font_size == font_size && entry->key == key && entry->inputs == inputs;
+    if (!*fresh) {
+        entry->key = key;
+        entry->inputs = inputs;
+        entry->font_size = font_size;
+    }
+    return entry;
+}
+
+void text_cache_format(TextEntry *const entry, char const *const format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->text, sizeof entry->text, format, args);
+    va_end(args);
+
+    entry->size = MeasureTextEx(GetFontDefault(), entry->text, entry->font_size, 0);
+}
+
+bool text_cache_draw_label(TextCache const *const cache, uint64_t const key, int const x, int const y) {
+    for (int i = 0; i < cache->label_count; i++) {
+        TextLabel const *const label = &cache->labels[i];
+        if (label->key != key) continue;
+
+        // Render textures are stored upside down.
+        Rectangle const source = {0, 0, label->width, -label->height};
+        DrawTextureRec(label->target.texture, source, (Vector2) {x, y}, WHITE);
+        return true;
+    }
+    return false;
+}
+
+void text_cache_bake_label(TextCache *const cache, uint64_t const key, char const *const text, int const x, int const y, int const font_size, Color const color) {
+    if (cache->label_count == TEXT_CACHE_LABELS) {
+        DrawText(text, x, y, font_size, color);
+        return;
+    }
+
+    TextLabel *const label = &cache->labels[cache->label_count++];
+    label->key = key;
+    label->width = MeasureText(text, font_size);
+    label->height = font_size;
+    label->target = LoadRenderTexture(label->width, label->height);
+
+    BeginTextureMode(label->target);
+    ClearBackground(BLANK);
+    DrawText(text, 0, 0, font_size, color);
+    EndTextureMode();
+
+    text_cache_draw_label(cache, key, x, y);
+}
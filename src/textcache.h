@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "raylib.h"
+
+#define TEXT_CACHE_SLOTS (1024) // power of two
+#define TEXT_CACHE_LABELS (16)
+#define TEXT_CACHE_LENGTH (64)  // bytes per text, including the terminator
+
+// Builds a cache key from a kind of text and something that tells apart texts of that kind, e.g. a player id.
+#define TEXT_KEY(kind, id) ((uint64_t) (kind) << 32 | (uint32_t) (id))
+
+// Formatted and measured text, kept until the values it was formatted from change.
+typedef struct {
+    uint64_t key;
+    uint64_t inputs;  // whatever the caller formatted the text from, packed into 64 bits
+    int font_size;    // 0 while the slot is unused
+    Vector2 size;     // `MeasureTextEx` with the default font and no spacing
+    char text[TEXT_CACHE_LENGTH];
+} TextEntry;
+
+// Text that never changes, rendered once into a texture.
+typedef struct {
+    uint64_t key;
+    RenderTexture2D target;
+    int width;
+    int height;
+} TextLabel;
+
+typedef struct {
+    TextEntry *entries; // `TEXT_CACHE_SLOTS` entries
+    TextLabel labels[TEXT_CACHE_LABELS];
+    int label_count;
+} TextCache;
+
+bool text_cache_init(TextCache *cache);
+
+// Unloads the label textures, so it must be called before the window is closed.
+void text_cache_close(TextCache *cache);
+
+// Returns the entry for `key` and sets `fresh` if it still holds text made from `inputs` at `font_size`.
+// Otherwise the entry is taken over for `key` and must be filled with `text_cache_format` before it is used.
+// Each key can go in one of a few slots, when they are all taken by other keys the first one is taken over,
+// so the entry is only valid until the next call.
+TextEntry *text_cache_find(TextCache *cache, uint64_t key, uint64_t inputs, int font_size, bool *fresh);
+
+// Formats the text of `entry` and measures it.
+void text_cache_format(TextEntry *entry, char const *format, ...);
+
+// Draws the label baked for `key`, returns false if there is none yet.
+bool text_cache_draw_label(TextCache const *cache, uint64_t key, int x, int y);
+
+// Renders `text` into a texture kept for `key` and draws it.
+// Once every label is taken the text is drawn directly instead.
+void text_cache_bake_label(TextCache *cache, uint64_t key, char const *text, int x, int y, int font_size, Color color);
@@ -0,0 +1,207 @@
+#ifdef _WIN64
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#elif defined(_WIN64)
+#include <process.h>
+#define getpid _getpid
+#endif
+
+#include "./trace.h"
+#include "./util.h"
+#include "./os/threads.h"
+#include "./os/random.h"
+
+#define TRACE_EVENTS (1 << 16) // power of two, the oldest stamps are overwritten
+
+typedef struct {
+    long long at; // microseconds
+    uint32_t trace;
+    uint8_t stage;
+} TraceEvent;
+
+static char const *const stage_names[TRACE_STAGES] = {
+    [TRACE_INPUT]          = "input",
+    [TRACE_CLIENT_SEND]    = "client send",
+    [TRACE_SERVER_RECEIVE] = "server receive",
+    [TRACE_SERVER_SEND]    = "server send",
+    [TRACE_CLIENT_RECEIVE] = "client receive",
+    [TRACE_RENDER]         = "render",
+};
+
+// The stages each stage follows. Drawing follows the client receiving the echo, or the server receiving the input when hosting.
+static unsigned const follows[TRACE_STAGES] = {
+    [TRACE_INPUT]          = 0,
+    [TRACE_CLIENT_SEND]    = 1 << TRACE_INPUT,
+    [TRACE_SERVER_RECEIVE] = 1 << TRACE_CLIENT_SEND,
+    [TRACE_SERVER_SEND]    = 1 << TRACE_SERVER_RECEIVE,
+    [TRACE_CLIENT_RECEIVE] = 1 << TRACE_SERVER_SEND,
+    [TRACE_RENDER]         = 1 << TRACE_CLIENT_RECEIVE | 1 << TRACE_SERVER_RECEIVE,
+};
+
+static TraceEvent *events = NULL; // `TRACE_EVENTS` entries while recording
+static _Atomic size_t next_event;
+static _Atomic uint32_t next_trace;
+static char *trace_path = NULL;
+
+bool trace_start(char const *const path) {
+    if (events != NULL) return false;
+
+    // Ids start somewhere random, so traces from different processes don't collide at the server.
+    uint32_t first;
+    if (!random_fill(&first, sizeof first))
+        first = 1;
+
+    trace_path = malloc(strlen(path) + 1);
+    strcpy(trace_path, path);
+    atomic_init(&next_event, 0);
+    atomic_init(&next_trace, first);
+    events = calloc(TRACE_EVENTS, sizeof (TraceEvent));
+    return events != NULL;
+}
+
+uint32_t trace_begin(void) {
+    if (events == NULL) return 0;
+
+    uint32_t trace;
+    do trace = atomic_fetch_add_explicit(&next_trace, 1, memory_order_relaxed);
+    while (trace == 0);
+
+    trace_mark(trace, TRACE_INPUT);
+    return trace;
+}
+
+void trace_mark(uint32_t const trace, TraceStage const stage) {
+    if (trace == 0 || events == NULL) return;
+
+    long long at;
+    if (!time_get_monotonic_us(&at))
+        EXIT_PRINT("Failed to get time: %s", threads_get_error());
+
+    size_t const i = atomic_fetch_add_explicit(&next_event, 1, memory_order_relaxed) & (TRACE_EVENTS - 1);
+    events[i] = (TraceEvent) {.at = at, .trace = trace, .stage = stage};
+}
+
+// By trace, then by time.
+static int compare_events(void const *const a, void const *const b) {
+    TraceEvent const *const x = a;
+    TraceEvent const *const y = b;
+    if (x->trace != y->trace) return x->trace < y->trace ? -1 : 1;
+    if (x->at != y->at) return x->at < y->at ? -1 : 1;
+    return (int) x->stage - (int) y->stage;
+}
+
+typedef struct {
+    long count;
+    long long total; // microseconds
+    long long max;   // microseconds
+} StageStats;
+
+static void stats_add(StageStats *const s, long long const duration) {
+    s->count++;
+    s->total += duration;
+    if (duration > s->max) s->max = duration;
+}
+
+static void stats_print(char const *const from, char const *const to, char const *const note, StageStats const *const s) {
+    if (s->count == 0) return;
+    printf(
+        "trace: %s -> %s%s: %ld samples, avg %.2f ms, max %.2f ms\n",
+        from, to, note, s->count, (double) s->total / s->count / 1000.0, (double) s->max / 1000.0
+    );
+}
+
+// Returns the index of the stamp that `events[i]` follows, or `i` if there is none.
+// `events` must be sorted.
+static size_t find_previous(size_t const i) {
+    for (size_t j = i; j-- > 0 && events[j].trace == events[i].trace;) {
+        if (follows[events[i].stage] & 1u << events[j].stage)
+            return j;
+    }
+    return i;
+}
+
+// Every stamp becomes an instant event, and the time since the stamp it follows becomes a slice on the stage's row,
+// so each row shows how long inputs waited to reach that stage.
+void trace_stop(void) {
+    if (events == NULL) return;
+
+    size_t const stamped = atomic_load(&next_event);
+    size_t const count = stamped < TRACE_EVENTS ? stamped : TRACE_EVENTS;
+    qsort(events, count, sizeof (TraceEvent), compare_events);
+
+    FILE *const file = fopen(trace_path, "w");
+    if (file == NULL) {
+        printf("Failed to open trace file %s\n", trace_path);
+    }
+    else {
+        int const pid = (int) getpid();
+
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for (int stage = 0; stage < TRACE_STAGES; stage++) {
+            fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", pid, stage, stage_names[stage]);
+            fprintf(file, "{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"sort_index\":%d}},\n", pid, stage, stage);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            TraceEvent const *const e = &events[i];
+
+            fprintf(
+                file, "{\"name\":\"%s\",\"cat\":\"trace\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"args\":{\"trace\":%u}},\n",
+                stage_names[e->stage], pid, e->stage, e->at, e->trace
+            );
+
+            size_t const j = find_previous(i);
+            if (j != i) {
+                fprintf(
+                    file, "{\"name\":\"%s -> %s\",\"cat\":\"latency\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"args\":{\"trace\":%u}},\n",
+                    stage_names[events[j].stage], stage_names[e->stage], pid, e->stage, events[j].at, e->at - events[j].at, e->trace
+                );
+            }
+        }
+
+        // The metadata above ends with a comma, so close the array with one more.
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"game %d\"}}\n]}\n", pid, pid);
+        fclose(file);
+        printf("trace written to %s (%zu stamps)\n", trace_path, count);
+    }
+
+    /* Summary */ {
+        StageStats stages[TRACE_STAGES][TRACE_STAGES] = {0}; // [from][to]
+        StageStats total = {0};
+
+        for (size_t i = 0; i < count; i++) {
+            TraceEvent const *const e = &events[i];
+            size_t const j = find_previous(i);
+            if (j != i)
+                stats_add(&stages[events[j].stage][e->stage], e->at - events[j].at);
+
+            // Input to the first frame drawn after the server echoed it, both on the same client.
+            if (e->stage == TRACE_RENDER && j != i && events[j].stage == TRACE_CLIENT_RECEIVE) {
+                for (size_t k = j; k-- > 0 && events[k].trace == e->trace;) {
+                    if (events[k].stage == TRACE_INPUT) {
+                        stats_add(&total, e->at - events[k].at);
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (int from = 0; from < TRACE_STAGES; from++)
+            for (int to = 0; to < TRACE_STAGES; to++)
+                stats_print(stage_names[from], stage_names[to], "", &stages[from][to]);
+        stats_print(stage_names[TRACE_INPUT], stage_names[TRACE_RENDER], " (end to end)", &total);
+    }
+
+    free(events);
+    free(trace_path);
+    events = NULL;
+    trace_path = NULL;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Latency tracing along the input path:
+// keypress, client send, server receive, server send, client receive and the first frame drawn after it.
+// A trace id travels with the input in the packet headers and every stage stamps it with the time,
+// into a fixed ring buffer that is written out as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) when tracing stops.
+// With tracing off every id is 0 and stamping it does nothing.
+
+typedef enum {
+    TRACE_INPUT,
+    TRACE_CLIENT_SEND,
+    TRACE_SERVER_RECEIVE,
+    TRACE_SERVER_SEND,
+    TRACE_CLIENT_RECEIVE,
+    TRACE_RENDER,
+    TRACE_STAGES,
+} TraceStage;
+
+// Starts recording, the trace is written to `path` by `trace_stop`.
+bool trace_start(char const *path);
+
+// Writes the trace, prints the average time spent between stages and stops recording.
+void trace_stop(void);
+
+// Returns a new trace id stamped with `TRACE_INPUT`, or 0 while not recording.
+uint32_t trace_begin(void);
+
+// Stamps `trace` with the current time for `stage`. Safe to call from any thread.
+void trace_mark(uint32_t trace, TraceStage stage);